@@ -15,28 +15,340 @@
  */
 
 #include <string>
-#include <utility> // for std::initializer_list()
+#include <sstream>
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <mutex>
+#include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
+#ifdef IMTOOLS_HAVE_LIBWEBP
+# include <cstdlib>
+# include <webp/encode.h>
+#endif
+#ifdef IMTOOLS_HAVE_ZLIB
+# include "pngwriter.hxx"
+#endif
 
+#include "imtools.hxx"
 #include "imtools-types.hxx"
 #include "threads.hxx"
+#include "exceptions.hxx"
+#include "log.hxx"
 #include "Command.hxx"
 
 using imtools::Command;
+using imtools::CommandFactory;
+using imtools::EncoderProfile;
+using imtools::ErrorException;
+using imtools::FileWriteErrorException;
+
+typedef std::chrono::steady_clock Clock;
+
+/////////////////////////////////////////////////////////////////////
+
+EncoderProfile Command::s_encoder_profile;
+std::atomic<uint64_t> Command::s_encode_count{0};
+std::atomic<uint64_t> Command::s_encode_usec{0};
+std::atomic<uint64_t> Command::s_encode_bytes{0};
+
+/// Serializes the calls of the output callbacks made from the encoding threads
+static std::mutex g_output_lock;
+/// Serializes event callbacks invoked from the threads of a command
+static std::mutex g_event_lock;
 
 /////////////////////////////////////////////////////////////////////
 
-Command::CompressionParams Command::s_compression_params(std::initializer_list<int> {
-    CV_IMWRITE_PNG_STRATEGY, cv::IMWRITE_PNG_STRATEGY_FILTERED,
-    CV_IMWRITE_PNG_COMPRESSION, 9, // 0 - none, 9 - full
-    CV_IMWRITE_JPEG_QUALITY, 90});
+#ifdef IMTOOLS_HAVE_LIBWEBP
+/*! Encodes 8-bit 1, 3, or 4-channel `img` to WebP by means of libwebp. Unlike
+ * the OpenCV encoder, it supports the compression method setting.
+ * \returns false on error */
+static bool
+_encode_webp(std::vector<unsigned char>& buf, const cv::Mat& img, const EncoderProfile& profile)
+{
+  cv::Mat src;
+
+  if (img.depth() != CV_8U) {
+    return false;
+  }
+  switch (img.channels()) {
+    case 1: cv::cvtColor(img, src, CV_GRAY2BGR); break;
+    case 3: // no break
+    case 4: src = img; break;
+    default: return false;
+  }
+
+  WebPConfig config;
+  if (!WebPConfigInit(&config)) {
+    return false;
+  }
+  config.lossless = profile.webp_lossless;
+  config.quality  = profile.webp_quality;
+  config.method   = profile.webp_method;
+  if (!WebPValidateConfig(&config)) {
+    return false;
+  }
+
+  WebPPicture pic;
+  if (!WebPPictureInit(&pic)) {
+    return false;
+  }
+  pic.width    = src.cols;
+  pic.height   = src.rows;
+  pic.use_argb = config.lossless;
+
+  int stride = static_cast<int>(src.step);
+  if (!(src.channels() == 3
+        ? WebPPictureImportBGR(&pic, src.data, stride)
+        : WebPPictureImportBGRA(&pic, src.data, stride)))
+  {
+    WebPPictureFree(&pic);
+    return false;
+  }
+
+  WebPMemoryWriter writer;
+  WebPMemoryWriterInit(&writer);
+  pic.writer     = WebPMemoryWrite;
+  pic.custom_ptr = &writer;
+
+  bool success = WebPEncode(&config, &pic);
+  if (success) {
+    buf.assign(writer.mem, writer.mem + writer.size);
+  } else {
+    warning_log("WebPEncode failed with error code %d", pic.error_code);
+  }
+  WebPPictureFree(&pic);
+#if WEBP_ENCODER_ABI_VERSION >= 0x0203
+  WebPMemoryWriterClear(&writer);
+#else
+  free(writer.mem);
+#endif
+
+  return success;
+}
+#endif // IMTOOLS_HAVE_LIBWEBP
+
+
+/// \returns `value` as integer within [`min`, `max`]
+/// \throws ErrorException
+static int
+_parse_int(const std::string& key, const std::string& value, int min, int max)
+{
+  int i;
+
+  try {
+    i = std::stoi(value);
+  } catch (std::exception& e) {
+    throw ErrorException("Invalid %s: '%s'", key.c_str(), value.c_str());
+  }
+  if (i < min || i > max) {
+    throw ErrorException("%s is out of range [%d, %d]: %d", key.c_str(), min, max, i);
+  }
+
+  return i;
+}
+
+
+EncoderProfile::EncoderProfile() noexcept
+  : png_level(9),
+  png_strategy(cv::IMWRITE_PNG_STRATEGY_FILTERED),
+  png_parallel(false),
+  jpeg_quality(90),
+  jpeg_progressive(false),
+  jpeg_optimize(false),
+  jpeg_restart(true),
+  webp_quality(80),
+  webp_lossless(false),
+  webp_method(4)
+{
+}
+
+
+EncoderProfile
+EncoderProfile::get(const std::string& name)
+{
+  EncoderProfile profile;
+
+  profile.png_parallel = true;
+
+  if (name == "fastest") {
+    // zlib level 1 is several times faster than level 9 on photos, while
+    // the output is usually only 10-20% larger
+    profile.png_level        = 1;
+    profile.png_strategy     = cv::IMWRITE_PNG_STRATEGY_DEFAULT;
+    profile.webp_method      = 1;
+  } else if (name == "balanced") {
+    profile.png_level        = 6;
+    profile.jpeg_optimize    = true;
+    profile.webp_method      = 4;
+  } else if (name == "smallest") {
+    profile.png_level        = 9;
+    profile.jpeg_optimize    = true;
+    profile.jpeg_progressive = true;
+    profile.webp_method      = 6;
+  } else {
+    throw ErrorException("Unknown encoder profile: '%s'", name.c_str());
+  }
+
+  return profile;
+}
+
+
+EncoderProfile
+CommandFactory::getEncoderProfile(const Command::Arguments& arguments)
+{
+  EncoderProfile profile = Command::getDefaultEncoderProfile();
+
+  for (auto& it : arguments) {
+    if (it.first == "encoder" && it.second->getType() == Command::Value::Type::STRING) {
+      profile.set(it.first, it.second->getString());
+    }
+  }
+
+  return profile;
+}
+
+
+bool
+EncoderProfile::set(const std::string& key, const std::string& value)
+{
+  if (key == "encoder") {
+    // The format is not a part of the profiles
+    std::string f(format);
+    *this = get(value);
+    format = f;
+  } else if (key == "format") {
+    std::string f(value[0] == '.' ? value.substr(1) : value);
+    std::transform(f.begin(), f.end(), f.begin(), ::tolower);
+    if (f.empty() || std::find_if_not(f.begin(), f.end(), ::isalnum) != f.end()) {
+      throw ErrorException("Invalid format: '%s'", value.c_str());
+    }
+    format = f;
+  } else if (key == "png_level") {
+    png_level = _parse_int(key, value, 0, 9);
+  } else if (key == "png_strategy") {
+    if      (value == "default")  png_strategy = cv::IMWRITE_PNG_STRATEGY_DEFAULT;
+    else if (value == "filtered") png_strategy = cv::IMWRITE_PNG_STRATEGY_FILTERED;
+    else if (value == "huffman")  png_strategy = cv::IMWRITE_PNG_STRATEGY_HUFFMAN_ONLY;
+    else if (value == "rle")      png_strategy = cv::IMWRITE_PNG_STRATEGY_RLE;
+    else if (value == "fixed")    png_strategy = cv::IMWRITE_PNG_STRATEGY_FIXED;
+    else {
+      throw ErrorException("Invalid png_strategy: '%s'", value.c_str());
+    }
+  } else if (key == "png_parallel") {
+    png_parallel = _parse_int(key, value, 0, 1);
+  } else if (key == "jpeg_quality") {
+    jpeg_quality = _parse_int(key, value, 0, 100);
+  } else if (key == "jpeg_progressive") {
+    jpeg_progressive = _parse_int(key, value, 0, 1);
+  } else if (key == "jpeg_optimize") {
+    jpeg_optimize = _parse_int(key, value, 0, 1);
+  } else if (key == "jpeg_restart") {
+    jpeg_restart = _parse_int(key, value, 0, 1);
+  } else if (key == "webp_quality") {
+    webp_quality = _parse_int(key, value, 0, 100);
+  } else if (key == "webp_lossless") {
+    webp_lossless = _parse_int(key, value, 0, 1);
+  } else if (key == "webp_method") {
+    webp_method = _parse_int(key, value, 0, 6);
+  } else {
+    return false;
+  }
+
+  return true;
+}
+
+
+EncoderProfile::Params
+EncoderProfile::getParams() const
+{
+  Params params {
+    CV_IMWRITE_PNG_STRATEGY, png_strategy,
+    CV_IMWRITE_PNG_COMPRESSION, png_level,
+    CV_IMWRITE_JPEG_QUALITY, jpeg_quality,
+    // OpenCV writes lossless WebP, if the quality is above 100
+    CV_IMWRITE_WEBP_QUALITY, webp_lossless ? 101 : std::max(webp_quality, 1)
+  };
+
+#if CV_MAJOR_VERSION >= 3
+  if (jpeg_progressive) {
+    params.push_back(cv::IMWRITE_JPEG_PROGRESSIVE);
+    params.push_back(1);
+  }
+  if (jpeg_optimize) {
+    params.push_back(cv::IMWRITE_JPEG_OPTIMIZE);
+    params.push_back(1);
+  }
+#endif
+
+  return params;
+}
+
+
+EncoderProfile::Params
+EncoderProfile::getParams(const cv::Mat& img) const
+{
+  Params params = getParams();
+
+#if CV_MAJOR_VERSION > 3 || (CV_MAJOR_VERSION == 3 && CV_MINOR_VERSION >= 1)
+  // Progressive JPEG can't be decoded in parts anyway
+  if (jpeg_restart && !jpeg_progressive) {
+    // OpenCV writes color JPEG with 4:2:0 subsampling, i.e. 16x16 MCUs
+    const int mcu_width = img.channels() == 1 ? 8 : 16;
+    params.push_back(cv::IMWRITE_JPEG_RST_INTERVAL);
+    params.push_back(std::min(65535, (img.cols + mcu_width - 1) / mcu_width));
+  }
+#else
+  (void) img;
+#endif
+
+  return params;
+}
+
+
+std::string
+EncoderProfile::toString() const
+{
+  std::stringstream ss;
+
+  ss << "png_level=" << png_level
+    << " png_strategy=" << png_strategy
+    << " png_parallel=" << png_parallel
+    << " jpeg_quality=" << jpeg_quality
+    << " jpeg_progressive=" << jpeg_progressive
+    << " jpeg_optimize=" << jpeg_optimize
+    << " jpeg_restart=" << jpeg_restart
+    << " webp_quality=" << webp_quality
+    << " webp_lossless=" << webp_lossless
+    << " webp_method=" << webp_method;
+  if (!format.empty()) {
+    ss << " format=" << format;
+  }
+
+  return ss.str();
+}
+
+std::string
+EncoderProfile::getFileExt(const std::string& filename) const
+{
+  if (!format.empty()) {
+    return '.' + format;
+  }
+
+  std::string ext(imtools::get_file_ext(filename));
+  if (ext.empty() && imtools::is_stdio(filename)) {
+    ext = ".png";
+  }
+
+  return ext;
+}
 
 /////////////////////////////////////////////////////////////////////
 
 void
 Command::invokeEventCallback(const std::string& message) const noexcept
 {
-  IT_IO_SCOPED_LOCK(_cmd_event_lock);
+  std::lock_guard<std::mutex> lock(g_event_lock);
 
   if (m_event_callback != nullptr) {
     CommandResult result(message);
@@ -45,6 +357,101 @@ Command::invokeEventCallback(const std::string& message) const noexcept
 }
 
 
+void
+Command::writeImage(const std::string& filename, const cv::Mat& img) const
+{
+  // Reused by the subsequent images encoded on this thread
+  static thread_local std::vector<unsigned char> buf;
+  uint64_t usec;
+
+  if (!_encode(buf, m_encoder_profile.getFileExt(filename), img, usec)) {
+    throw FileWriteErrorException(filename);
+  }
+  writeOutput(filename, buf);
+
+  char msg[64];
+  snprintf(msg, sizeof(msg), ": %lu bytes, %.3f msec",
+      static_cast<unsigned long>(buf.size()), usec / 1000.);
+  verbose_log("Encoded %s%s", filename.c_str(), msg);
+  invokeEventCallback(filename + msg);
+}
+
+
+void
+Command::writeOutput(const std::string& filename, const std::vector<unsigned char>& data) const
+{
+  if (m_output_callback == nullptr) {
+    imtools::write_file(filename, data.data(), data.size());
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(g_output_lock);
+  try {
+    m_output_callback(filename, data);
+  } catch (std::exception& e) {
+    error_log("Failed to pass output %s: %s", filename.c_str(), e.what());
+    throw FileWriteErrorException(filename);
+  }
+}
+
+
+bool
+Command::encodeImage(std::vector<unsigned char>& buf, const std::string& ext, const cv::Mat& img) const
+{
+  uint64_t usec;
+
+  if (!_encode(buf, ext, img, usec)) {
+    return false;
+  }
+  verbose_log("Encoded %s image: %lu bytes, %.3f msec",
+      ext.c_str(), static_cast<unsigned long>(buf.size()), usec / 1000.);
+
+  return true;
+}
+
+
+bool
+Command::_encode(std::vector<unsigned char>& buf, const std::string& ext, const cv::Mat& img, uint64_t& usec) const
+{
+  auto start = Clock::now();
+  bool success;
+
+#ifdef IMTOOLS_HAVE_LIBWEBP
+  if (ext == ".webp") {
+    success = _encode_webp(buf, img, m_encoder_profile);
+  } else
+#endif
+#ifdef IMTOOLS_HAVE_ZLIB
+  if (ext == ".png" && m_encoder_profile.png_parallel
+      && encode_png(buf, img, m_encoder_profile.png_level, m_encoder_profile.png_strategy))
+  {
+    // The image type may be unsupported, then OpenCV encoder is used
+    success = true;
+  } else
+#endif
+  {
+    success = cv::imencode(ext, img, buf, m_encoder_profile.getParams(img));
+  }
+  if (!success) {
+    return false;
+  }
+
+  usec = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+  s_encode_count += 1;
+  s_encode_usec += usec;
+  s_encode_bytes += buf.size();
+
+  return true;
+}
+
+
+Command::EncodeStats
+Command::getEncodeStats() noexcept
+{
+  return EncodeStats{s_encode_count.load(), s_encode_usec.load(), s_encode_bytes.load()};
+}
+
+
 Command::Type
 Command::getType(const std::string& c)
 {
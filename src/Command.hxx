@@ -22,14 +22,86 @@
 #include <utility> // for std::pair
 #include <vector>
 #include <memory>
+#include <atomic>
+#include <cstdint>
 #include <boost/algorithm/string/trim.hpp>
 #include "imtools-types.hxx"
+#include "opencv-fwd.hxx"
 
 
 namespace imtools {
 
 class CommandResult;
 
+/////////////////////////////////////////////////////////////////////
+/// Encoder settings trading the encoding speed against the output size
+class EncoderProfile
+{
+  public:
+    typedef std::vector<int> Params;
+
+    /// The built-in settings: PNG level 9 with filtered strategy, JPEG quality 90 with restart markers
+    EncoderProfile() noexcept;
+
+    /*! \returns profile by `name`:
+     * - `fastest`  - PNG level 1, baseline JPEG, WebP method 1
+     * - `balanced` - PNG level 6, optimized JPEG, WebP method 4
+     * - `smallest` - PNG level 9, optimized progressive JPEG, WebP method 6
+     * The JPEG and WebP quality is the same in all of the profiles. All of
+     * the profiles use the parallel PNG encoder, if available.
+     * \throws ErrorException
+     */
+    static EncoderProfile get(const std::string& name);
+
+    /*! Overrides a single setting. `key` is one of `encoder` (profile name),
+     * `png_level`, `png_strategy` (default, filtered, huffman, rle, fixed), `png_parallel`,
+     * `jpeg_quality`, `jpeg_progressive`, `jpeg_optimize`, `jpeg_restart`, `webp_quality`,
+     * `webp_lossless`, `webp_method`, `format`.
+     * \returns false, if `key` is not an encoder setting
+     * \throws ErrorException, if `value` is invalid
+     */
+    bool set(const std::string& key, const std::string& value);
+
+    /// \returns parameters for `cv::imwrite()`
+    Params getParams() const;
+    /// \returns parameters for `cv::imwrite()` of `img` (the JPEG restart interval depends on the width)
+    Params getParams(const cv::Mat& img) const;
+
+    /// \returns string representation of the settings
+    std::string toString() const;
+
+    /// \returns extension (including the dot) specifying the format in which an image
+    /// written to `filename` is encoded
+    std::string getFileExt(const std::string& filename) const;
+
+  public:
+    /// PNG (zlib) compression level: 0 - none, 9 - full
+    int png_level;
+    /// PNG (zlib) compression strategy
+    int png_strategy;
+    /// Whether to encode PNG with `imtools::encode_png()` rather than OpenCV
+    bool png_parallel;
+    /// JPEG quality: 0 - 100
+    int jpeg_quality;
+    /// Whether to write progressive JPEG
+    bool jpeg_progressive;
+    /// Whether to optimize JPEG Huffman tables
+    bool jpeg_optimize;
+    /// Whether to write a JPEG restart marker at the start of each MCU row
+    /// (allows `imtools::read_jpeg()` to decode the image on multiple threads)
+    bool jpeg_restart;
+    /// WebP quality: 0 - 100 (for lossless, the compression effort)
+    int webp_quality;
+    /// Whether to write lossless WebP
+    bool webp_lossless;
+    /// WebP compression method: 0 - fastest, 6 - slowest (requires libwebp)
+    int webp_method;
+    /// Output format as a file extension without the dot, e.g. `jpg` (empty - by the
+    /// extension of the output filename; PNG for stdout)
+    std::string format;
+};
+
+
 /////////////////////////////////////////////////////////////////////
 /// Base class for API command classes
 class Command
@@ -137,8 +209,10 @@ class Command
     typedef const std::shared_ptr<const Value> CValuePtr;
     typedef std::pair<std::string, CValuePtr> ArgumentItem;
     typedef std::vector<ArgumentItem> Arguments;
-    typedef std::vector<int> CompressionParams;
+    typedef EncoderProfile::Params CompressionParams;
     typedef std::function<void(const CommandResult& r)> EventCallback;
+    /// Receives an encoded output image: the output filename and the data
+    typedef std::function<void(const std::string& output, const std::vector<unsigned char>& data)> OutputCallback;
 
     /// Command type
     enum class Type
@@ -156,8 +230,18 @@ class Command
 #endif
     };
 
+    /// Encoder statistics
+    struct EncodeStats {
+      /// Number of encoded images
+      uint64_t count;
+      /// Total encoding time in microseconds
+      uint64_t usec;
+      /// Total size of the encoded images in bytes
+      uint64_t bytes;
+    };
+
     ///////////////////////////////////////////////////////////////
-    Command() : m_allow_absolute_paths(true) {}
+    Command() : m_allow_absolute_paths(true), m_encoder_profile(s_encoder_profile) {}
     Command(const Command&) = delete;
     Command(const Command&&) = delete;
 
@@ -171,14 +255,34 @@ class Command
     /// \returns numeric representation of command name for comparisions.
     static Type getType(const std::string& c);
 
-    static inline const CompressionParams getCompressionParams() noexcept
+    /// Sets the encoder profile of the commands created afterwards
+    static inline void setDefaultEncoderProfile(const EncoderProfile& profile) noexcept
     {
-      return s_compression_params;
+      s_encoder_profile = profile;
+    }
+
+    static inline const EncoderProfile& getDefaultEncoderProfile() noexcept
+    {
+      return s_encoder_profile;
+    }
+
+    static EncodeStats getEncodeStats() noexcept;
+
+    virtual inline void setEncoderProfile(const EncoderProfile& profile) noexcept
+    {
+      m_encoder_profile = profile;
+    }
+
+    inline const EncoderProfile& getEncoderProfile() const noexcept { return m_encoder_profile; }
+
+    inline const CompressionParams getCompressionParams() const noexcept
+    {
+      return m_encoder_profile.getParams();
     }
 
     virtual inline void setAllowAbsolutePaths(bool v) noexcept { m_allow_absolute_paths = v; }
 
-    virtual inline std::string trimPath(const std::string& path) noexcept
+    virtual inline std::string trimPath(const std::string& path) const noexcept
     {
       return m_allow_absolute_paths
         ? path
@@ -187,16 +291,47 @@ class Command
 
     virtual inline void setEventCallback(const EventCallback& cb) noexcept {m_event_callback = cb;};
 
+    /*! Makes the command pass the encoded output images to `cb` instead of writing them
+     * to files. The output filenames only name the outputs and select the formats then.
+     * The data is valid during the call only. */
+    virtual inline void setOutputCallback(const OutputCallback& cb) noexcept { m_output_callback = cb; }
+    inline bool hasOutputCallback() const noexcept { return m_output_callback != nullptr; }
+
   protected:
     virtual void invokeEventCallback(const std::string& message) const noexcept;
 
+    /*! Encodes `img` with the encoder profile of the command and writes it to `filename`
+     * (see `writeOutput()`). The output size and encoding time are reported via the event callback.
+     * \throws FileWriteErrorException */
+    void writeImage(const std::string& filename, const cv::Mat& img) const;
+
+    /*! Writes encoded image `data` to `filename`, or passes it to the output callback, if set.
+     * \throws FileWriteErrorException */
+    void writeOutput(const std::string& filename, const std::vector<unsigned char>& data) const;
+
+    /*! Encodes `img` into `buf` in the format specified by file extension `ext`
+     * (e.g. ".png") with the encoder profile of the command.
+     * \returns false on error */
+    bool encodeImage(std::vector<unsigned char>& buf, const std::string& ext, const cv::Mat& img) const;
+
+    /*! Encodes `img` into `buf` in the format specified by `ext`.
+     * \param usec Encoding time in microseconds
+     * \returns false on error */
+    bool _encode(std::vector<unsigned char>& buf, const std::string& ext, const cv::Mat& img, uint64_t& usec) const;
+
   protected:
-    /// Format-specific save parameters for `cv::imwrite()`.
-    static CompressionParams s_compression_params;
+    /// Encoder profile for the commands created afterwards
+    static EncoderProfile s_encoder_profile;
+    static std::atomic<uint64_t> s_encode_count;
+    static std::atomic<uint64_t> s_encode_usec;
+    static std::atomic<uint64_t> s_encode_bytes;
     /// Whether to allow absolute path processing
     bool m_allow_absolute_paths = true;
     const char* PATH_DELIMS = " \t\r\n/";
     EventCallback m_event_callback{nullptr};
+    OutputCallback m_output_callback{nullptr};
+    /// Encoder settings
+    EncoderProfile m_encoder_profile;
 };
 
 
@@ -213,6 +348,12 @@ class CommandFactory
     /// \param o option name
     /// \returns numeric representation of option name for comparisions.
     virtual int getOptionCode(const std::string& o) const = 0;
+
+    /*! \returns the default encoder profile, or the one named by the `encoder` argument.
+     * The rest of the encoder settings in `arguments` are to be applied on top of it
+     * (skipping `encoder`), so they override the profile regardless of the key order.
+     * \throws ErrorException */
+    static EncoderProfile getEncoderProfile(const Command::Arguments& arguments);
 };
 
 
@@ -19,7 +19,9 @@
  * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
  */
 #include "MetaCommand.hxx"
+#include <cinttypes>
 #include "imtools-meta.hxx"
+#include "imresize-api.hxx"
 #include "log.hxx"
 #include "exceptions.hxx"
 
@@ -28,6 +30,8 @@ using imtools::MetaCommandFactory;
 using imtools::CommandResult;
 using imtools::ErrorException;
 
+MetaCommand::StatsProvider MetaCommand::s_stats_provider;
+
 /////////////////////////////////////////////////////////////////////
 
 void
@@ -48,6 +52,9 @@ MetaCommand::run(CommandResult& result)
             IMTOOLS_COPYRIGHT "\n"
             IMTOOLS_FEATURES));
       break;
+    case SubCommand::STATS:
+      result.setValue(_getStats());
+      break;
     case SubCommand::UNKNOWN:
     default:
       throw ErrorException("Unknown command %s", m_subcommand);
@@ -63,6 +70,7 @@ MetaCommand::_getName(const MetaCommand::SubCommand& code) const
     case SubCommand::COPYRIGHT: return "copyright";
     case SubCommand::FEATURES: return "features";
     case SubCommand::ALL: return "all";
+    case SubCommand::STATS: return "stats";
     case SubCommand::UNKNOWN:
     default:
       return "unknown";
@@ -70,6 +78,43 @@ MetaCommand::_getName(const MetaCommand::SubCommand& code) const
 }
 
 
+std::string
+MetaCommand::_getStats() const
+{
+  std::string result;
+  char buf[256];
+
+  auto encode_stats = Command::getEncodeStats();
+  snprintf(buf, sizeof(buf),
+      "encode_count: %" PRIu64 "\n"
+      "encode_usec: %" PRIu64 "\n"
+      "encode_bytes: %" PRIu64 "\n",
+      encode_stats.count, encode_stats.usec, encode_stats.bytes);
+  result += buf;
+
+  const auto& cache = imtools::imresize::ResizeCommand::getCache();
+  if (cache) {
+    auto stats = cache->getStats();
+    snprintf(buf, sizeof(buf),
+        "resize_cache: on\n"
+        "resize_cache_hits: %" PRIu64 "\n"
+        "resize_cache_misses: %" PRIu64 "\n"
+        "resize_cache_evictions: %" PRIu64 "\n"
+        "resize_cache_size: %" PRIu64 "\n",
+        stats.hits, stats.misses, stats.evictions, stats.size);
+    result += buf;
+  } else {
+    result += "resize_cache: off\n";
+  }
+
+  if (s_stats_provider) {
+    result += s_stats_provider();
+  }
+
+  return result;
+}
+
+
 std::string
 MetaCommand::serialize() const noexcept
 {
@@ -95,6 +140,9 @@ MetaCommand::getSubCommandCode(const std::string& name) noexcept
     case 'a':
       code = name == "all" ? SubCommand::ALL : SubCommand::UNKNOWN;
       break;
+    case 's':
+      code = name == "stats" ? SubCommand::STATS : SubCommand::UNKNOWN;
+      break;
     default:
       code = SubCommand::UNKNOWN;
       break;
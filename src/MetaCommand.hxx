@@ -20,6 +20,7 @@
 #define IMTOOLS_META_COMMAND_HXX
 
 #include <string>
+#include <functional>
 #include "Command.hxx"
 
 namespace imtools {
@@ -36,9 +37,14 @@ class MetaCommand : public Command
       VERSION,
       COPYRIGHT,
       FEATURES,
-      ALL
+      ALL,
+      /// Runtime statistics of the server process
+      STATS
     };
 
+    /// Provides extra statistics in `name: value` lines
+    typedef std::function<std::string()> StatsProvider;
+
     // Inherit ctors
     using Command::Command;
     explicit MetaCommand(SubCommand subcommand) : m_subcommand(subcommand) {};
@@ -52,11 +58,18 @@ class MetaCommand : public Command
     /// Returns numeric representation of subcommand name for comparisions.
     static SubCommand getSubCommandCode(const std::string& name) noexcept;
 
+    /// Sets provider of the statistics appended to the `stats` subcommand output
+    static inline void setStatsProvider(const StatsProvider& provider) noexcept { s_stats_provider = provider; }
+
   protected:
     SubCommand m_subcommand;
 
+    static StatsProvider s_stats_provider;
+
   private:
     std::string _getName(const MetaCommand::SubCommand& code) const;
+    /// \returns runtime statistics in `name: value` lines
+    std::string _getStats() const;
 };
 
 /////////////////////////////////////////////////////////////////////
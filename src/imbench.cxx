@@ -0,0 +1,105 @@
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include "imtools.hxx"
+#include "resample.hxx"
+
+static const char* g_program_name;
+
+static const char* usage_template = IMTOOLS_FULL_NAME "\n\n" IMTOOLS_COPYRIGHT "\n\n"
+"Usage: %s <image> <width> <height> [<repeats>]\n\n"
+"Resizes <image> to <width>x<height> by means of cv::resize() and the built-in resampler\n"
+"with every interpolation method. Outputs the best time of <repeats> runs (default: 10)\n"
+"in msec, the speedup of the built-in resampler, and the max. absolute difference\n"
+"between the results.\n";
+
+
+static void
+usage(bool is_error)
+{
+  fprintf(is_error ? stdout : stderr, usage_template, g_program_name);
+  exit(is_error ? 1 : 0);
+}
+
+
+/// \returns the best time of `repeats` calls of `fn` in msec
+template<class Fn>
+static double
+bench(int repeats, Fn fn)
+{
+  double best = -1.;
+
+  for (int i = 0; i < repeats; i++) {
+    double start = static_cast<double>(cv::getTickCount());
+    fn();
+    double t = (cv::getTickCount() - start) * 1000. / cv::getTickFrequency();
+    if (best < 0 || t < best) {
+      best = t;
+    }
+  }
+
+  return best;
+}
+
+
+int main(int argc, char **argv)
+{
+  static const struct {
+    const char* name;
+    int code;
+  } methods[] = {
+    {"nearest",  cv::INTER_NEAREST},
+    {"linear",   cv::INTER_LINEAR},
+    {"area",     cv::INTER_AREA},
+    {"cubic",    cv::INTER_CUBIC},
+    {"lanczos4", cv::INTER_LANCZOS4}
+  };
+
+  g_program_name = argv[0];
+
+  if (argc < 4) {
+    usage(true);
+    return 1;
+  }
+
+  if (!imtools::file_exists(argv[1])) {
+    error_log("File %s doesn't exist", argv[1]);
+    usage(true);
+    return 1;
+  }
+
+  cv::Size size(atoi(argv[2]), atoi(argv[3]));
+  int repeats = argc > 4 ? atoi(argv[4]) : 10;
+  if (size.width <= 0 || size.height <= 0 || repeats <= 0) {
+    usage(true);
+    return 1;
+  }
+
+  cv::Mat img = cv::imread(argv[1], 1);
+  if (img.empty()) {
+    error_log("Failed to read image %s", argv[1]);
+    return 1;
+  }
+
+  printf("%dx%d -> %dx%d, best of %d\n", img.cols, img.rows, size.width, size.height, repeats);
+  printf("%-10s %12s %12s %8s %8s\n", "method", "opencv, ms", "imtools, ms", "speedup", "maxdiff");
+
+  for (auto& m : methods) {
+    cv::Mat a, b;
+    double t_cv = bench(repeats, [&]() { cv::resize(img, a, size, 0, 0, m.code); });
+
+    if (!imtools::resample_supported(img.type(), m.code)) {
+      printf("%-10s %12.2f %12s %8s %8s\n", m.name, t_cv, "-", "-", "-");
+      continue;
+    }
+
+    double t_im = bench(repeats, [&]() { imtools::resample(b, img, size, m.code); });
+    cv::Mat diff;
+    double maxdiff;
+    cv::absdiff(a, b, diff);
+    cv::minMaxLoc(diff.reshape(1), nullptr, &maxdiff);
+
+    printf("%-10s %12.2f %12.2f %8.2f %8.0f\n", m.name, t_cv, t_im, t_cv / t_im, maxdiff);
+  }
+
+  return 0;
+}
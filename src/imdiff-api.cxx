@@ -33,6 +33,7 @@ using imtools::imdiff::DiffCommandFactory;
 using imtools::CommandResult;
 using imtools::ErrorException;
 using imtools::FileWriteErrorException;
+using imtools::BoundBoxVector;
 
 /////////////////////////////////////////////////////////////////////
 
@@ -40,8 +41,8 @@ void
 DiffCommand::run(CommandResult& result)
 {
   cv::Mat diff_img;
-  cv::Mat old_img{cv::imread(m_old_image_filename, 1)};
-  cv::Mat new_img{cv::imread(m_new_image_filename, 1)};
+  cv::Mat old_img{imtools::read_image(m_old_image_filename)};
+  cv::Mat new_img{imtools::read_image(m_new_image_filename)};
 
   if (old_img.size() != new_img.size()) {
     throw ErrorException("Input images have different dimensions");
@@ -52,13 +53,16 @@ DiffCommand::run(CommandResult& result)
 
   debug_timer_init(t1, t2);
   debug_timer_start(t1);
-  imtools::diff(diff_img, old_img, new_img);
+  if (m_coarse_scale > 1) {
+    BoundBoxVector regions;
+    imtools::diff(diff_img, regions, old_img, new_img, m_min_threshold, m_coarse_scale);
+  } else {
+    imtools::diff(diff_img, old_img, new_img);
+  }
   debug_timer_end(t1, t2, diff);
 
   debug_log("Writing to %s", m_out_image_filename.c_str());
-  if (!cv::imwrite(m_out_image_filename, diff_img, getCompressionParams())) {
-    throw FileWriteErrorException(m_out_image_filename);
-  }
+  writeImage(m_out_image_filename, diff_img);
 
   result.setValue("OK");
 }
@@ -95,6 +99,12 @@ DiffCommandFactory::getOptionCode(const std::string& o) const noexcept
     case 'n':
       code = o == "new_image" ? Option::NEW_IMAGE : Option::UNKNOWN;
       break;
+    case 'c':
+      code = o == "coarse_scale" ? Option::COARSE_SCALE : Option::UNKNOWN;
+      break;
+    case 'm':
+      code = o == "min_threshold" ? Option::MIN_THRESHOLD : Option::UNKNOWN;
+      break;
     default:
       code = Option::UNKNOWN;
       break;
@@ -110,6 +120,9 @@ DiffCommandFactory::create(const Command::Arguments& arguments) const
   std::string old_image_filename;
   std::string new_image_filename;
   std::string out_image_filename;
+  int coarse_scale = 0;
+  int min_threshold = THRESHOLD_MIN;
+  EncoderProfile encoder = getEncoderProfile(arguments);
 
   for (auto& it : arguments) {
     std::string key = it.first.data();
@@ -124,11 +137,21 @@ DiffCommandFactory::create(const Command::Arguments& arguments) const
       case Option::OLD_IMAGE: old_image_filename = str_value; break;
       case Option::NEW_IMAGE: new_image_filename = str_value; break;
       case Option::OUT_IMAGE: out_image_filename = str_value; break;
-      default: warning_log("Skipping unknown key '%s'", key.c_str()); break;
+      case Option::COARSE_SCALE: coarse_scale = std::stoi(str_value); break;
+      case Option::MIN_THRESHOLD: min_threshold = std::stoi(str_value); break;
+      default:
+        if (key != "encoder" && !encoder.set(key, str_value)) {
+          warning_log("Skipping unknown key '%s'", key.c_str());
+        }
+        break;
     }
   }
 
-  return new DiffCommand(old_image_filename, new_image_filename, out_image_filename);
+  auto cmd = new DiffCommand(old_image_filename, new_image_filename, out_image_filename,
+      coarse_scale, min_threshold);
+  cmd->setEncoderProfile(encoder);
+
+  return cmd;
 }
 
 // vim: et ts=2 sts=2 sw=2
@@ -35,10 +35,14 @@ class DiffCommand : public Command
     using Command::Command;
     explicit DiffCommand(const std::string& old_image_filename,
         const std::string& new_image_filename,
-        const std::string& out_image_filename) :
+        const std::string& out_image_filename,
+        int coarse_scale = 0,
+        int min_threshold = THRESHOLD_MIN) :
       m_old_image_filename{old_image_filename},
       m_new_image_filename{new_image_filename},
-      m_out_image_filename{out_image_filename}
+      m_out_image_filename{out_image_filename},
+      m_coarse_scale{coarse_scale},
+      m_min_threshold{min_threshold}
     {};
 
     // Executes the command
@@ -51,6 +55,10 @@ class DiffCommand : public Command
     const std::string m_old_image_filename;
     const std::string m_new_image_filename;
     const std::string m_out_image_filename;
+    /// Scale factor for the multi-resolution difference. Values less than 2 turn it off.
+    const int m_coarse_scale;
+    /// Channel differences up to this value are skipped in the multi-resolution mode
+    const int m_min_threshold;
 };
 
 /////////////////////////////////////////////////////////////////////
@@ -62,6 +70,8 @@ class DiffCommandFactory : public ::imtools::CommandFactory
       OLD_IMAGE,
       NEW_IMAGE,
       OUT_IMAGE,
+      COARSE_SCALE,
+      MIN_THRESHOLD
     };
 
     using ::imtools::CommandFactory::CommandFactory;
@@ -2,11 +2,14 @@
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 #include "imtools.hxx"
+#include "Command.hxx"
 
 
 static const char* g_program_name;
 
 static std::string g_out_filename;
+/// Output format (empty - by the file extension, see `EncoderProfile::getFileExt()`)
+static imtools::EncoderProfile g_encoder_profile;
 
 
 // Minimum difference between old and new matrix elements specifying
@@ -29,14 +32,18 @@ static const char* usage_template = "Usage: %s OPTIONS old_image new_image\n\n"
 "Computes difference between two images of the same size.\n\n"
 " -h, --help           Display this help.\n"
 " -v, --verbose        Verbose mode.\n"
-" -o, --output         Filename of the output image. Required.\n";
+" -o, --output         Filename of the output image (\"-\" for stdout). Required.\n"
+" -f, --format         Output format overriding the file extension: jpg, png, webp, etc.\n"
+"                      Default: by the file extension; png for stdout.\n\n"
+"Either of the input images can be \"-\" for stdin.\n";
 
-static const char* g_short_options = "hvo:";
+static const char* g_short_options = "hvo:f:";
 
 static const struct option g_long_options[] = {
   {"help",    no_argument,       NULL, 'h'},
   {"verbose", no_argument,       NULL, 'v'},
   {"output",  required_argument, NULL, 'o'},
+  {"format",  required_argument, NULL, 'f'},
   {0,         0,                 0,    0}
 };
 
@@ -89,8 +96,8 @@ show_diff(const std::string& filename_old, const std::string& filename_new)
 
   // Load images forcing them to be 3-channel
   // (for converting to grayscale)
-  old_img = cv::imread(filename_old, 1);
-  new_img = cv::imread(filename_new, 1);
+  old_img = imtools::read_image(filename_old);
+  new_img = imtools::read_image(filename_new);
 
   cv::namedWindow(window_title, CV_WINDOW_NORMAL);
 
@@ -114,6 +121,7 @@ show_diff(const std::string& filename_old, const std::string& filename_new)
 int main(int argc, char** argv)
 {
   g_program_name = argv[0];
+  imtools::set_stdio_enabled(true);
 
   int next_option;
   std::string filename_old, filename_new;
@@ -129,6 +137,15 @@ int main(int argc, char** argv)
         g_out_filename = optarg;
         break;
 
+      case 'f':
+        try {
+          g_encoder_profile.set("format", optarg);
+        } catch (imtools::ErrorException& e) {
+          fprintf(stderr, "Error: %s\n", e.what());
+          usage(true);
+        }
+        break;
+
       case 'v':
         imtools::verbose++;
         break;
@@ -147,6 +164,11 @@ int main(int argc, char** argv)
     }
   } while (next_option != -1);
 
+  if (imtools::is_stdio(g_out_filename)) {
+    // Keep the image data intact
+    imtools::log::set_stderr_only(true);
+  }
+
   if (argc - optind == 2) {
     filename_old = argv[optind++];
     filename_new = argv[optind++];
@@ -160,19 +182,29 @@ int main(int argc, char** argv)
     show_diff(filename_old, filename_new);
 
     if (imtools::verbose) {
-      if (imtools::file_exists(g_out_filename.c_str())) {
+      if (!imtools::is_stdio(g_out_filename) && imtools::file_exists(g_out_filename.c_str())) {
         fprintf(stderr, "Warning: File %s will be overwritten\n", g_out_filename.c_str());
       }
-      printf("* Writing to %s\n", g_out_filename.c_str());
+      fprintf(imtools::is_stdio(g_out_filename) ? stderr : stdout,
+          "* Writing to %s\n", g_out_filename.c_str());
     }
     if (g_out_filename.length() == 0) {
       fprintf(stderr, "Error: No output file specified.\n");
       usage(true);
     }
-    cv::imwrite(g_out_filename, g_out);
+
+    std::string ext(g_encoder_profile.getFileExt(g_out_filename));
+    std::vector<unsigned char> buf;
+    if (!cv::imencode(ext, g_out, buf)) {
+      throw imtools::FileWriteErrorException(g_out_filename);
+    }
+    imtools::write_file(g_out_filename, buf.data(), buf.size());
   } catch (cv::Exception& e) {
     fprintf(stderr, "Error: %s\n", e.what());
     return 1;
+  } catch (imtools::ErrorException& e) {
+    fprintf(stderr, "Error: %s\n", e.what());
+    return 1;
   }
 
   return 0;
@@ -21,6 +21,14 @@
 #include "immerge-api.hxx"
 
 #include <string>
+#include <cstdio>
+#include <cstring>
+#include <climits>
+#include <fstream>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
+#include <sys/stat.h>
 #include <boost/algorithm/string/trim.hpp>
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
@@ -39,60 +47,253 @@ typedef ::imtools::Command::Arguments Arguments;
 typedef ::imtools::Command::ArgumentItem ArgumentItem;
 typedef ::imtools::BoundBoxVector BoundBoxVector;
 typedef ::imtools::BoundBox BoundBox;
+typedef std::chrono::steady_clock Clock;
+
+
+/// \returns number of milliseconds elapsed since `start`
+static inline double
+msec_since(const Clock::time_point& start)
+{
+  return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+
+/// Writes `s` as JSON string
+static void
+json_string(std::ostream& os, const std::string& s)
+{
+  static const char* hex = "0123456789abcdef";
+
+  os << '"';
+  for (unsigned char c : s) {
+    switch (c) {
+      case '"':  os << "\\\""; break;
+      case '\\': os << "\\\\"; break;
+      case '\n': os << "\\n";  break;
+      case '\r': os << "\\r";  break;
+      case '\t': os << "\\t";  break;
+      default:
+        if (c < 0x20) {
+          os << "\\u00" << hex[c >> 4] << hex[c & 0xf];
+        } else {
+          os << c;
+        }
+    }
+  }
+  os << '"';
+}
+
+
+/// Writes `r` as JSON array `[x, y, width, height]`
+static inline void
+json_rect(std::ostream& os, const cv::Rect& r)
+{
+  os << '[' << r.x << ',' << r.y << ',' << r.width << ',' << r.height << ']';
+}
+
+
+/// Writes `p` as JSON array `[x, y]`
+static inline void
+json_point(std::ostream& os, const cv::Point& p)
+{
+  os << '[' << p.x << ',' << p.y << ']';
+}
+
+
+/// Magic bytes at the beginning of a patch bundle
+static const char BUNDLE_MAGIC[4] = {'I', 'M', 'T', 'B'};
+
+
+/// Writes `v` in little-endian byte order
+static void
+bundle_write_u32(std::ostream& os, uint32_t v)
+{
+  char buf[4] = {
+    static_cast<char>(v & 0xff),
+    static_cast<char>((v >> 8) & 0xff),
+    static_cast<char>((v >> 16) & 0xff),
+    static_cast<char>((v >> 24) & 0xff)
+  };
+  os.write(buf, sizeof(buf));
+}
+
+
+/// Reads little-endian 32-bit unsigned integer
+static uint32_t
+bundle_read_u32(std::istream& is)
+{
+  unsigned char buf[4];
+  if (!is.read(reinterpret_cast<char*>(buf), sizeof(buf))) {
+    throw ErrorException("Unexpected end of patch bundle");
+  }
+  return buf[0] | (buf[1] << 8) | (buf[2] << 16) | (static_cast<uint32_t>(buf[3]) << 24);
+}
+
+
+/// \returns number of bytes from the current position to the end of `is`
+static uint64_t
+bundle_remaining(std::istream& is)
+{
+  const std::istream::pos_type pos = is.tellg();
+  is.seekg(0, std::ios::end);
+  const std::istream::pos_type end = is.tellg();
+  is.seekg(pos);
+  if (pos < 0 || end < pos) {
+    return 0;
+  }
+  return static_cast<uint64_t>(end - pos);
+}
+
+
+/// Writes `data` prefixed with its length
+static void
+bundle_write_blob(std::ostream& os, const void* data, size_t size)
+{
+  bundle_write_u32(os, static_cast<uint32_t>(size));
+  os.write(static_cast<const char*>(data), size);
+}
+
+
+/// Reads data written by `bundle_write_blob()`
+template <class T>
+static void
+bundle_read_blob(std::istream& is, T& data)
+{
+  // Bundles don't contain anything close to this
+  const uint32_t max_size = 1 << 30;
+
+  uint32_t size = bundle_read_u32(is);
+  if (size > max_size || size > bundle_remaining(is)) {
+    throw ErrorException("Invalid blob size in patch bundle: %u", size);
+  }
+  data.resize(size);
+  if (size && !is.read(reinterpret_cast<char*>(&data[0]), size)) {
+    throw ErrorException("Unexpected end of patch bundle");
+  }
+}
+
+
+static inline void
+bundle_write_rect(std::ostream& os, const cv::Rect& r)
+{
+  bundle_write_u32(os, static_cast<uint32_t>(r.x));
+  bundle_write_u32(os, static_cast<uint32_t>(r.y));
+  bundle_write_u32(os, static_cast<uint32_t>(r.width));
+  bundle_write_u32(os, static_cast<uint32_t>(r.height));
+}
+
+
+static inline cv::Rect
+bundle_read_rect(std::istream& is)
+{
+  cv::Rect r;
+  r.x      = static_cast<int32_t>(bundle_read_u32(is));
+  r.y      = static_cast<int32_t>(bundle_read_u32(is));
+  r.width  = static_cast<int32_t>(bundle_read_u32(is));
+  r.height = static_cast<int32_t>(bundle_read_u32(is));
+  return r;
+}
+
+
+/// Writes `d` as JSON number (`null`, if the number is not finite)
+static inline void
+json_number(std::ostream& os, double d)
+{
+  if (std::isfinite(d)) {
+    os << d;
+  } else {
+    os << "null";
+  }
+}
 
 /////////////////////////////////////////////////////////////////////
 
 MergeCommand::MergeCommand(
     const imtools::ImageArray& input_images,
     const imtools::ImageArray& out_images,
-    const std::string& old_image_filename,
-    const std::string& new_image_filename,
+    const imtools::ImageArray& old_image_filenames,
+    const imtools::ImageArray& new_image_filenames,
     int strict,
     int min_threshold,
     int max_threshold,
-    unsigned max_threads_num) noexcept
+    unsigned max_threads_num,
+    int band_rows,
+    int coarse_scale,
+    const std::string& explain_filename,
+    const std::string& bundle_filename,
+    const std::string& save_bundle_filename,
+    const std::string& state_filename,
+    int match_tile) noexcept
 : m_input_images(input_images),
   m_out_images(out_images),
-  m_old_image_filename(old_image_filename),
-  m_new_image_filename(new_image_filename),
+  m_old_image_filenames(old_image_filenames),
+  m_new_image_filenames(new_image_filenames),
   m_strict(strict),
   m_min_threshold(min_threshold),
   m_max_threshold(max_threshold),
+  m_band_rows(band_rows),
+  m_coarse_scale(coarse_scale),
+  m_explain_filename(explain_filename),
+  m_bundle_filename(bundle_filename),
+  m_save_bundle_filename(save_bundle_filename),
+  m_state_filename(state_filename),
+  m_match_tile(match_tile),
   m_max_threads(max_threads_num)
 {
 }
 
 
 bool
-MergeCommand::_processPatch(const BoundBox& box, const cv::Mat& in_img, cv::Mat& out_img, BoundBoxVector& patched_boxes)
+MergeCommand::_matchPatch(const Patch& patch, const cv::Mat& img, PatchMatch& match) const
+{
+  auto start = Clock::now();
+  bool success{true};
+
+  try {
+    if (m_match_tile > 0) {
+      // Find likely location of an area similar to the old template on the image being processed now.
+      imtools::match_template_tiled(match.match_loc, img, patch.old_tpl, m_match_tile);
+      // Some patches may already be applied. We'll try to detect if it's so.
+      imtools::match_template_tiled(match.match_loc_new, img, patch.new_tpl, m_match_tile);
+    } else {
+      imtools::match_template(match.match_loc, img, patch.old_tpl);
+      imtools::match_template(match.match_loc_new, img, patch.new_tpl);
+    }
+  } catch (ErrorException& e) {
+    success = false;
+    imtools::log::push_error(e.what());
+  } catch (std::exception& e) {
+    success = false;
+    imtools::log::push_error("Unhandled exception: %s", e.what());
+  }
+
+  match.msec = msec_since(start);
+
+  return (success);
+}
+
+
+bool
+MergeCommand::_processPatch(const Patch& patch, const PatchMatch& match, cv::Mat& out_img,
+    BoundBoxVector& patched_boxes, PatchTrace* trace)
 {
+  auto      start = Clock::now();
   bool      success{true};
-  cv::Point match_loc;
-  cv::Point match_loc_new;
+  const cv::Point& match_loc     = match.match_loc;
+  const cv::Point& match_loc_new = match.match_loc_new;
   cv::Rect  roi;
   cv::Rect  roi_new;
   double    avg_mssim;
   double    avg_mssim_new;
 
-  BoundBox homo_box(box);
+  const BoundBox& box      = patch.box;
+  const BoundBox& homo_box = patch.homo_box;
+  const cv::Mat& old_tpl_img = patch.old_tpl;
+  const cv::Mat& new_tpl_img = patch.new_tpl;
 
   debug_log("%s: %dx%d @ %d;%d", __func__, box.width, box.height, box.x, box.y);
 
   try {
-    // The more the box area is heterogeneous on m_old_img, the more chances
-    // to match this location on the image being patched.
-    // However, imtools::make_heterogeneous() *modifies* the box! So we'll have to restore its size
-    // before patching.
-    imtools::make_heterogeneous(homo_box, m_old_img);
-
-    auto old_tpl_img(cv::Mat(m_old_img, homo_box));
-    auto new_tpl_img(cv::Mat(m_new_img, box));
-
-    // Find likely location of an area similar to old_tpl_img on the image being processed now.
-    imtools::match_template(match_loc, in_img, old_tpl_img);
-    // Some patches may already be applied. We'll try to detect if it's so.
-    imtools::match_template(match_loc_new, in_img, new_tpl_img);
-
     // Assign regions of interest for old and new images. Then we'll see which of them
     // matches best.
 
@@ -110,8 +311,8 @@ MergeCommand::_processPatch(const BoundBox& box, const cv::Mat& in_img, cv::Mat&
     debug_log("roi_new = (%d, %d, %d, %d)", roi_new.x, roi_new.y, roi_new.width, roi_new.height);
 
     // Calculate average similarity
-    avg_mssim     = imtools::get_avg_MSSIM(new_tpl_img, cv::Mat(out_img, roi));
-    avg_mssim_new = imtools::get_avg_MSSIM(new_tpl_img, cv::Mat(out_img, roi_new));
+    avg_mssim     = imtools::get_avg_MSSIM(patch.new_tpl_stats, cv::Mat(out_img, roi));
+    avg_mssim_new = imtools::get_avg_MSSIM(patch.new_tpl_stats, cv::Mat(out_img, roi_new));
     debug_log("avg_mssim: %f avg_mssim_new: %f", avg_mssim, avg_mssim_new);
 
     if (avg_mssim > avg_mssim_new /*|| avg_mssim < 0*/) {
@@ -121,6 +322,17 @@ MergeCommand::_processPatch(const BoundBox& box, const cv::Mat& in_img, cv::Mat&
       imtools::patch(out_img, new_tpl_img, roi_new);
       patched_boxes.push_back(cv::Rect(roi_new));
     }
+
+    if (trace) {
+      trace->homo_box      = homo_box;
+      trace->match_loc     = match_loc;
+      trace->match_loc_new = match_loc_new;
+      trace->roi           = roi;
+      trace->roi_new       = roi_new;
+      trace->avg_mssim     = avg_mssim;
+      trace->avg_mssim_new = avg_mssim_new;
+      trace->use_roi_new   = !(avg_mssim > avg_mssim_new);
+    }
   } catch (ErrorException& e) {
     success = false;
     imtools::log::push_error(e.what());
@@ -129,6 +341,10 @@ MergeCommand::_processPatch(const BoundBox& box, const cv::Mat& in_img, cv::Mat&
     imtools::log::push_error("Unhandled exception: %s", e.what());
   }
 
+  if (trace) {
+    trace->msec = match.msec + msec_since(start);
+  }
+
   return (success);
 }
 
@@ -147,128 +363,771 @@ MergeCommand::_isHugeBoundBox(const BoundBox& box, const cv::Mat& out_img)
 
 
 bool
-MergeCommand::_processImage(const std::string& in_filename, const std::string& out_filename)
+MergeCommand::_processImage(const imtools::ImageArray& in_filenames, const imtools::ImageArray& out_filenames,
+    TargetTrace* trace)
 {
+  assert(!in_filenames.empty() && in_filenames.size() == out_filenames.size());
+  const std::string& in_filename = in_filenames[0];
+  auto           start            = Clock::now();
   bool           success          = true;
   cv::Mat        in_img;
   cv::Mat        out_img;
   std::string    merged_filename;
-  BoundBoxVector boxes;
   BoundBoxVector patched_boxes;
 
   // Load target image forcing 3 channels
   verbose_log2("Processing target: %s", in_filename.c_str());
+  assert(!out_filenames.empty());
+  const std::string& out_filename = out_filenames[0];
   invokeEventCallback((in_filename + " -> ") + out_filename);
-  in_img = cv::imread(in_filename, 1);
+  if (trace) {
+    trace->in_filename  = in_filename;
+    trace->out_filename = out_filename;
+    trace->patches.reserve(m_n_boxes);
+  }
+  in_img = imtools::read_image(in_filename);
   if (in_img.empty()) {
     throw ErrorException("empty image skipped: " + in_filename);
   }
+  if (trace) {
+    trace->read_msec = msec_since(start);
+    start = Clock::now();
+  }
 
-  // Prepare matrix for the output image
-  out_img = in_img.clone();
+  // The image is patched in place. The templates of a change are searched for
+  // before any of its patches is applied, so no pristine copy is needed.
+  out_img = in_img;
 
-  // Generate rectangles bounding clusters of white (changed) pixels on `m_diff_img`
-  imtools::bound_boxes(boxes, m_diff_img, m_min_threshold, m_max_threshold);
-  patched_boxes.reserve(boxes.size());
+  patched_boxes.reserve(m_n_boxes);
 
-  // Process the patches
-  for (auto& box : boxes) {
-    debug_log("bbox %dx%d @ %d;%d", box.width, box.height, box.x, box.y);
+  // Apply the changes one after another within the same decode/encode cycle,
+  // as if the changes were applied by separate runs
+  std::vector<PatchMatch> matches;
+  for (size_t c = 0; c < m_changes.size() && success; ++c) {
+    const Change& change = m_changes[c];
+    const size_t n_patches = change.patches.size();
 
-    if (_isHugeBoundBox(box, out_img)) {
-      continue;
+    // Find the locations
+    matches.assign(n_patches, PatchMatch());
+    for (size_t p = 0; p < n_patches; ++p) {
+      const BoundBox& box = change.patches[p].box;
+      debug_log("bbox %dx%d @ %d;%d", box.width, box.height, box.x, box.y);
+
+      if (_isHugeBoundBox(box, out_img)) {
+        matches[p].huge = true;
+        continue;
+      }
+
+      if (!_matchPatch(change.patches[p], out_img, matches[p])) {
+        success = false;
+        break;
+      }
     }
 
-    if (!_processPatch(box, in_img, out_img, patched_boxes)) {
-      success = false;
-      break;
+    // Process the patches
+    for (size_t p = 0; p < n_patches && success; ++p) {
+      const Patch& patch = change.patches[p];
+
+      PatchTrace* patch_trace = nullptr;
+      if (trace) {
+        trace->patches.emplace_back();
+        patch_trace = &trace->patches.back();
+        patch_trace->change = c;
+        patch_trace->box = patch.box;
+      }
+
+      if (matches[p].huge) {
+        if (patch_trace) {
+          patch_trace->huge = true;
+        }
+        continue;
+      }
+
+      if (!_processPatch(patch, matches[p], out_img, patched_boxes, patch_trace)) {
+        success = false;
+        break;
+      }
     }
   }
 
+  if (trace) {
+    trace->patch_msec = msec_since(start);
+    start = Clock::now();
+  }
+
   if (!success) {
+    if (trace) {
+      trace->error = "failed to process";
+    }
     imtools::log::warn_all();
     error_log("%s: failed to process, skipping", in_filename.c_str());
     return (success);
   }
 
   // Save merged matrix to filesystem
-  if (m_strict && out_filename == in_filename && imtools::file_exists(out_filename)) {
-    throw ErrorException("strict mode prohibits writing to existing file " + out_filename);
+  for (size_t k = 0; k < out_filenames.size(); ++k) {
+    const std::string& filename = out_filenames[k];
+    if (m_strict && filename == in_filenames[k] && !hasOutputCallback()
+        && !imtools::is_stdio(filename) && imtools::file_exists(filename))
+    {
+      throw ErrorException("strict mode prohibits writing to existing file " + filename);
+    }
   }
-  verbose_log2("Writing to %s", out_filename.c_str());
-  invokeEventCallback(out_filename + " done");
-  if (!cv::imwrite(out_filename, out_img, getCompressionParams())) {
-    throw FileWriteErrorException(out_filename);
+  if (out_filenames.size() == 1) {
+    verbose_log2("Writing to %s", out_filename.c_str());
+    invokeEventCallback(out_filename + " done");
+    writeImage(out_filename, out_img);
+    verbose_log("[Output] file:%s boxes:%d", out_filename.c_str(), m_n_boxes);
+  } else {
+    // Encode once for all the outputs
+    std::vector<unsigned char> buf;
+    if (!encodeImage(buf, m_encoder_profile.getFileExt(out_filename), out_img)) {
+      throw FileWriteErrorException(out_filename);
+    }
+    for (auto& filename : out_filenames) {
+      verbose_log2("Writing to %s", filename.c_str());
+      invokeEventCallback(filename + " done");
+      writeOutput(filename, buf);
+      verbose_log("[Output] file:%s boxes:%d", filename.c_str(), m_n_boxes);
+    }
+  }
+
+  if (trace) {
+    trace->write_msec = msec_since(start);
+    trace->success    = success;
   }
-  verbose_log("[Output] file:%s boxes:%d", out_filename.c_str(), boxes.size());
 
   return (success);
 }
 
 
 void
-MergeCommand::run(imtools::CommandResult& result)
+MergeCommand::_loadChange(Change& change, const std::string& old_filename, const std::string& new_filename) const
 {
-  bool      success     = true;
-  uint_t    n_images    = m_input_images.size();
-  uint_t    i;
-  cv::Point match_loc;
-  cv::Mat   out_img;
-
-  // Load the two images which will specify the modificatoin to be applied to
-  // each of m_input_images; force 3 channels
-  m_old_img = cv::imread(m_old_image_filename, 1);
-  m_new_img = cv::imread(m_new_image_filename, 1);
-  if (m_old_img.size() != m_new_img.size()) {
+  // Force 3 channels
+  cv::Mat old_img = imtools::read_image(old_filename);
+  cv::Mat new_img = imtools::read_image(new_filename);
+  if (old_img.empty() || new_img.empty()) {
+    throw ErrorException("Failed to read images %s, %s", old_filename.c_str(), new_filename.c_str());
+  }
+  if (old_img.size() != new_img.size()) {
     throw ErrorException("Input images have different dimensions, old: %dx%d, new: %dx%d",
-        m_old_img.cols, m_old_img.rows, m_new_img.cols, m_new_img.rows);
+        old_img.cols, old_img.rows, new_img.cols, new_img.rows);
   }
-  if (m_old_img.type() != m_new_img.type()) {
+  if (old_img.type() != new_img.type()) {
     throw ErrorException("Input images have different types");
   }
+  change.size = old_img.size();
+
+  // Generate rectangles bounding clusters of changed pixels.
+  BoundBoxVector boxes;
+  if (m_band_rows > 0) {
+    imtools::bound_boxes_tiled(boxes, old_img, new_img, m_band_rows,
+        m_min_threshold, m_max_threshold);
+  } else if (m_coarse_scale > 1) {
+    // Refine only the tiles which differ at coarse scale
+    cv::Mat diff_img;
+    BoundBoxVector regions;
+    imtools::diff(diff_img, regions, old_img, new_img, m_min_threshold, m_coarse_scale);
+    imtools::bound_boxes(boxes, diff_img, regions, m_min_threshold, m_max_threshold);
+  } else {
+    // Binary image representing differences between the old and the new
+    // images where modified spots have high values.
+    cv::Mat diff_img;
+    imtools::diff(diff_img, old_img, new_img);
+    imtools::bound_boxes(boxes, diff_img, m_min_threshold, m_max_threshold);
+  }
+  verbose_log2("%s -> %s: %lu boxes", old_filename.c_str(), new_filename.c_str(), boxes.size());
+
+  change.patches.clear();
+  change.patches.resize(boxes.size());
+  for (size_t i = 0; i < boxes.size(); ++i) {
+    Patch& patch = change.patches[i];
+
+    // The more the box area is heterogeneous on the old image, the more chances
+    // to match this location on the image being patched.
+    // However, imtools::make_heterogeneous() *modifies* the box! So we keep
+    // the original box for patching.
+    patch.box      = boxes[i];
+    patch.homo_box = boxes[i];
+    imtools::make_heterogeneous(patch.homo_box, old_img);
+
+    patch.old_tpl = cv::Mat(old_img, patch.homo_box);
+    patch.new_tpl = cv::Mat(new_img, patch.box);
+    _preparePatch(patch);
+  }
+}
+
+
+void
+MergeCommand::_preparePatch(Patch& patch)
+{
+  imtools::get_MSSIM_stats(patch.new_tpl_stats, patch.new_tpl);
+}
+
+
+void
+MergeCommand::_saveBundle() const
+{
+  const std::string filename = trimPath(m_save_bundle_filename);
+  std::ofstream os(filename, std::ios::binary);
+  if (!os) {
+    throw FileWriteErrorException(filename);
+  }
+
+  os.write(BUNDLE_MAGIC, sizeof(BUNDLE_MAGIC));
+  bundle_write_u32(os, BUNDLE_VERSION);
+  bundle_write_u32(os, m_changes.size());
+
+  // Lossless, and fast enough
+  const std::vector<int> png_params{CV_IMWRITE_PNG_COMPRESSION, 3};
+  std::vector<unsigned char> buf;
+
+  for (size_t c = 0; c < m_changes.size(); ++c) {
+    const Change& change = m_changes[c];
+    const std::string& old_filename = c < m_old_image_filenames.size() ? m_old_image_filenames[c] : "";
+    const std::string& new_filename = c < m_new_image_filenames.size() ? m_new_image_filenames[c] : "";
+
+    bundle_write_blob(os, old_filename.data(), old_filename.size());
+    bundle_write_blob(os, new_filename.data(), new_filename.size());
+    bundle_write_u32(os, change.size.width);
+    bundle_write_u32(os, change.size.height);
+    bundle_write_u32(os, change.patches.size());
+
+    for (auto& patch : change.patches) {
+      bundle_write_rect(os, patch.box);
+      bundle_write_rect(os, patch.homo_box);
+
+      for (const cv::Mat* tpl : {&patch.old_tpl, &patch.new_tpl}) {
+        if (!cv::imencode(".png", *tpl, buf, png_params)) {
+          throw ErrorException("Failed to encode template for patch bundle");
+        }
+        bundle_write_blob(os, buf.data(), buf.size());
+      }
+    }
+  }
+
+  if (!os.flush()) {
+    throw FileWriteErrorException(filename);
+  }
+  verbose_log("Saved patch bundle %s: %lu changes, %lu patches",
+      filename.c_str(), m_changes.size(), m_n_boxes);
+}
+
+
+void
+MergeCommand::_loadBundle()
+{
+  std::string filename = trimPath(m_bundle_filename);
+  std::ifstream is(filename, std::ios::binary);
+  if (!is) {
+    throw ErrorException("Failed to open patch bundle %s", filename.c_str());
+  }
+
+  char magic[sizeof(BUNDLE_MAGIC)];
+  if (!is.read(magic, sizeof(magic)) || !std::equal(magic, magic + sizeof(magic), BUNDLE_MAGIC)) {
+    throw ErrorException("%s is not a patch bundle", filename.c_str());
+  }
+  uint32_t version = bundle_read_u32(is);
+  if (version != BUNDLE_VERSION) {
+    throw ErrorException("Unsupported patch bundle version %u, expected %u", version, BUNDLE_VERSION);
+  }
+  uint32_t n_changes = bundle_read_u32(is);
+  if (n_changes == 0 || n_changes > static_cast<uint32_t>(MAX_MERGE_CHANGES)) {
+    throw ErrorException("Invalid number of changes in patch bundle: %u", n_changes);
+  }
+
+  m_changes.resize(n_changes);
+  m_old_image_filenames.resize(n_changes);
+  m_new_image_filenames.resize(n_changes);
+
+  std::vector<unsigned char> buf;
+  for (uint32_t c = 0; c < n_changes; ++c) {
+    Change& change = m_changes[c];
+
+    bundle_read_blob(is, m_old_image_filenames[c]);
+    bundle_read_blob(is, m_new_image_filenames[c]);
+    change.size.width  = static_cast<int32_t>(bundle_read_u32(is));
+    change.size.height = static_cast<int32_t>(bundle_read_u32(is));
+    if (change.size.width <= 0 || change.size.height <= 0) {
+      throw ErrorException("Invalid image size in patch bundle %s: %dx%d",
+          filename.c_str(), change.size.width, change.size.height);
+    }
+    const cv::Rect image_rect(cv::Point(0, 0), change.size);
+
+    // Each patch takes at least two rectangles and two blob lengths
+    const uint64_t min_patch_size = 2 * 4 * 4 + 2 * 4;
+    uint32_t n_patches = bundle_read_u32(is);
+    if (n_patches > bundle_remaining(is) / min_patch_size) {
+      throw ErrorException("Invalid number of patches in patch bundle %s: %u", filename.c_str(), n_patches);
+    }
+    change.patches.clear();
+    change.patches.reserve(n_patches);
+    for (uint32_t i = 0; i < n_patches; ++i) {
+      change.patches.emplace_back();
+      Patch& patch = change.patches.back();
+
+      patch.box      = bundle_read_rect(is);
+      patch.homo_box = bundle_read_rect(is);
+      // _processPatch() relies on the box lying within the homogeneous box within the image
+      if (patch.box.area() <= 0 || (patch.box & patch.homo_box) != patch.box
+          || (patch.homo_box & image_rect) != patch.homo_box)
+      {
+        throw ErrorException("Invalid patch box in patch bundle %s", filename.c_str());
+      }
+
+      for (cv::Mat* tpl : {&patch.old_tpl, &patch.new_tpl}) {
+        bundle_read_blob(is, buf);
+        *tpl = cv::imdecode(buf, 1);
+        if (tpl->empty()) {
+          throw ErrorException("Failed to decode template from patch bundle %s", filename.c_str());
+        }
+      }
+      if (patch.new_tpl.size() != patch.box.size() || patch.old_tpl.size() != patch.homo_box.size()) {
+        throw ErrorException("Template size mismatch in patch bundle %s", filename.c_str());
+      }
+
+      _preparePatch(patch);
+    }
+  }
+  verbose_log2("Loaded patch bundle %s: %u changes", filename.c_str(), n_changes);
+}
+
+
+bool
+MergeCommand::_processTarget(const std::vector<uint_t>& targets, TargetTrace* trace,
+    std::vector<StateEntry>* entries)
+{
+  const uint_t i = targets[0];
+  imtools::ImageArray in_filenames;
+  imtools::ImageArray out_filenames;
+
+  in_filenames.reserve(targets.size());
+  out_filenames.reserve(targets.size());
+  for (auto t : targets) {
+    in_filenames.push_back(trimPath(m_input_images[t]));
+    out_filenames.push_back(trimPath(m_out_images[t]));
+  }
+
+  bool success = _processImage(in_filenames, out_filenames, trace);
+  if (success && entries) {
+    // All the outputs have the same contents
+    uint64_t output_hash = imtools::hash_file(out_filenames[0]);
+    for (auto t : targets) {
+      (*entries)[t].input_hash  = (*entries)[i].input_hash;
+      (*entries)[t].plan_hash   = (*entries)[i].plan_hash;
+      (*entries)[t].output_hash = output_hash;
+    }
+  }
+
+  return (success);
+}
 
-  // Compute difference between `m_old_img` and `m_new_img`
-  debug_timer_init(t1, t2);
-  debug_timer_start(t1);
-  imtools::diff(m_diff_img, m_old_img, m_new_img);
-  debug_timer_end(t1, t2, diff);
+
+bool
+MergeCommand::_inputsEqual(uint_t i, uint_t j) const noexcept
+{
+  try {
+    return imtools::files_equal(trimPath(m_input_images[i]), trimPath(m_input_images[j]));
+  } catch (ErrorException& e) {
+    debug_log("%s", e.what());
+  }
+  return false;
+}
+
+
+bool
+MergeCommand::_usesStdio() const noexcept
+{
+  for (auto& filename : m_input_images) {
+    if (imtools::is_stdio(trimPath(filename))) {
+      return true;
+    }
+  }
+  for (auto& filename : m_out_images) {
+    if (imtools::is_stdio(trimPath(filename))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+imtools::uint_t
+MergeCommand::_groupTargets(std::vector<std::vector<uint_t>>& groups, const std::vector<char>& unchanged,
+    const std::vector<StateEntry>& entries) const
+{
+  const uint_t n_images = m_input_images.size();
+  std::vector<uint64_t> hashes(n_images, 0);
+  std::vector<char> hashed(n_images, 0);
+  uint_t i;
+
+  groups.assign(n_images, std::vector<uint_t>());
+
+  // Fingerprint the inputs
+#ifdef IMTOOLS_THREADS
+  _Pragma("omp parallel for")
+#endif
+  for (i = 0; i < n_images; ++i) {
+    if (unchanged[i]) {
+      continue;
+    }
+    if (!entries.empty() && entries[i].input_hash) {
+      // Already computed in incremental mode
+      hashes[i] = entries[i].input_hash;
+      hashed[i] = 1;
+      continue;
+    }
+    if (imtools::is_stdio(trimPath(m_input_images[i]))) {
+      // Hashing would consume the stream
+      continue;
+    }
+    try {
+      hashes[i] = imtools::hash_file(trimPath(m_input_images[i]));
+      hashed[i] = 1;
+    } catch (ErrorException& e) {
+      // Will be reported when processing the target
+      debug_log("%s", e.what());
+    }
+  }
+
+  // The output format affects the encoded bytes
+  std::map<std::pair<uint64_t, std::string>, uint_t> leaders;
+  uint_t n_groups = 0;
+  for (i = 0; i < n_images; ++i) {
+    if (unchanged[i]) {
+      continue;
+    }
+    if (hashed[i]) {
+      auto key = std::make_pair(hashes[i], m_encoder_profile.getFileExt(trimPath(m_out_images[i])));
+      auto it = leaders.find(key);
+      if (it == leaders.end()) {
+        leaders.emplace(key, i);
+      } else if (_inputsEqual(it->second, i)) {
+        groups[it->second].push_back(i);
+        continue;
+      }
+      // Otherwise, a hash collision. Process the target separately.
+    }
+    groups[i].push_back(i);
+    ++n_groups;
+  }
+
+  return n_groups;
+}
+
+
+void
+MergeCommand::_scheduleTargets(std::vector<uint_t>& order,
+    const std::vector<std::vector<uint_t>>& groups) const
+{
+  const uint_t n_images = groups.size();
+  std::vector<uint64_t> costs(n_images, 0);
+  uint_t i;
+
+  order.clear();
+  for (i = 0; i < n_images; ++i) {
+    if (!groups[i].empty()) {
+      order.push_back(i);
+    }
+  }
+
+  // Decoding, template matching and encoding are all linear in the number of
+  // pixels of the target, so the pixel count read from the header is a fair
+  // estimate of the cost.
+#ifdef IMTOOLS_THREADS
+  _Pragma("omp parallel for")
+#endif
+  for (i = 0; i < order.size(); ++i) {
+    const std::string filename = trimPath(m_input_images[order[i]]);
+    imtools::ImageInfo info;
+    struct stat st;
+
+    if (imtools::probe_image(info, filename)) {
+      costs[order[i]] = static_cast<uint64_t>(info.width) * info.height;
+    } else if (stat(filename.c_str(), &st) == 0) {
+      // Unknown format. Compressed images usually take fewer bytes than pixels.
+      costs[order[i]] = st.st_size;
+    }
+  }
+
+  std::stable_sort(order.begin(), order.end(),
+      [&costs](uint_t a, uint_t b) { return costs[a] > costs[b]; });
+
+  if (!order.empty()) {
+    verbose_log("Scheduled %lu targets, max. cost %lu px, min. cost %lu px", order.size(),
+        static_cast<unsigned long>(costs[order.front()]), static_cast<unsigned long>(costs[order.back()]));
+  }
+}
+
+
+uint64_t
+MergeCommand::_getPlanHash() const
+{
+  std::stringstream ss;
+
+  ss << BUNDLE_VERSION << ' ' << m_min_threshold << ' ' << m_max_threshold
+    << ' ' << m_band_rows << ' ' << m_coarse_scale << ' ' << m_match_tile
+    << ' ' << m_encoder_profile.toString();
+  std::string params = ss.str();
+
+  uint64_t hash = imtools::hash_bytes(params.data(), params.size());
+  if (!m_bundle_filename.empty()) {
+    hash = imtools::hash_file(trimPath(m_bundle_filename), hash);
+  } else {
+    for (size_t c = 0; c < m_old_image_filenames.size() && c < m_new_image_filenames.size(); ++c) {
+      hash = imtools::hash_file(trimPath(m_old_image_filenames[c]), hash);
+      hash = imtools::hash_file(trimPath(m_new_image_filenames[c]), hash);
+    }
+  }
+
+  return hash;
+}
+
+
+bool
+MergeCommand::_isUnchanged(uint_t i, const State& state, uint64_t plan_hash, StateEntry& entry) const
+{
+  const std::string in_filename  = trimPath(m_input_images[i]);
+  const std::string out_filename = trimPath(m_out_images[i]);
+
+  entry.plan_hash  = plan_hash;
+  entry.input_hash = imtools::hash_file(in_filename);
+
+  auto it = state.find(in_filename + '\t' + out_filename);
+  if (it == state.end() || it->second.plan_hash != plan_hash) {
+    return false;
+  }
+  const StateEntry& prev = it->second;
+
+  // A target patched in place has the output hash on the next run
+  if (entry.input_hash != prev.input_hash
+      && !(in_filename == out_filename && entry.input_hash == prev.output_hash))
+  {
+    return false;
+  }
+
+  // The output may have been modified or removed since then
+  uint64_t output_hash;
+  if (in_filename == out_filename) {
+    output_hash = entry.input_hash;
+  } else if (imtools::file_exists(out_filename)) {
+    output_hash = imtools::hash_file(out_filename);
+  } else {
+    return false;
+  }
+  if (output_hash != prev.output_hash) {
+    return false;
+  }
+
+  entry = prev;
+  return true;
+}
+
+
+void
+MergeCommand::_loadState(State& state) const
+{
+  const std::string filename = trimPath(m_state_filename);
+  FILE* fp = fopen(filename.c_str(), "r");
+  if (!fp) {
+    // No state yet
+    return;
+  }
+
+  char line[PATH_MAX * 2 + 64];
+  while (fgets(line, sizeof(line), fp)) {
+    if (line[0] == '#') {
+      continue;
+    }
+
+    // input<TAB>output<TAB>input_hash<TAB>plan_hash<TAB>output_hash
+    char* in_end = strchr(line, '\t');
+    char* out_end = in_end ? strchr(in_end + 1, '\t') : nullptr;
+    StateEntry entry;
+    unsigned long long input_hash, plan_hash, output_hash;
+
+    if (!out_end || sscanf(out_end + 1, "%llx %llx %llx", &input_hash, &plan_hash, &output_hash) != 3) {
+      warning_log("Skipping invalid line in state file %s", filename.c_str());
+      continue;
+    }
+    entry.input_hash  = input_hash;
+    entry.plan_hash   = plan_hash;
+    entry.output_hash = output_hash;
+    state[std::string(line, out_end - line)] = entry;
+  }
+
+  fclose(fp);
+}
+
+
+void
+MergeCommand::_saveState(const State& state) const
+{
+  const std::string filename     = trimPath(m_state_filename);
+  const std::string tmp_filename = filename + ".tmp";
+
+  FILE* fp = fopen(tmp_filename.c_str(), "w");
+  if (!fp) {
+    throw FileWriteErrorException(tmp_filename);
+  }
+
+  fprintf(fp, "# imtools merge state v1\n");
+  for (auto& it : state) {
+    fprintf(fp, "%s\t%016llx\t%016llx\t%016llx\n", it.first.c_str(),
+        static_cast<unsigned long long>(it.second.input_hash),
+        static_cast<unsigned long long>(it.second.plan_hash),
+        static_cast<unsigned long long>(it.second.output_hash));
+  }
+
+  bool failed = ferror(fp);
+  if (fclose(fp) != 0 || failed || rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+    remove(tmp_filename.c_str());
+    throw FileWriteErrorException(filename);
+  }
+}
+
+
+void
+MergeCommand::run(imtools::CommandResult& result)
+{
+  bool      success     = true;
+  uint_t    n_images    = m_input_images.size();
+  uint_t    n_unchanged = 0;
+  uint_t    i;
+  auto      start       = Clock::now();
+  bool      explain     = !m_explain_filename.empty();
+  // The outputs passed to the output callback don't persist between the runs,
+  // and the standard streams can't be hashed without consuming them
+  bool      incremental = !m_state_filename.empty() && !hasOutputCallback() && !_usesStdio();
+  std::vector<TargetTrace> traces(explain ? n_images : 0);
+  std::vector<StateEntry>  entries(incremental ? n_images : 0);
+  std::vector<char>        unchanged(n_images, 0);
+  State     state;
 
   if (m_out_images.size() != m_input_images.size()) {
     throw ErrorException("Number of input doesn't match number of output images");
   }
 
 #ifdef IMTOOLS_THREADS
+  // Team size of the target loop only. The thread-wide setting is left intact, so that
+  // the nested regions (JPEG decoding, PNG encoding) of a single target use all threads.
   uint_t num_threads = m_input_images.size() >= m_max_threads ? m_max_threads : m_input_images.size();
+  if (num_threads == 0) {
+    num_threads = 1;
+  }
+#endif
 
-  assert(m_out_images.size() == m_input_images.size());
+  // Find targets which are up to date since the previous run
+  if (incremental) {
+    _loadState(state);
+    uint64_t plan_hash = _getPlanHash();
+
+#ifdef IMTOOLS_THREADS
+    _Pragma("omp parallel for reduction(+:n_unchanged)")
+#endif
+    for (i = 0; i < n_images; ++i) {
+      try {
+        if (_isUnchanged(i, state, plan_hash, entries[i])) {
+          unchanged[i] = 1;
+          ++n_unchanged;
+        }
+      } catch (ErrorException& e) {
+        // Will be reported when processing the target
+        debug_log("%s", e.what());
+      }
+    }
+    verbose_log("Skipping %u unchanged of %u targets", n_unchanged, n_images);
+  }
+
+  // Process each unique input once
+  std::vector<std::vector<uint_t>> groups;
+  uint_t n_unique = _groupTargets(groups, unchanged, entries);
+  if (n_unique < n_images - n_unchanged) {
+    char msg[128];
+    snprintf(msg, sizeof(msg), "dedup: %u targets, %u unique (ratio %.2f)",
+        n_images - n_unchanged, n_unique, static_cast<double>(n_images - n_unchanged) / n_unique);
+    verbose_log("%s", msg);
+    invokeEventCallback(msg);
+  }
+
+  std::vector<uint_t> order;
+  _scheduleTargets(order, groups);
+  const uint_t n_order = order.size();
+
+  // Load the changes to be applied to each of m_input_images. The patches are
+  // the same for all targets, so compute them only once.
+  debug_timer_init(t1, t2);
+  debug_timer_start(t1);
+  m_changes.clear();
+  if (n_images > 0 && n_unchanged == n_images && m_save_bundle_filename.empty()) {
+    // Nothing to do
+  } else if (!m_bundle_filename.empty()) {
+    _loadBundle();
+  } else {
+    if (m_old_image_filenames.empty() || m_old_image_filenames.size() != m_new_image_filenames.size()) {
+      throw ErrorException("Expected equal non-zero numbers of old and new images, got %lu and %lu",
+          m_old_image_filenames.size(), m_new_image_filenames.size());
+    }
+    if (m_old_image_filenames.size() > static_cast<size_t>(MAX_MERGE_CHANGES)) {
+      throw ErrorException("Max. number of old/new image pairs exceeded: %d", MAX_MERGE_CHANGES);
+    }
+
+    m_changes.resize(m_old_image_filenames.size());
+    for (size_t c = 0; c < m_changes.size(); ++c) {
+      _loadChange(m_changes[c], trimPath(m_old_image_filenames[c]), trimPath(m_new_image_filenames[c]));
+    }
+  }
+  m_n_boxes = 0;
+  for (auto& change : m_changes) {
+    m_n_boxes += change.patches.size();
+  }
+  debug_timer_end(t1, t2, bound_boxes);
+  double plan_msec = msec_since(start);
+
+  if (!m_save_bundle_filename.empty()) {
+    _saveBundle();
+  }
 
-  IT_INIT_OPENMP(num_threads);
+#ifdef IMTOOLS_THREADS
+  assert(m_out_images.size() == m_input_images.size());
 
   bool r;
   // We'll use `&=` instead of `=` because of restrictions of `omp atomic`.
   // See http://www-01.ibm.com/support/knowledgecenter/SSXVZZ_8.0.0/com.ibm.xlcpp8l.doc/compiler/ref/ruompatm.htm%23RUOMPATM
-  _Pragma("omp parallel for private(r)")
-  for (i = 0; i < n_images; ++i) {
+  uint_t k;
+  // Targets differ in cost a lot, so hand them out one by one in the order of
+  // `_scheduleTargets()`
+  _Pragma("omp parallel for private(r, i) schedule(dynamic, 1) num_threads(num_threads)")
+  for (k = 0; k < n_order; ++k) {
+    i = order[k];
     try {
-      r = _processImage(trimPath(m_input_images[i]), trimPath(m_out_images[i]));
+      r = _processTarget(groups[i], explain ? &traces[i] : nullptr, incremental ? &entries : nullptr);
       if (!r) {
         _Pragma("omp atomic")
         success &= false;
       }
     } catch (ErrorException& e) {
       warning_log("%s", e.what());
+      if (explain) {
+        traces[i].error = e.what();
+      }
       _Pragma("omp atomic")
       success &= false;
     }
   }
 
 #else // no threads
-  for (i = 0; i < n_images; ++i) {
+  for (uint_t k = 0; k < n_order; ++k) {
+    i = order[k];
     try {
-      if (!_processImage(trimPath(m_input_images[i]), trimPath(m_out_images[i])))
+      if (!_processTarget(groups[i], explain ? &traces[i] : nullptr, incremental ? &entries : nullptr))
         success = false;
     } catch (ErrorException& e) {
       warning_log("%s", e.what());
+      if (explain) {
+        traces[i].error = e.what();
+      }
       success = false;
     }
   }
@@ -276,22 +1135,161 @@ MergeCommand::run(imtools::CommandResult& result)
 
   debug_timer_end(t1, t2, run);
 
+  if (incremental) {
+    // Record the targets processed successfully; forget the failed ones
+    for (i = 0; i < n_images; ++i) {
+      std::string key = trimPath(m_input_images[i]) + '\t' + trimPath(m_out_images[i]);
+      if (key.find('\n') != std::string::npos) {
+        continue;
+      }
+      if (entries[i].output_hash || unchanged[i]) {
+        state[key] = entries[i];
+      } else {
+        state.erase(key);
+      }
+    }
+    _saveState(state);
+  }
+
+  if (explain) {
+    for (i = 0; i < n_images; ++i) {
+      if (unchanged[i]) {
+        traces[i].in_filename  = m_input_images[i];
+        traces[i].out_filename = m_out_images[i];
+        traces[i].success = traces[i].unchanged = true;
+      }
+      for (size_t g = 1; g < groups[i].size(); ++g) {
+        TargetTrace& dup = traces[groups[i][g]];
+        dup = traces[i];
+        dup.in_filename  = m_input_images[groups[i][g]];
+        dup.out_filename = m_out_images[groups[i][g]];
+        dup.duplicate_of = traces[i].in_filename;
+        dup.patches.clear();
+      }
+    }
+    _writeExplain(traces, plan_msec, n_unique);
+  }
+
   if (success) {
     result.setValue("OK");
   }
 }
 
 
+void
+MergeCommand::_writeExplain(const std::vector<TargetTrace>& traces, double plan_msec, uint_t n_unique) const
+{
+  const std::string filename = trimPath(m_explain_filename);
+  std::ofstream os(filename);
+  if (!os) {
+    throw FileWriteErrorException(filename);
+  }
+
+  // The plan (common for all targets)
+  os << "{\"type\":\"plan\",\"targets\":" << traces.size()
+    << ",\"unique\":" << n_unique
+    << ",\"min_threshold\":" << m_min_threshold
+    << ",\"max_threshold\":" << m_max_threshold
+    << ",\"band_rows\":" << m_band_rows
+    << ",\"coarse_scale\":" << m_coarse_scale
+    << ",\"bundle\":";
+  json_string(os, m_bundle_filename);
+  os << ",\"changes\":[";
+  for (size_t c = 0; c < m_changes.size(); ++c) {
+    const Change& change = m_changes[c];
+
+    if (c) os << ',';
+    os << "{\"old_image\":";
+    json_string(os, m_old_image_filenames[c]);
+    os << ",\"new_image\":";
+    json_string(os, m_new_image_filenames[c]);
+    os << ",\"width\":" << change.size.width
+      << ",\"height\":" << change.size.height
+      << ",\"boxes\":[";
+    for (size_t i = 0; i < change.patches.size(); ++i) {
+      if (i) os << ',';
+      json_rect(os, change.patches[i].box);
+    }
+    os << "]}";
+  }
+  os << "],\"timings\":{\"plan\":" << plan_msec << "}}\n";
+
+  // Decisions per target
+  for (auto& t : traces) {
+    os << "{\"type\":\"target\",\"input\":";
+    json_string(os, t.in_filename);
+    os << ",\"output\":";
+    json_string(os, t.out_filename);
+    os << ",\"success\":" << (t.success ? "true" : "false");
+    if (t.unchanged) {
+      os << ",\"unchanged\":true";
+    }
+    if (!t.duplicate_of.empty()) {
+      os << ",\"duplicate_of\":";
+      json_string(os, t.duplicate_of);
+    }
+    if (!t.error.empty()) {
+      os << ",\"error\":";
+      json_string(os, t.error);
+    }
+    os << ",\"patches\":[";
+    for (size_t i = 0; i < t.patches.size(); ++i) {
+      const PatchTrace& p = t.patches[i];
+
+      if (i) os << ',';
+      os << "{\"change\":" << p.change << ",\"box\":";
+      json_rect(os, p.box);
+      if (p.huge) {
+        os << ",\"skipped\":\"huge\"}";
+        continue;
+      }
+      os << ",\"homo_box\":";
+      json_rect(os, p.homo_box);
+      os << ",\"match_loc\":";
+      json_point(os, p.match_loc);
+      os << ",\"match_loc_new\":";
+      json_point(os, p.match_loc_new);
+      os << ",\"roi\":";
+      json_rect(os, p.roi);
+      os << ",\"roi_new\":";
+      json_rect(os, p.roi_new);
+      os << ",\"avg_mssim\":";
+      json_number(os, p.avg_mssim);
+      os << ",\"avg_mssim_new\":";
+      json_number(os, p.avg_mssim_new);
+      os << ",\"chosen\":\"" << (p.use_roi_new ? "roi_new" : "roi")
+        << "\",\"time\":" << p.msec << '}';
+    }
+    os << "],\"timings\":{\"read\":" << t.read_msec
+      << ",\"patch\":" << t.patch_msec
+      << ",\"write\":" << t.write_msec << "}}\n";
+  }
+
+  if (!os) {
+    throw FileWriteErrorException(filename);
+  }
+}
+
+
 std::string
 MergeCommand::serialize() const noexcept
 {
   std::stringstream ss;
 
-  ss << m_old_image_filename
-    << m_new_image_filename
+  for (size_t c = 0; c < m_old_image_filenames.size(); ++c) {
+    ss << m_old_image_filenames[c];
+  }
+  for (size_t c = 0; c < m_new_image_filenames.size(); ++c) {
+    ss << m_new_image_filenames[c];
+  }
+  ss << m_bundle_filename
     //<< m_input_images.size()
     << m_out_images.size()
-    << m_strict;
+    << m_strict
+    << ' ' << m_explain_filename
+    << ' ' << m_save_bundle_filename
+    << ' ' << m_state_filename
+    << ' ' << m_encoder_profile.toString();
 
   return ss.str();
 }
@@ -308,12 +1306,35 @@ MergeCommandFactory::getOptionCode(const std::string& o) const noexcept
     case 's':
       if (o == "strict") {
         code = Option::STRICT;
+      } else if (o == "save_bundle") {
+        code = Option::SAVE_BUNDLE;
       } else {
         code = Option::UNKNOWN;
       }
       break;
     case 'i':
-      code = o == "input_images" ? Option::INPUT_IMAGES : Option::UNKNOWN;
+      if (o == "input_images") {
+        code = Option::INPUT_IMAGES;
+      } else if (o == "incremental") {
+        code = Option::INCREMENTAL;
+      } else {
+        code = Option::UNKNOWN;
+      }
+      break;
+    case 'c':
+      code = o == "coarse_scale" ? Option::COARSE_SCALE : Option::UNKNOWN;
+      break;
+    case 'e':
+      code = o == "explain" ? Option::EXPLAIN : Option::UNKNOWN;
+      break;
+    case 'b':
+      if (o == "band_rows") {
+        code = Option::BAND_ROWS;
+      } else if (o == "bundle") {
+        code = Option::BUNDLE;
+      } else {
+        code = Option::UNKNOWN;
+      }
       break;
     case 'o':
       if (o == "old_image") {
@@ -332,6 +1353,8 @@ MergeCommandFactory::getOptionCode(const std::string& o) const noexcept
         code = Option::MIN_THRESHOLD;
       }  else if (o == "max_threshold") {
         code = Option::MAX_THRESHOLD;
+      } else if (o == "match_tile") {
+        code = Option::MATCH_TILE;
       } else {
         code = Option::UNKNOWN;
       }
@@ -345,17 +1368,37 @@ MergeCommandFactory::getOptionCode(const std::string& o) const noexcept
 }
 
 
+void
+MergeCommandFactory::_appendImages(imtools::ImageArray& images, const Command::CValuePtr& value)
+{
+  if (value->getType() == Command::Value::Type::ARRAY) {
+    auto array = value->getArray();
+    images.insert(images.end(), array.begin(), array.end());
+  } else {
+    images.push_back(value->getString());
+  }
+}
+
+
 MergeCommand*
 MergeCommandFactory::create(const Command::Arguments& arguments) const
 {
   imtools::ImageArray input_images;
   imtools::ImageArray out_images;
-  std::string         old_image_filename;
-  std::string         new_image_filename;
+  imtools::ImageArray old_image_filenames;
+  imtools::ImageArray new_image_filenames;
   int                 strict              = 0;
   int                 min_threshold       = imtools::Threshold::THRESHOLD_MIN;
   int                 max_threshold       = imtools::Threshold::THRESHOLD_MAX;
   unsigned            max_threads_num     = imtools::threads::max_threads();
+  int                 band_rows           = 0;
+  int                 coarse_scale        = 0;
+  std::string         explain_filename;
+  std::string         bundle_filename;
+  std::string         save_bundle_filename;
+  std::string         state_filename;
+  int                 match_tile          = 0;
+  EncoderProfile      encoder             = getEncoderProfile(arguments);
 
   for (auto& it : arguments) {
     std::string key = it.first.data();
@@ -368,13 +1411,26 @@ MergeCommandFactory::create(const Command::Arguments& arguments) const
     switch (option) {
       case Option::INPUT_IMAGES:  input_images       = value->getArray();                                break;
       case Option::OUTPUT_IMAGES: out_images         = value->getArray();                                break;
-      case Option::OLD_IMAGE:     old_image_filename = value->getString();                               break;
-      case Option::NEW_IMAGE:     new_image_filename = value->getString();                               break;
+      case Option::OLD_IMAGE:     _appendImages(old_image_filenames, value);                             break;
+      case Option::NEW_IMAGE:     _appendImages(new_image_filenames, value);                             break;
       case Option::STRICT:        strict             = std::stoi(value->getString());                    break;
       case Option::MIN_THRESHOLD: min_threshold      = std::stoi(value->getString());                    break;
       case Option::MAX_THRESHOLD: max_threshold      = std::stoi(value->getString());                    break;
+      case Option::BAND_ROWS:     band_rows          = std::stoi(value->getString());                    break;
+      case Option::COARSE_SCALE:  coarse_scale       = std::stoi(value->getString());                    break;
+      case Option::EXPLAIN:       explain_filename   = value->getString();                               break;
+      case Option::BUNDLE:        bundle_filename    = value->getString();                               break;
+      case Option::SAVE_BUNDLE:   save_bundle_filename = value->getString();                             break;
+      case Option::INCREMENTAL:   state_filename     = value->getString();                               break;
+      case Option::MATCH_TILE:    match_tile         = std::stoi(value->getString());                    break;
       case Option::UNKNOWN:
-      default: warning_log("Skipping unknown key '%s'", key.c_str()); break;
+      default:
+        if (key == "encoder" && value->getType() == Command::Value::Type::STRING) {
+          // Applied by getEncoderProfile()
+        } else if (value->getType() != Command::Value::Type::STRING || !encoder.set(key, value->getString())) {
+          warning_log("Skipping unknown key '%s'", key.c_str());
+        }
+        break;
     }
   }
 
@@ -390,15 +1446,25 @@ MergeCommandFactory::create(const Command::Arguments& arguments) const
   printf("input_images: "); for (auto& it : input_images) { printf("%s ", it.c_str()); } printf("\n");
 #endif
 
-  return new MergeCommand(
+  auto cmd = new MergeCommand(
       input_images,
       out_images,
-      old_image_filename,
-      new_image_filename,
+      old_image_filenames,
+      new_image_filenames,
       strict,
       min_threshold,
       max_threshold,
-      max_threads_num);
+      max_threads_num,
+      band_rows,
+      coarse_scale,
+      explain_filename,
+      bundle_filename,
+      save_bundle_filename,
+      state_filename,
+      match_tile);
+  cmd->setEncoderProfile(encoder);
+
+  return cmd;
 }
 
 // vim: et ts=2 sts=2 sw=2
@@ -17,8 +17,12 @@
 #ifndef IMTOOLS_IMMERGE_API_HXX
 #define IMTOOLS_IMMERGE_API_HXX
 #include <string>
+#include <vector>
+#include <map>
+#include <cstdint>
 #include <opencv2/highgui/highgui.hpp>
 #include "imtools-types.hxx"
+#include "imtools.hxx"
 #include "Command.hxx"
 
 namespace imtools { namespace immerge {
@@ -35,12 +39,19 @@ class MergeCommand : public ::imtools::Command
     MergeCommand(
         const imtools::ImageArray& input_images,
         const imtools::ImageArray& out_images,
-        const std::string& old_image_filename,
-        const std::string& new_image_filename,
+        const imtools::ImageArray& old_image_filenames,
+        const imtools::ImageArray& new_image_filenames,
         int strict,
         int min_threshold,
         int max_threshold,
-        unsigned max_threads_num) noexcept;
+        unsigned max_threads_num,
+        int band_rows = 0,
+        int coarse_scale = 0,
+        const std::string& explain_filename = "",
+        const std::string& bundle_filename = "",
+        const std::string& save_bundle_filename = "",
+        const std::string& state_filename = "",
+        int match_tile = 0) noexcept;
 
     /// Executes the command
     virtual void run(imtools::CommandResult& result) override;
@@ -50,6 +61,10 @@ class MergeCommand : public ::imtools::Command
   public:
     /// Max. number of target images
     static const int MAX_MERGE_TARGETS = 100;
+    /// Max. number of old/new image pairs applied in a single pass
+    static const int MAX_MERGE_CHANGES = 20;
+    /// Version of the patch bundle format
+    static const uint32_t BUNDLE_VERSION = 1;
 
     /*! Min. accepted value of the structural similarity coefficient in (double) strict mode.
      * See http://docs.opencv.org/doc/tutorials/highgui/video-input-psnr-ssim/video-input-psnr-ssim.html#image-similarity-psnr-and-ssim
@@ -68,25 +83,205 @@ class MergeCommand : public ::imtools::Command
   protected:
     imtools::ImageArray m_input_images;
     imtools::ImageArray m_out_images;
-    std::string m_old_image_filename;
-    std::string m_new_image_filename;
+    /*! "Old" images. Each of them forms a change together with the "new" image
+     * of the same index. The changes are applied to a target in order. */
+    imtools::ImageArray m_old_image_filenames;
+    /// "New" images (see `m_old_image_filenames`)
+    imtools::ImageArray m_new_image_filenames;
     /*! Turn some warnings into fatal errors. Can be used multiple times
      * to increase strictness.*/
     int m_strict = 0;
     int m_min_threshold;
     int m_max_threshold;
+    /*! Number of rows in a band for the bounded-memory computation of the bounding
+     * boxes (see imtools::bound_boxes_tiled()). Zero turns the tiled mode off. */
+    int m_band_rows = 0;
+    /*! Scale factor for the multi-resolution difference (see the multi-resolution
+     * version of imtools::diff()). Values less than 2 turn it off. */
+    int m_coarse_scale = 0;
+    /*! Path to file where the merge plan and per-target decisions are written
+     * in NDJSON format. Empty string turns the explain mode off. */
+    std::string m_explain_filename;
+    /*! Patch bundle to load the changes from (see `_saveBundle()`). If not
+     * empty, the old and new images are not required. */
+    std::string m_bundle_filename;
+    /// Path to file where the computed changes are saved as a patch bundle
+    std::string m_save_bundle_filename;
+    /*! Incremental state store. If not empty, targets whose input, output and
+     * plan haven't changed since the previous run are skipped. */
+    std::string m_state_filename;
+    /*! Number of template positions along each side of a tile searched at once
+     * (see imtools::match_template_tiled()). Zero turns the tiled search off. */
+    int m_match_tile = 0;
 
   private:
-    bool _processImage(const std::string& in_filename, const std::string& out_filename);
+    /// Data precomputed for a bounding box of a change. Doesn't depend on targets.
+    struct Patch {
+      /// Rectangle bounding a cluster of changed pixels
+      BoundBox box;
+      /// `box` enlarged by imtools::make_heterogeneous() on the old image
+      BoundBox homo_box;
+      /// Area of `homo_box` on the old image
+      cv::Mat old_tpl;
+      /// Area of `box` on the new image
+      cv::Mat new_tpl;
+      /// Statistics of `new_tpl` for imtools::get_MSSIM()
+      imtools::MSSIMStats new_tpl_stats;
+    };
+
+    /// Modification specified by a pair of "old" and "new" images
+    struct Change {
+      /// Size of the old (and the new) image
+      cv::Size size;
+      /// Patches for the clusters of changed pixels between the old and the new images
+      std::vector<Patch> patches;
+    };
+
+    /// Decisions made for a bounding box on a target image (explain mode)
+    struct PatchTrace {
+      /// Index of the change (old/new image pair)
+      size_t    change        = 0;
+      BoundBox  box;
+      BoundBox  homo_box;
+      cv::Point match_loc;
+      cv::Point match_loc_new;
+      cv::Rect  roi;
+      cv::Rect  roi_new;
+      double    avg_mssim     = 0.;
+      double    avg_mssim_new = 0.;
+      /// Whether the box has been skipped as suspiciously large
+      bool      huge          = false;
+      /// Whether `roi_new` has been chosen over `roi`
+      bool      use_roi_new   = false;
+      /// Time spent on the patch in milliseconds
+      double    msec          = 0.;
+    };
+
+    /// Locations of the templates of a patch found on a target
+    struct PatchMatch {
+      /// Location of the old template
+      cv::Point match_loc;
+      /// Location of the new template
+      cv::Point match_loc_new;
+      /// Whether the box has been skipped as suspiciously large
+      bool      huge = false;
+      /// Time spent on the search in milliseconds
+      double    msec = 0.;
+    };
+
+    /// Content hashes recorded for a target in the incremental state store
+    struct StateEntry {
+      uint64_t input_hash  = 0;
+      uint64_t plan_hash   = 0;
+      uint64_t output_hash = 0;
+    };
+    /// Incremental state keyed by "input<TAB>output" path pairs
+    typedef std::map<std::string, StateEntry> State;
+
+    /// Per-target data collected in explain mode
+    struct TargetTrace {
+      std::string in_filename;
+      std::string out_filename;
+      bool        success    = false;
+      /// Whether the target has been skipped as unchanged (incremental mode)
+      bool        unchanged  = false;
+      /// Input of the target whose result has been copied (deduplicated target)
+      std::string duplicate_of;
+      std::string error;
+      std::vector<PatchTrace> patches;
+      /// Stage timings in milliseconds
+      double      read_msec  = 0.;
+      double      patch_msec = 0.;
+      double      write_msec = 0.;
+    };
+
+    /*! \param in_filenames Input files with the same contents. The first one is read.
+     * \param out_filenames Output files, one per input. The image is encoded once,
+     * then the bytes are written to each of them.
+     * \param trace Optional pointer to the structure which is filled with
+     * the decisions made for the target in explain mode. */
+    bool _processImage(const imtools::ImageArray& in_filenames, const imtools::ImageArray& out_filenames,
+        TargetTrace* trace = nullptr);
+
+    /// Loads the images of a change and computes its patches
+    void _loadChange(Change& change, const std::string& old_filename, const std::string& new_filename) const;
+
+    /// Fills the data of `patch` which is derived from the templates
+    static void _preparePatch(Patch& patch);
+
+    /*! Saves `m_changes` to `m_save_bundle_filename`.
+     *
+     * The bundle is a binary file with the following layout (integers are
+     * little-endian, strings and blobs are prefixed with uint32 length):
+     * - magic "IMTB", uint32 version, uint32 number of changes;
+     * - for each change: old and new image paths, int32 width and height,
+     *   uint32 number of patches;
+     * - for each patch: int32 x, y, width, height of the box and the homo box,
+     *   PNG-encoded old and new templates.
+     */
+    void _saveBundle() const;
+
+    /// Loads `m_changes` from `m_bundle_filename` (see `_saveBundle()`)
+    void _loadBundle();
+
+    /*! Searches for the templates of `patch` on `img`.
+     * \returns false on error (pushed to the error stack).
+     */
+    bool _matchPatch(const Patch& patch, const cv::Mat& img, PatchMatch& match) const;
 
-    /*! Applies a patch using a bounding box.
+    /*! Applies a patch.
      *
-     * \param box Specifies patch area on a canvas of the size of `g_old_img` matrix (of size equal to the size of `g_new_img` matrix).
-     * \param in_img Input image which will be patched.
-     * \param out_img Output image previously cloned from `in_img`.
+     * \param patch Specifies patch area on a canvas of the size of the old image, and the templates.
+     * \param match Locations of the templates found by `_matchPatch()`.
+     * \param out_img Image being patched.
      * \param patched_boxes Patches which have been applied on `out_img`
      */
-    bool _processPatch(const BoundBox& box, const cv::Mat& in_img, cv::Mat& out_img, BoundBoxVector& patched_boxes);
+    bool _processPatch(const Patch& patch, const PatchMatch& match, cv::Mat& out_img,
+        BoundBoxVector& patched_boxes, PatchTrace* trace = nullptr);
+
+    /*! Processes a group of targets having identical inputs and output formats.
+     * In incremental mode, stores the output hash in the `entries` of the group.
+     * \param targets Indexes of the targets. Only the input of the first one is read. */
+    bool _processTarget(const std::vector<uint_t>& targets, TargetTrace* trace,
+        std::vector<StateEntry>* entries);
+
+    /*! Groups targets with identical input contents and output formats.
+     * \param groups Output vector. `groups[i]` lists indexes of the targets
+     * processed together with target `i`, or is empty, if target `i` is
+     * processed within another group, or is `unchanged`.
+     * \param entries Incremental state entries with input hashes (optional).
+     * \returns number of groups */
+    uint_t _groupTargets(std::vector<std::vector<uint_t>>& groups, const std::vector<char>& unchanged,
+        const std::vector<StateEntry>& entries) const;
+
+    /// \returns whether the inputs of targets `i` and `j` have the same bytes
+    bool _inputsEqual(uint_t i, uint_t j) const noexcept;
+
+    /// \returns whether any of the inputs or outputs is a standard stream (see imtools::is_stdio())
+    bool _usesStdio() const noexcept;
+
+    /*! Orders the groups by estimated cost, the most expensive first, so that
+     * a huge target doesn't start at the end of the run while the other threads
+     * are idle (longest processing time first).
+     * \param order Output vector of the indexes of non-empty `groups` */
+    void _scheduleTargets(std::vector<uint_t>& order, const std::vector<std::vector<uint_t>>& groups) const;
+
+    /*! \returns hash identifying the plan, i.e. the contents of the old and new
+     * images (or the bundle) and the parameters affecting the patches */
+    uint64_t _getPlanHash() const;
+
+    /*! Checks if target number `i` is up to date according to `state`.
+     * \param entry Filled with the current hashes of the target. */
+    bool _isUnchanged(uint_t i, const State& state, uint64_t plan_hash, StateEntry& entry) const;
+
+    /// Loads the incremental state from `m_state_filename`
+    void _loadState(State& state) const;
+
+    /// Atomically saves the incremental state to `m_state_filename`
+    void _saveState(const State& state) const;
+
+    /// Writes the merge plan and `traces` to `m_explain_filename` in NDJSON format
+    void _writeExplain(const std::vector<TargetTrace>& traces, double plan_msec, uint_t n_unique) const;
 
     /*! Checks if box is suspiciously large
      *
@@ -96,13 +291,10 @@ class MergeCommand : public ::imtools::Command
     static bool _isHugeBoundBox(const BoundBox& box, const cv::Mat& out_img);
 
   private:
-    /// Matrix for the "old" image.
-    cv::Mat m_old_img;
-    /// Matrix for the "new" image.
-    cv::Mat m_new_img;
-    /// Matrix for a binary image representing differences between original (`g_old_img`) and
-    /// modified (`g_new_img`) images where modified spots have high values.
-    cv::Mat m_diff_img;
+    /// Changes to apply, in order
+    std::vector<Change> m_changes;
+    /// Total number of patches in `m_changes`
+    size_t m_n_boxes = 0;
     /// Maximum number of parallel threads
     unsigned m_max_threads = 4;
 };
@@ -120,7 +312,14 @@ class MergeCommandFactory : public ::imtools::CommandFactory
       MIN_THRESHOLD,
       MAX_THRESHOLD,
       INPUT_IMAGES,
-      OUTPUT_IMAGES
+      OUTPUT_IMAGES,
+      BAND_ROWS,
+      COARSE_SCALE,
+      EXPLAIN,
+      BUNDLE,
+      SAVE_BUNDLE,
+      INCREMENTAL,
+      MATCH_TILE
     };
 
     using ::imtools::CommandFactory::CommandFactory;
@@ -131,6 +330,10 @@ class MergeCommandFactory : public ::imtools::CommandFactory
     /*! \param o option name
      * \returns numeric representation of option name for comparisions. */
     virtual int getOptionCode(const std::string& o) const noexcept override;
+
+  private:
+    /// Appends a single image or an array of images specified by `value` to `images`
+    static void _appendImages(imtools::ImageArray& images, const Command::CValuePtr& value);
 };
 
 
@@ -27,6 +27,7 @@
 
 using imtools::uint_t;
 using imtools::file_exists;
+using imtools::probe_image;
 using imtools::ErrorException;
 using imtools::InvalidCliArgException;
 using namespace imtools::immerge;
@@ -51,6 +52,24 @@ usage(bool is_error)
 }
 
 
+/*! Checks an image file by its header.
+ * \returns true, if the file is an image with a valid header, or exists, but has a
+ * format which `probe_image()` doesn't recognize (left to OpenCV). False, if the file
+ * doesn't exist, or its format is recognized, but the header is truncated or invalid.
+ */
+static bool
+check_image(const char* filename)
+{
+  imtools::ImageInfo info;
+
+  if (probe_image(info, filename)) {
+    return true;
+  }
+  return info.format == imtools::ImageFormat::UNKNOWN
+    && (imtools::is_stdio(filename) || file_exists(filename));
+}
+
+
 /*! Loads images specified by the CLI arguments into memory
 *
 * \param argc The number of elements in `argv`
@@ -62,12 +81,13 @@ usage(bool is_error)
 static void
 load_images(const int argc, char** argv)
 {
-  if (optind >= argc) {
+  if (optind >= argc && g_save_bundle_filename.empty()) {
     strict_log(g_strict, "Target image(s) expected. "
         "You don't need this tool just to replace one image with another ;)\n");
     exit(1);
   }
 
+  // Only headers are read here, so that bad inputs are rejected before any decoding
   if (g_pairs) {
     // `argv` is a list of input and output files:
     // `infile outfile infile2 outfile2 ...`
@@ -82,8 +102,8 @@ load_images(const int argc, char** argv)
         }
 
         // Input file
-        if (!file_exists(filename)) {
-          strict_log(g_strict, "image %s doesn't exist.", filename);
+        if (!check_image(filename)) {
+          strict_log(g_strict, "image %s doesn't exist or is not a supported image.", filename);
           break;
         }
         g_input_images.push_back(filename);
@@ -107,8 +127,8 @@ load_images(const int argc, char** argv)
       }
 
       const char* const filename = argv[optind++];
-      if (!file_exists(filename)) {
-        strict_log(g_strict, "image %s doesn't exist.", filename);
+      if (!check_image(filename)) {
+        strict_log(g_strict, "image %s doesn't exist or is not a supported image.", filename);
         break;
       }
       g_input_images.push_back(filename);
@@ -118,11 +138,26 @@ load_images(const int argc, char** argv)
     g_out_images = g_input_images;
   }
 
-  if (g_old_image_filename.length() == 0 || g_new_image_filename.length() == 0) {
+  if (!g_bundle_filename.empty()) {
+    if (!g_old_image_filenames.empty() || !g_new_image_filenames.empty()) {
+      warning_log("old and new images are ignored when a patch bundle is loaded");
+      g_old_image_filenames.clear();
+      g_new_image_filenames.clear();
+    }
+    return;
+  }
+
+  if (g_old_image_filenames.empty() || g_new_image_filenames.empty()) {
     strict_log(g_strict, "expected non-empty image paths for comparison.\n");
     exit(1);
   }
 
+  if (g_old_image_filenames.size() != g_new_image_filenames.size()) {
+    strict_log(g_strict, "number of old images (%lu) doesn't match number of new images (%lu).\n",
+        g_old_image_filenames.size(), g_new_image_filenames.size());
+    exit(1);
+  }
+
 }
 
 
@@ -133,6 +168,7 @@ main(int argc, char **argv)
   int exit_code   = 0;
 
   g_program_name = argv[0];
+  imtools::set_stdio_enabled(true);
 
 #ifdef IMTOOLS_THREADS
   g_max_threads = max_threads();
@@ -154,13 +190,13 @@ main(int argc, char **argv)
 
         case 'n':
         case 'o':
-          if (!file_exists(optarg)) {
-            throw InvalidCliArgException("File %s doesn't exist", optarg);
+          if (!check_image(optarg)) {
+            throw InvalidCliArgException("File %s doesn't exist or is not a supported image", optarg);
           }
           if (next_option == 'n') {
-            g_new_image_filename = optarg;
+            g_new_image_filenames.push_back(optarg);
           } else {
-            g_old_image_filename = optarg;
+            g_old_image_filenames.push_back(optarg);
           }
           break;
 
@@ -172,6 +208,59 @@ main(int argc, char **argv)
           save_int_opt_arg(g_max_threshold, "Invalid max threshold\n");
           break;
 
+        case 'B':
+          save_int_opt_arg(g_band_rows, "Invalid band rows\n");
+          if (g_band_rows < 0) {
+            throw InvalidCliArgException("Band rows must be non-negative");
+          }
+          break;
+
+        case 'C':
+          save_int_opt_arg(g_coarse_scale, "Invalid coarse scale\n");
+          if (g_coarse_scale < 0) {
+            throw InvalidCliArgException("Coarse scale must be non-negative");
+          }
+          break;
+
+        case 'E':
+          g_explain_filename = optarg;
+          break;
+
+        case 'b':
+          if (!file_exists(optarg)) {
+            throw InvalidCliArgException("File %s doesn't exist", optarg);
+          }
+          g_bundle_filename = optarg;
+          break;
+
+        case 'W':
+          g_save_bundle_filename = optarg;
+          break;
+
+        case 'I':
+          g_state_filename = optarg;
+          break;
+
+        case 'M':
+          save_int_opt_arg(g_match_tile, "Invalid match tile\n");
+          if (g_match_tile < 0) {
+            throw InvalidCliArgException("Match tile must be non-negative");
+          }
+          break;
+
+        case 'e':
+          try {
+            imtools::Command::setDefaultEncoderProfile(imtools::EncoderProfile::get(optarg));
+          } catch (ErrorException& e) {
+            throw InvalidCliArgException("%s", e.what());
+          }
+          g_encoder = optarg;
+          break;
+
+        case 'f':
+          g_format = optarg;
+          break;
+
 #ifdef IMTOOLS_THREADS
         case 'T':
           {
@@ -218,6 +307,17 @@ main(int argc, char **argv)
           exit(2);
       }
     } while (next_option != -1);
+
+    if (!g_format.empty()) {
+      // Applied after --encoder, which replaces the default profile
+      imtools::EncoderProfile profile(imtools::Command::getDefaultEncoderProfile());
+      try {
+        profile.set("format", g_format);
+      } catch (ErrorException& e) {
+        throw InvalidCliArgException("%s", e.what());
+      }
+      imtools::Command::setDefaultEncoderProfile(profile);
+    }
   } catch (imtools::InvalidCliArgException& e) {
     error_log("%s", e.what());
     exit(2);
@@ -227,6 +327,15 @@ main(int argc, char **argv)
   debug_log("strict: %d",          (int) g_strict);
   debug_log("min-threshold: %d",   g_min_threshold);
   debug_log("max-threshold: %d",   g_max_threshold);
+  debug_log("band-rows: %d",       g_band_rows);
+  debug_log("coarse-scale: %d",    g_coarse_scale);
+  debug_log("explain: %s",         g_explain_filename.c_str());
+  debug_log("bundle: %s",          g_bundle_filename.c_str());
+  debug_log("save-bundle: %s",     g_save_bundle_filename.c_str());
+  debug_log("incremental: %s",     g_state_filename.c_str());
+  debug_log("match-tile: %d",      g_match_tile);
+  debug_log("encoder: %s",         g_encoder.c_str());
+  debug_log("format: %s",          g_format.c_str());
 #ifdef IMTOOLS_THREADS
   debug_log("max-threads: %d",     g_max_threads);
 #endif
@@ -237,19 +346,33 @@ main(int argc, char **argv)
     load_images(argc, argv);
     debug_timer_end(t1, t2, load_images());
 
+    for (auto& filename : g_out_images) {
+      if (imtools::is_stdio(filename)) {
+        // Keep the image data intact
+        imtools::log::set_stderr_only(true);
+      }
+    }
+
     debug_log("input_images size: %ld", g_input_images.size());
     debug_log("out_images size: %ld",   g_out_images.size());
-    debug_log("new image filename: %s", g_new_image_filename.c_str());
-    debug_log("old image filename: %s", g_old_image_filename.c_str());
+    debug_log("new images size: %ld",   g_new_image_filenames.size());
+    debug_log("old images size: %ld",   g_old_image_filenames.size());
 
     MergeCommand cmd(g_input_images,
         g_out_images,
-        g_old_image_filename,
-        g_new_image_filename,
+        g_old_image_filenames,
+        g_new_image_filenames,
         g_strict,
         g_min_threshold,
         g_max_threshold,
-        g_max_threads);
+        g_max_threads,
+        g_band_rows,
+        g_coarse_scale,
+        g_explain_filename,
+        g_bundle_filename,
+        g_save_bundle_filename,
+        g_state_filename,
+        g_match_tile);
     imtools::CommandResult result;
     cmd.run(result);
     if (!result) {
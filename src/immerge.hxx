@@ -32,8 +32,10 @@ const char* g_program_name;
 int g_min_threshold = THRESHOLD_MIN;
 int g_max_threshold = THRESHOLD_MAX;
 
-std::string g_old_image_filename;
-std::string g_new_image_filename;
+/// Old images; each forms a change with the new image of the same index
+ImageArray g_old_image_filenames;
+/// New images
+ImageArray g_new_image_filenames;
 
 /// Whether non-option ARGV-elements are interpreted as `input-file output-file` pairs
 bool g_pairs = false;
@@ -41,6 +43,33 @@ bool g_pairs = false;
 /// Whether to turn warnings into fatal errors
 int g_strict = 0;
 
+/// Number of rows in a band for bounded-memory diff (0 - off)
+int g_band_rows = 0;
+
+/// Scale factor for the multi-resolution diff (0 - off)
+int g_coarse_scale = 0;
+
+/// File where the merge plan and per-target decisions are written (explain mode)
+std::string g_explain_filename;
+
+/// Patch bundle to load the changes from
+std::string g_bundle_filename;
+
+/// File where the computed changes are saved as a patch bundle
+std::string g_save_bundle_filename;
+
+/// Incremental state store
+std::string g_state_filename;
+
+/// Number of template positions along each side of a search tile (0 - off)
+int g_match_tile = 0;
+
+/// Encoder profile (empty - built-in settings)
+std::string g_encoder;
+
+/// Output format (empty - by the file extension)
+std::string g_format;
+
 /// Input images.
 ImageArray g_input_images;
 /// Output images.
@@ -58,7 +87,8 @@ const char* g_usage_template = IMTOOLS_FULL_NAME "\n\n" IMTOOLS_COPYRIGHT "\n\n"
 "The tool can be useful to update a logo or some common elements on a set of \"similar\" images.\n"
 "Note: the bigger difference in quality the higher min. thresholds are required.\n\n"
 "IMAGES:\n"
-"Arguments specifying the target image paths.\n\n"
+"Arguments specifying the target image paths. \"-\" stands for stdin as an input,\n"
+"and for stdout as an output (also for --old-image and --new-image).\n\n"
 "OPTIONS:\n"
 " -h, --help                 Display this help.\n"
 " -V, --version              Print version\n"
@@ -66,14 +96,44 @@ const char* g_usage_template = IMTOOLS_FULL_NAME "\n\n" IMTOOLS_COPYRIGHT "\n\n"
 "                            to increase verbosity (e.g. -vv). Default: off.\n"
 " -s, --strict               Turn some warnings into fatal errors. Can be used multiple times\n"
 "                            to increase strictness. Default: off.\n"
-" -n, --new-image            New image. Required.\n"
-" -o, --old-image            Old image. Required.\n"
+" -n, --new-image            New image. Required. Can be used multiple times\n"
+"                            together with --old-image in order to apply several changes\n"
+"                            in a single pass (the Nth new image pairs with the Nth old image).\n"
+" -o, --old-image            Old image. Required. Can be used multiple times.\n"
 " -p, --pairs                Interpret IMAGES as a list of input and output file pairs.\n"
 #if 0
 " -m, --mod-threshold        Modification threshold in %%. Default: %d.\n"
 #endif
 " -L, --min-threshold        Min. noise suppression threshold. Default: %2$d.\n"
 " -H, --max-threshold        Max. noise suppression threshold. Default: %3$d.\n"
+" -B, --band-rows            Compute the difference in bands of this number of rows\n"
+"                            in order to bound memory usage on huge images. Default: 0 (off).\n"
+" -C, --coarse-scale         Compute the difference on images downscaled by this factor first,\n"
+"                            then refine only the tiles which changed. Ignored with --band-rows.\n"
+"                            Default: 0 (off).\n"
+" -E, --explain              Write the merge plan and per-target decisions (boxes, match locations,\n"
+"                            similarity scores, timings in msec) to this file in NDJSON format.\n"
+" -b, --bundle               Load the changes from a patch bundle instead of comparing\n"
+"                            --old-image and --new-image.\n"
+" -W, --save-bundle          Save the computed changes to a patch bundle. IMAGES are optional\n"
+"                            with this option.\n"
+" -I, --incremental          Incremental mode. Skip targets whose input, output and changes\n"
+"                            haven't changed since the previous run according to this state file\n"
+"                            (content hashes). The file is updated after the run.\n"
+" -M, --match-tile           Search templates on targets in tiles of this number of positions\n"
+"                            along each side in order to bound memory usage on huge targets.\n"
+"                            Equally good matches may be resolved to a different location.\n"
+"                            Default: 0 (off).\n"
+" -e, --encoder              Encoder profile. Possible values:\n"
+"    fastest  - PNG compression level 1, baseline JPEG, WebP method 1\n"
+"    balanced - PNG compression level 6, optimized JPEG, WebP method 4\n"
+"    smallest - PNG compression level 9, optimized progressive JPEG,\n"
+"               WebP method 6\n"
+"                            All of the profiles encode PNG on multiple threads.\n"
+"                            Default: PNG compression level 9, baseline JPEG.\n"
+"                            The output format is chosen by the file extension (e.g. .webp).\n"
+" -f, --format               Output format overriding the file extensions: jpg, png, webp, etc.\n"
+"                            Default: by the file extension; png for stdout.\n"
 #ifdef IMTOOLS_THREADS
 " -T, --max-threads          Max. number of concurrent threads. Default: %4$d.\n"
 #endif
@@ -81,13 +141,20 @@ const char* g_usage_template = IMTOOLS_FULL_NAME "\n\n" IMTOOLS_COPYRIGHT "\n\n"
 "To apply changes between old.png and new.png to copies of old1.png and old2.png (out1.png and out2.png):\n"
 "%1$s -o old.png -n new.png -p old1.png out1.png old2.png out2.png\n\n"
 "To apply changes between old.png and new.png to old2.png (old2.png will be overwritten):\n"
-"%1$s -o old.png -n new.png old2.png\n";
+"%1$s -o old.png -n new.png old2.png\n\n"
+"To apply changes between old.png and new.png, and between old2.png and new2.png to out.png:\n"
+"%1$s -o old.png -n new.png -o old2.png -n new2.png out.png\n\n"
+"To precompute changes between old.png and new.png once, then apply them to old2.png:\n"
+"%1$s -o old.png -n new.png -W changes.imb\n"
+"%1$s -b changes.imb old2.png\n\n"
+"To apply changes between old.png and new.png to an image read from stdin, and write the result to stdout:\n"
+"%1$s -o old.png -n new.png -f jpg - < old3.jpg > out3.jpg\n";
 
 
 /////////////////////////////////////////////////////////////////////
 // CLI arguments.
 
-const char *g_short_options = "hvVsn:o:pm:L:H:"
+const char *g_short_options = "hvVsn:o:pm:L:H:B:C:E:b:W:I:M:e:f:"
 #ifdef IMTOOLS_THREADS
   "T:"
 #endif
@@ -105,6 +172,15 @@ const struct option g_long_options[] = {
 #endif
   {"min-threshold", required_argument, NULL, 'L'},
   {"max-threshold", required_argument, NULL, 'H'},
+  {"band-rows",     required_argument, NULL, 'B'},
+  {"coarse-scale",  required_argument, NULL, 'C'},
+  {"explain",       required_argument, NULL, 'E'},
+  {"bundle",        required_argument, NULL, 'b'},
+  {"save-bundle",   required_argument, NULL, 'W'},
+  {"incremental",   required_argument, NULL, 'I'},
+  {"match-tile",    required_argument, NULL, 'M'},
+  {"encoder",       required_argument, NULL, 'e'},
+  {"format",        required_argument, NULL, 'f'},
 #ifdef IMTOOLS_THREADS
   {"max-threads",   required_argument, NULL, 'T'},
 #endif
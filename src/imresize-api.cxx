@@ -22,16 +22,241 @@
 
 #include <cmath> // for isgreater()
 #include <string>
+#include <algorithm>
+#include <stdexcept>
+#include <sstream>
+#include <tuple>
+#include <cerrno>
+#include <cstring>
+#include <cinttypes>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <utime.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+# include <linux/fs.h> // FICLONE
+#endif
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 
 #include "log.hxx"
 #include "exceptions.hxx"
+#include "threads.hxx"
+#include "imtools.hxx"
+#include "resample.hxx"
+#include "rowreader.hxx"
+#ifdef IMTOOLS_HAVE_LIBJPEG
+# include "jpegreader.hxx"
+#endif
+#ifdef IMTOOLS_HAVE_ZLIB
+# include "pngreader.hxx"
+#endif
 
 using imtools::imresize::ResizeCommand;
 using imtools::imresize::ResizeCommandFactory;
+using imtools::imresize::ThumbnailCache;
+using imtools::imresize::ThumbnailCachePtr;
 using imtools::CommandResult;
 
+ThumbnailCachePtr ResizeCommand::s_cache{nullptr};
+ResizeCommand::Resampler ResizeCommand::s_resampler{ResizeCommand::Resampler::AUTO};
+
+
+/*! Copies file `from` into new file `to`. The data is shared copy-on-write
+ * (reflink), if the filesystem supports it.
+ * \returns false on error */
+static bool
+copy_file(const std::string& from, const std::string& to)
+{
+  int in_fd = open(from.c_str(), O_RDONLY);
+  if (in_fd == -1) {
+    return false;
+  }
+  int out_fd = open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+  if (out_fd == -1) {
+    close(in_fd);
+    return false;
+  }
+
+  bool success = false;
+#ifdef FICLONE
+  success = ioctl(out_fd, FICLONE, in_fd) == 0;
+#endif
+  if (!success) {
+    char buf[65536];
+    ssize_t n;
+
+    success = true;
+    while (success && (n = read(in_fd, buf, sizeof(buf))) != 0) {
+      if (n < 0) {
+        success = errno == EINTR;
+        continue;
+      }
+      for (ssize_t written = 0, w; written < n; written += w) {
+        if ((w = write(out_fd, buf + written, n - written)) < 0) {
+          success = false;
+          break;
+        }
+      }
+    }
+  }
+
+  close(in_fd);
+  return (close(out_fd) == 0 && success);
+}
+
+
+/*! Atomically replaces `to` with a copy of `from`. The files don't share an
+ * inode, so rewriting one of them in place doesn't affect the other.
+ * \returns false on error */
+static bool
+replace_with_copy(const std::string& from, const std::string& to)
+{
+  static std::atomic<unsigned> counter{0};
+  std::string tmp(to + ".tmp" + std::to_string(getpid()) + '.' + std::to_string(counter++));
+
+  if (!copy_file(from, tmp)) {
+    unlink(tmp.c_str());
+    return false;
+  }
+  if (rename(tmp.c_str(), to.c_str()) != 0) {
+    unlink(tmp.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+/////////////////////////////////////////////////////////////////////
+
+ThumbnailCache::ThumbnailCache(const std::string& dir, uint64_t max_size)
+: m_dir(dir),
+  m_max_size(max_size)
+{
+  if (mkdir(m_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+    throw ErrorException("Failed to create cache directory '%s': %s", m_dir.c_str(), strerror(errno));
+  }
+
+  // Find the current size, and trim the cache, if the limit has been lowered
+  _evict();
+}
+
+
+std::string
+ThumbnailCache::makeKey(const std::string& source, const std::string& params, const std::string& ext)
+{
+  struct stat st;
+  if (stat(source.c_str(), &st) != 0) {
+    return std::string();
+  }
+
+  std::stringstream ss;
+  ss << st.st_dev << ' ' << st.st_ino << ' ' << st.st_size << ' '
+    << st.st_mtime << ' ' << st.st_ctime << ' ' << params;
+  const std::string id(ss.str());
+
+  char hex[17];
+  snprintf(hex, sizeof(hex), "%016" PRIx64, imtools::hash_bytes(id.data(), id.size()));
+
+  return std::string(hex) + ext;
+}
+
+
+bool
+ThumbnailCache::fetch(const std::string& key, const std::string& output)
+{
+  const std::string entry(m_dir + '/' + key);
+
+  if (!replace_with_copy(entry, output)) {
+    ++m_misses;
+    return false;
+  }
+
+  // Mark as recently used
+  utime(entry.c_str(), nullptr);
+  ++m_hits;
+
+  return true;
+}
+
+
+void
+ThumbnailCache::store(const std::string& key, const std::string& output)
+{
+  const std::string entry(m_dir + '/' + key);
+  struct stat st;
+
+  if (!replace_with_copy(output, entry) || stat(entry.c_str(), &st) != 0) {
+    warning_log("Failed to store %s in cache %s", output.c_str(), m_dir.c_str());
+    return;
+  }
+
+  if ((m_size += st.st_size) > m_max_size && m_max_size > 0) {
+    _evict();
+  }
+}
+
+
+void
+ThumbnailCache::_evict()
+{
+  std::lock_guard<std::mutex> lock(m_evict_lock);
+
+  DIR* dir = opendir(m_dir.c_str());
+  if (!dir) {
+    warning_log("opendir(%s): %s", m_dir.c_str(), strerror(errno));
+    return;
+  }
+
+  // (mtime, size, path)
+  std::vector<std::tuple<time_t, off_t, std::string>> entries;
+  uint64_t size = 0;
+  struct dirent* de;
+  struct stat st;
+
+  while ((de = readdir(dir)) != nullptr) {
+    if (de->d_name[0] == '.') {
+      continue;
+    }
+    std::string path(m_dir + '/' + de->d_name);
+    if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+      entries.emplace_back(st.st_mtime, st.st_size, path);
+      size += st.st_size;
+    }
+  }
+  closedir(dir);
+
+  if (m_max_size > 0 && size > m_max_size) {
+    // Leave some room, so that we don't scan the directory on every store
+    const uint64_t low_mark = m_max_size - m_max_size / 10;
+
+    std::sort(entries.begin(), entries.end());
+    for (auto& e : entries) {
+      if (size <= low_mark) {
+        break;
+      }
+      if (unlink(std::get<2>(e).c_str()) == 0) {
+        size -= std::get<1>(e);
+        ++m_evictions;
+      }
+    }
+  }
+
+  m_size = size;
+}
+
+
+ThumbnailCache::Stats
+ThumbnailCache::getStats() const noexcept
+{
+  return Stats{m_hits, m_misses, m_evictions, m_size};
+}
+
+/////////////////////////////////////////////////////////////////////
+
 
 ResizeCommand::ResizeCommand(const std::string& source,
     const std::string& output,
@@ -40,13 +265,20 @@ ResizeCommand::ResizeCommand(const std::string& source,
     double fx,
     double fy,
     int interpolation) noexcept
-: m_source(source),
-  m_output(output),
-  m_width(width),
-  m_height(height),
-  m_fx(fx),
-  m_fy(fy),
-  m_interpolation(interpolation)
+: m_items(1, Item{source, Targets(1, Target(output, width, height, fx, fy, interpolation))})
+{
+}
+
+
+ResizeCommand::ResizeCommand(const std::string& source, const Targets& targets) noexcept
+: m_items(1, Item{source, targets})
+{
+}
+
+
+ResizeCommand::ResizeCommand(const Items& items, unsigned max_threads_num) noexcept
+: m_items(items),
+  m_max_threads(max_threads_num)
 {
 }
 
@@ -90,11 +322,22 @@ ResizeCommandFactory::getOptionCode(const std::string& o) const noexcept
   Option code;
 
   switch (o[0]) {
+    case 'c':
+      code = o == "crop" ? Option::CROP : Option::UNKNOWN;
+      break;
+    case 'g':
+      code = o == "gravity" ? Option::GRAVITY : Option::UNKNOWN;
+      break;
     case 's':
-      code = o == "source" ? Option::SOURCE : Option::UNKNOWN;
+      code = o == "source" ? Option::SOURCE
+        : (o == "sources" ? Option::SOURCES : Option::UNKNOWN);
+      break;
+    case 't':
+      code = o == "targets" ? Option::TARGETS : Option::UNKNOWN;
       break;
     case 'o':
-      code = o == "output" ? Option::OUTPUT : Option::UNKNOWN;
+      code = o == "output" ? Option::OUTPUT
+        : (o == "outputs" ? Option::OUTPUTS : Option::UNKNOWN);
       break;
     case 'w':
       code = o == "width" ? Option::WIDTH : Option::UNKNOWN;
@@ -118,31 +361,676 @@ ResizeCommandFactory::getOptionCode(const std::string& o) const noexcept
 }
 
 
+ResizeCommand::Target
+ResizeCommandFactory::parseTarget(const std::string& spec)
+{
+  ResizeCommand::Target target;
+
+  size_t colon = spec.find(':');
+  if (colon == std::string::npos || colon + 1 == spec.size()) {
+    throw ErrorException("Invalid target '%s'. Expected GEOMETRY[/INTERPOLATION]:OUTPUT", spec.c_str());
+  }
+  target.output = spec.substr(colon + 1);
+
+  std::string geometry = spec.substr(0, colon);
+  size_t slash = geometry.find('/');
+  if (slash != std::string::npos) {
+    target.interpolation = _getInterpolationCode(geometry.substr(slash + 1));
+    geometry.resize(slash);
+  }
+
+  bool valid = false;
+  try {
+    size_t sep, pos;
+    if ((sep = geometry.find('x')) != std::string::npos) {
+      target.width  = std::stoul(geometry.substr(0, sep), &pos);
+      valid = pos == sep;
+      target.height = std::stoul(geometry.substr(sep + 1), &pos);
+      valid = valid && pos == geometry.size() - sep - 1;
+    } else if ((sep = geometry.find(',')) != std::string::npos) {
+      target.fx = std::stod(geometry.substr(0, sep), &pos);
+      valid = pos == sep;
+      target.fy = std::stod(geometry.substr(sep + 1), &pos);
+      valid = valid && pos == geometry.size() - sep - 1;
+    }
+  } catch (std::logic_error& e) {
+    valid = false;
+  }
+  if (!valid) {
+    throw ErrorException("Invalid geometry in target '%s'. Expected WIDTHxHEIGHT or FX,FY", spec.c_str());
+  }
+
+  return target;
+}
+
+
+ResizeCommand::Crop
+ResizeCommandFactory::parseCrop(const std::string& spec)
+{
+  ResizeCommand::Crop crop;
+  crop.enabled = true;
+
+  if (spec == "aspect") {
+    return crop;
+  }
+
+  bool valid = false;
+  try {
+    size_t sep, pos;
+    if (spec.find(',') != std::string::npos) {
+      // X,Y,WIDTH,HEIGHT
+      int* fields[] = { &crop.x, &crop.y, &crop.width, &crop.height };
+      size_t start = 0;
+      valid = true;
+      for (int i = 0; i < 4 && valid; ++i) {
+        sep = i < 3 ? spec.find(',', start) : spec.size();
+        if (sep == std::string::npos) {
+          valid = false;
+          break;
+        }
+        *fields[i] = std::stoi(spec.substr(start, sep - start), &pos);
+        valid = pos == sep - start && *fields[i] >= 0;
+        start = sep + 1;
+      }
+    } else if ((sep = spec.find('x')) != std::string::npos) {
+      // WIDTHxHEIGHT[+X+Y]
+      crop.width = std::stoi(spec.substr(0, sep), &pos);
+      valid = pos == sep;
+
+      size_t plus = spec.find('+', sep + 1);
+      size_t end = plus == std::string::npos ? spec.size() : plus;
+      crop.height = std::stoi(spec.substr(sep + 1, end - sep - 1), &pos);
+      valid = valid && pos == end - sep - 1;
+
+      if (valid && plus != std::string::npos) {
+        size_t plus2 = spec.find('+', plus + 1);
+        valid = plus2 != std::string::npos;
+        if (valid) {
+          crop.x = std::stoi(spec.substr(plus + 1, plus2 - plus - 1), &pos);
+          valid = pos == plus2 - plus - 1;
+          crop.y = std::stoi(spec.substr(plus2 + 1), &pos);
+          valid = valid && pos == spec.size() - plus2 - 1;
+        }
+      }
+    }
+  } catch (std::logic_error& e) {
+    valid = false;
+  }
+  if (!valid || crop.width <= 0 || crop.height <= 0) {
+    throw ErrorException("Invalid crop '%s'. Expected X,Y,WIDTH,HEIGHT, WIDTHxHEIGHT[+X+Y], or aspect",
+        spec.c_str());
+  }
+
+  return crop;
+}
+
+
+ResizeCommand::Gravity
+ResizeCommandFactory::getGravityByName(const std::string& name)
+{
+  typedef ResizeCommand::Gravity Gravity;
+
+  if (name == "center")    return Gravity::CENTER;
+  if (name == "north")     return Gravity::NORTH;
+  if (name == "northeast") return Gravity::NORTH_EAST;
+  if (name == "east")      return Gravity::EAST;
+  if (name == "southeast") return Gravity::SOUTH_EAST;
+  if (name == "south")     return Gravity::SOUTH;
+  if (name == "southwest") return Gravity::SOUTH_WEST;
+  if (name == "west")      return Gravity::WEST;
+  if (name == "northwest") return Gravity::NORTH_WEST;
+
+  throw ErrorException("Invalid gravity '%s'", name.c_str());
+}
+
+
+cv::Size
+ResizeCommand::_getTargetSize(const Target& target, const cv::Size& source_size)
+{
+  if (target.width > 0 && target.height > 0) {
+    return cv::Size(target.width, target.height);
+  }
+
+  if (std::isgreater(target.fx, 0.0) && std::isgreater(target.fy, 0.0)) {
+    // Rounded the same way as in cv::resize()
+    cv::Size size(cvRound(source_size.width * target.fx), cvRound(source_size.height * target.fy));
+    if (size.width > 0 && size.height > 0) {
+      return size;
+    }
+  }
+
+  throw ErrorException("Expected pairs of positive numbers: "
+      "whether width/height, or fx/fy. None provided for '%s'.", target.output.c_str());
+}
+
+
+int
+ResizeCommand::_getReduction(const Targets& targets, const cv::Size& source_size)
+{
+  for (int r = 8; r > 1; r /= 2) {
+    // The codec rounds the reduced size up
+    const cv::Size reduced((source_size.width + r - 1) / r, (source_size.height + r - 1) / r);
+    bool fits = true;
+
+    for (auto& target : targets) {
+      cv::Size size = _getTargetSize(target, source_size);
+      if (size.width > reduced.width || size.height > reduced.height) {
+        fits = false;
+        break;
+      }
+    }
+    if (fits) {
+      return r;
+    }
+  }
+
+  return 1;
+}
+
+
+/// \returns region `rect` of the full-scale image at 1/`r` scale
+static cv::Rect
+scale_rect(const cv::Rect& rect, int r)
+{
+  const int x = rect.x / r;
+  const int y = rect.y / r;
+
+  return cv::Rect(x, y, (rect.x + rect.width + r - 1) / r - x, (rect.y + rect.height + r - 1) / r - y);
+}
+
+
+cv::Rect
+ResizeCommand::getCropRect(const Crop& crop, const cv::Size& source_size)
+{
+  const cv::Rect whole(0, 0, source_size.width, source_size.height);
+
+  if (!crop.enabled) {
+    return whole;
+  }
+
+  cv::Size size(crop.width, crop.height);
+  if (size.width <= 0 || size.height <= 0) {
+    // The largest region having the aspect ratio
+    if (crop.aspect.width <= 0 || crop.aspect.height <= 0) {
+      throw ErrorException("Crop region requires whether a size, or the target width and height");
+    }
+    const double aspect = static_cast<double>(crop.aspect.width) / crop.aspect.height;
+    if (source_size.width > source_size.height * aspect) {
+      size = cv::Size(std::max(cvRound(source_size.height * aspect), 1), source_size.height);
+    } else {
+      size = cv::Size(source_size.width, std::max(cvRound(source_size.width / aspect), 1));
+    }
+  }
+  size.width = std::min(size.width, source_size.width);
+  size.height = std::min(size.height, source_size.height);
+
+  cv::Point pos(crop.x, crop.y);
+  if (crop.x < 0 || crop.y < 0) {
+    // Fractions of the free space on the left and on the top
+    double gx = 0.5, gy = 0.5;
+    switch (crop.gravity) {
+      case Gravity::NORTH_WEST: gx = 0.; gy = 0.; break;
+      case Gravity::NORTH:      gy = 0.;          break;
+      case Gravity::NORTH_EAST: gx = 1.; gy = 0.; break;
+      case Gravity::WEST:       gx = 0.;          break;
+      case Gravity::EAST:       gx = 1.;          break;
+      case Gravity::SOUTH_WEST: gx = 0.; gy = 1.; break;
+      case Gravity::SOUTH:      gy = 1.;          break;
+      case Gravity::SOUTH_EAST: gx = 1.; gy = 1.; break;
+      case Gravity::CENTER:                       break;
+    }
+    pos = cv::Point(cvRound((source_size.width - size.width) * gx),
+        cvRound((source_size.height - size.height) * gy));
+  }
+
+  const cv::Rect rect(cv::Rect(pos, size) & whole);
+  if (rect.area() == 0) {
+    throw ErrorException("Crop region %dx%d+%d+%d is out of the %dx%d source",
+        size.width, size.height, pos.x, pos.y, source_size.width, source_size.height);
+  }
+
+  return rect;
+}
+
+
+cv::Mat
+ResizeCommand::_readSource(const std::string& filename, const Targets& targets, const Crop& crop, cv::Size& crop_size)
+{
+  cv::Mat img;
+
+#if defined(IMTOOLS_HAVE_LIBJPEG) || defined(IMTOOLS_REDUCED_READ)
+  imtools::ImageInfo info;
+
+  if (imtools::probe_image(info, filename) && info.format == imtools::ImageFormat::JPEG) {
+    const cv::Size size(info.width, info.height);
+    cv::Rect rect(getCropRect(crop, size));
+    const int r = _getReduction(targets, rect.size());
+
+# ifdef IMTOOLS_HAVE_LIBJPEG
+    if (crop.enabled) {
+      // Decode the region only
+      imtools::RowReaderPtr reader(imtools::open_jpeg_reader(filename, r, scale_rect(rect, r)));
+      if (reader) {
+        img = imtools::read_rows(*reader);
+        if (reader->getType() == CV_8UC1) {
+          cv::cvtColor(img, img, CV_GRAY2BGR);
+        }
+        crop_size = rect.size();
+        debug_log("Decoded region %dx%d+%d+%d of %s at 1/%d scale: %dx%d",
+            rect.width, rect.height, rect.x, rect.y, filename.c_str(), r, img.cols, img.rows);
+        return img;
+      }
+    }
+# endif
+
+# ifdef IMTOOLS_REDUCED_READ
+    if (r > 1) {
+      const int flags = r == 8 ? cv::IMREAD_REDUCED_COLOR_8
+        : (r == 4 ? cv::IMREAD_REDUCED_COLOR_4 : cv::IMREAD_REDUCED_COLOR_2);
+      const cv::Size reduced((size.width + r - 1) / r, (size.height + r - 1) / r);
+      cv::Size full_size;
+
+#  ifdef IMTOOLS_HAVE_LIBJPEG
+      img = imtools::read_jpeg(filename, r);
+#  endif
+      if (img.empty()) {
+        img = imtools::decode_image(filename, flags);
+      }
+      if (img.size() == reduced) {
+        full_size = size;
+      } else if (img.size() == cv::Size(reduced.height, reduced.width)) {
+        // Rotated according to the EXIF orientation
+        full_size = cv::Size(size.height, size.width);
+      }
+
+      if (!img.empty() && full_size.area() > 0) {
+        rect = getCropRect(crop, full_size);
+        if (_getReduction(targets, rect.size()) >= r) {
+          crop_size = rect.size();
+          debug_log("Decoded %s at 1/%d scale: %dx%d", filename.c_str(), r, img.cols, img.rows);
+          return img(scale_rect(rect, r) & cv::Rect(0, 0, img.cols, img.rows));
+        }
+      }
+      img.release();
+    }
+# endif // IMTOOLS_REDUCED_READ
+  }
+#else
+  (void) targets;
+#endif
+
+  img = imtools::read_image(filename);
+  if (img.empty()) {
+    return img;
+  }
+
+  const cv::Rect rect(getCropRect(crop, img.size()));
+  crop_size = rect.size();
+
+  return img(rect);
+}
+
+
+std::string
+ResizeCommand::_getCacheParams(const Target& target, const Crop& crop) const
+{
+  std::stringstream ss;
+
+  ss << target.width << ' ' << target.height << ' '
+    << target.fx << ' ' << target.fy << ' ' << target.interpolation
+    << ' ' << static_cast<int>(s_resampler)
+    << ' ' << m_encoder_profile.toString();
+  if (crop.enabled) {
+    ss << " crop=" << crop.x << ',' << crop.y << ',' << crop.width << ',' << crop.height
+      << ',' << crop.aspect.width << ',' << crop.aspect.height << ',' << static_cast<int>(crop.gravity);
+  }
+
+  return ss.str();
+}
+
+
+ResizeCommand::Resampler
+ResizeCommand::getResamplerByName(const std::string& name)
+{
+  if (name == "auto") {
+    return Resampler::AUTO;
+  }
+  if (name == "opencv") {
+    return Resampler::OPENCV;
+  }
+  if (name == "imtools") {
+    return Resampler::IMTOOLS;
+  }
+  throw ErrorException("Unknown resampler: '%s'", name.c_str());
+}
+
+
 void
-ResizeCommand::run(CommandResult& result)
+ResizeCommand::resize(cv::Mat& dst, const cv::Mat& src, const cv::Size& size, int interpolation)
 {
-  std::string source_filename(trimPath(m_source));
-  std::string output_filename(trimPath(m_output));
+  bool use_imtools = false;
 
-  cv::Mat source(cv::imread(source_filename, 1));
-  if (source.empty()) {
-    throw ErrorException("Source image '%s' doesn't exist", source_filename.c_str());
+  if (s_resampler != Resampler::OPENCV && resample_supported(src.type(), interpolation)) {
+    if (s_resampler == Resampler::IMTOOLS) {
+      use_imtools = true;
+    } else {
+      // The filter support of resample() grows with the downscale ratio, while
+      // cv::resize() uses fixed number of taps (and aliases). So resample() is
+      // only faster for the smoother filters at moderate ratios, which is the
+      // common case after the reduced JPEG decode.
+      use_imtools = (interpolation == cv::INTER_CUBIC || interpolation == cv::INTER_LANCZOS4)
+        && size.width <= src.cols && size.height <= src.rows
+        && src.cols <= size.width * RESAMPLE_MAX_AUTO_RATIO
+        && src.rows <= size.height * RESAMPLE_MAX_AUTO_RATIO;
+    }
   }
 
-  cv::Mat output;
-  if ((m_width > 0 && m_height > 0)
-      || (std::isgreater(m_fx, 0.0) && std::isgreater(m_fy, 0.0)))
+  if (use_imtools) {
+    debug_log("resample(%dx%d, o, size(%d, %d), %i)",
+        src.cols, src.rows, size.width, size.height, interpolation);
+    resample(dst, src, size, interpolation);
+  } else {
+    debug_log("cv::resize(%dx%d, o, size(%d, %d), 0, 0, %i)",
+        src.cols, src.rows, size.width, size.height, interpolation);
+    cv::resize(src, dst, size, 0, 0, interpolation);
+  }
+}
+
+
+bool
+ResizeCommand::_resizeStream(std::vector<cv::Mat>& outputs, const std::string& filename,
+    const Targets& targets, const Crop& crop)
+{
+  imtools::ImageInfo info;
+
+  if (!imtools::probe_image(info, filename)
+      || static_cast<int64_t>(info.width) * info.height < STREAM_MIN_PIXELS)
   {
-    debug_log("cv::resize(s, o, size(%d, %d), %f, %f, %i)",
-        m_width, m_height, m_fx, m_fy, m_interpolation);
-    cv::resize(source, output, cv::Size(m_width, m_height), m_fx, m_fy, m_interpolation);
+    return false;
+  }
+
+  const cv::Rect rect(getCropRect(crop, cv::Size(info.width, info.height)));
+  imtools::RowReaderPtr reader;
+#ifdef IMTOOLS_HAVE_LIBJPEG
+  if (info.format == imtools::ImageFormat::JPEG) {
+    const int r = _getReduction(targets, rect.size());
+    reader = imtools::open_jpeg_reader(filename, r, scale_rect(rect, r));
+  }
+#endif
+#ifdef IMTOOLS_HAVE_ZLIB
+  if (info.format == imtools::ImageFormat::PNG) {
+    reader = imtools::open_png_reader(filename);
+    if (reader) {
+      reader = imtools::crop_rows(std::move(reader), rect);
+    }
+  }
+#endif
+  if (!reader) {
+    return false;
+  }
+
+  // A resampler per distinct rendition
+  const cv::Size src_size = reader->getSize();
+  const int type = reader->getType();
+  const uint_t n_targets = targets.size();
+  std::vector<std::unique_ptr<imtools::StreamResampler>> resamplers;
+  std::vector<cv::Size> sizes(n_targets);
+  std::vector<uint_t> index(n_targets);
+  uint_t i, j;
+
+  for (i = 0; i < n_targets; ++i) {
+    sizes[i] = _getTargetSize(targets[i], rect.size());
+    if (sizes[i].width > src_size.width || sizes[i].height > src_size.height
+        || !imtools::StreamResampler::supported(type, targets[i].interpolation))
+    {
+      return false;
+    }
+
+    for (j = 0; j < i; ++j) {
+      if (sizes[j] == sizes[i] && targets[j].interpolation == targets[i].interpolation) {
+        break;
+      }
+    }
+    if (j < i) {
+      index[i] = index[j];
+    } else {
+      index[i] = resamplers.size();
+      resamplers.emplace_back(new imtools::StreamResampler(src_size, type, sizes[i], targets[i].interpolation));
+    }
+  }
+
+  debug_log("Resizing %s (%dx%d) while decoding", filename.c_str(), src_size.width, src_size.height);
+
+  cv::Mat strip(STREAM_STRIP_ROWS, src_size.width, type);
+  for (int y = 0; y < src_size.height;) {
+    const int n = reader->read(strip);
+    if (n <= 0) {
+      throw ErrorException("Failed to decode %s", filename.c_str());
+    }
+    y += n;
+
+    bool done = true;
+    for (auto& resampler : resamplers) {
+      if (!resampler->done()) {
+        resampler->push(strip.rowRange(0, n));
+        done = resampler->done() && done;
+      }
+    }
+    if (done) {
+      // The rest of the rows are beyond the filters
+      break;
+    }
+  }
+
+  for (i = 0; i < n_targets; ++i) {
+    const cv::Mat& result = resamplers[index[i]]->getResult();
+    if (type == CV_8UC1) {
+      // The same as cv::imread(filename, 1) yields
+      cv::cvtColor(result, outputs[i], CV_GRAY2BGR);
+    } else {
+      outputs[i] = result;
+    }
+  }
+
+  return true;
+}
+
+
+void
+ResizeCommand::_resizeSource(std::vector<cv::Mat>& outputs, const std::string& filename,
+    const Targets& targets, const Crop& crop)
+{
+  const uint_t n_targets = targets.size();
+  uint_t i;
+
+  cv::Size crop_size;
+  cv::Mat source(_readSource(filename, targets, crop, crop_size));
+  if (source.empty()) {
+    throw ErrorException("Source image '%s' doesn't exist", filename.c_str());
+  }
+
+  // The scale factors are relative to the full-scale region even if it was
+  // decoded at a reduced scale
+  std::vector<cv::Size> sizes(n_targets);
+  for (i = 0; i < n_targets; ++i) {
+    sizes[i] = _getTargetSize(targets[i], crop_size);
+  }
+
+  // Make the largest renditions first, so that the smaller ones can be derived
+  // from them
+  std::vector<uint_t> order(n_targets);
+  for (i = 0; i < n_targets; ++i) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(),
+      [&sizes](uint_t a, uint_t b) { return sizes[a].area() > sizes[b].area(); });
+
+  for (uint_t k = 0; k < n_targets; ++k) {
+    const uint_t t = order[k];
+    const int interpolation = targets[t].interpolation;
+    const cv::Mat* base = &source;
+    bool same = false;
+
+    for (uint_t j = 0; j < k && !same; ++j) {
+      const uint_t p = order[j];
+      if (targets[p].interpolation != interpolation) {
+        continue;
+      }
+      if (sizes[p] == sizes[t]) {
+        // The same rendition with another output path
+        outputs[t] = outputs[p];
+        same = true;
+      } else if (interpolation == cv::INTER_AREA
+          && sizes[p].width >= sizes[t].width * CASCADE_MIN_RATIO
+          && sizes[p].height >= sizes[t].height * CASCADE_MIN_RATIO
+          && sizes[p].area() < base->size().area())
+      {
+        // Every output pixel still averages a few pixels of the base, so
+        // the error of the intermediate rendition is negligible.
+        base = &outputs[p];
+      }
+    }
+    if (same) {
+      continue;
+    }
+
+    resize(outputs[t], *base, sizes[t], interpolation);
+  }
+}
+
+
+void
+ResizeCommand::_processItem(const Item& item) const
+{
+  std::string source_filename(trimPath(item.source));
+  uint_t i;
+
+  if (item.targets.empty()) {
+    throw ErrorException("No output images specified");
+  }
+
+  // The region of the crop doesn't depend on which of the targets are cached
+  Crop crop(m_crop);
+  if (crop.enabled && crop.aspect.area() == 0) {
+    crop.aspect = cv::Size(item.targets[0].width, item.targets[0].height);
+  }
+
+  // Targets missing in the cache, and their cache keys
+  Targets targets;
+  std::vector<std::string> keys;
+  if (s_cache && !hasOutputCallback() && !imtools::is_stdio(source_filename)) {
+    for (auto& target : item.targets) {
+      std::string output_filename(trimPath(target.output));
+      if (imtools::is_stdio(output_filename)) {
+        targets.push_back(target);
+        keys.push_back(std::string());
+        continue;
+      }
+      std::string key(ThumbnailCache::makeKey(source_filename, _getCacheParams(target, crop),
+            m_encoder_profile.getFileExt(output_filename)));
+
+      if (!key.empty() && s_cache->fetch(key, output_filename)) {
+        debug_log("Cache hit: %s", output_filename.c_str());
+        continue;
+      }
+      targets.push_back(target);
+      keys.push_back(key);
+    }
+    if (targets.empty()) {
+      return;
+    }
   } else {
-    throw ErrorException("Expected pairs of positive numbers: "
-        "whether width/height, or fx/fy. None provided.");
+    targets = item.targets;
+  }
+  const uint_t n_targets = targets.size();
+
+  std::vector<cv::Mat> outputs(n_targets);
+  if (!_resizeStream(outputs, source_filename, targets, crop)) {
+    _resizeSource(outputs, source_filename, targets, crop);
+  }
+
+  // Encode in parallel. Empty string means success.
+  std::vector<std::string> errors(n_targets);
+#ifdef IMTOOLS_THREADS
+  _Pragma("omp parallel for schedule(dynamic, 1)")
+#endif
+  for (i = 0; i < n_targets; ++i) {
+    std::string output_filename(trimPath(targets[i].output));
+    try {
+      writeImage(output_filename, outputs[i]);
+      if (!keys.empty() && !keys[i].empty()) {
+        s_cache->store(keys[i], output_filename);
+      }
+    } catch (FileWriteErrorException& e) {
+      errors[i] = output_filename;
+    } catch (cv::Exception& e) {
+      warning_log("%s", e.what());
+      errors[i] = output_filename;
+    }
   }
 
-  if (!cv::imwrite(output_filename, output, getCompressionParams())) {
-    throw FileWriteErrorException(output_filename);
+  for (i = 0; i < n_targets; ++i) {
+    if (!errors[i].empty()) {
+      throw FileWriteErrorException(errors[i]);
+    }
+  }
+}
+
+
+void
+ResizeCommand::run(CommandResult& result)
+{
+  const uint_t n_items = m_items.size();
+  uint_t n_failed = 0;
+  uint_t i;
+
+  if (n_items == 0) {
+    throw ErrorException("No source images specified");
+  }
+  if (n_items == 1) {
+    _processItem(m_items[0]);
+    result.setValue("OK");
+    return;
+  }
+
+#ifdef IMTOOLS_THREADS
+  // Team size of this loop only (see MergeCommand::run())
+  uint_t num_threads = n_items >= m_max_threads ? m_max_threads : n_items;
+  if (num_threads == 0) {
+    num_threads = 1;
+  }
+
+  // Sources differ in size, so hand them out one by one
+  _Pragma("omp parallel for schedule(dynamic, 1) reduction(+:n_failed) num_threads(num_threads)")
+#endif
+  for (i = 0; i < n_items; ++i) {
+    std::string error;
+
+    try {
+      _processItem(m_items[i]);
+    } catch (ErrorException& e) {
+      error = e.what();
+    } catch (cv::Exception& e) {
+      error = std::string("CV error: ") + e.what();
+    }
+
+    // Report the result of each item as soon as it is ready
+    std::string message = std::to_string(i) + " " + m_items[i].source + ": ";
+    if (error.empty()) {
+      message += "OK";
+    } else {
+      message += error;
+      warning_log("%s", message.c_str());
+      ++n_failed;
+    }
+#ifdef IMTOOLS_THREADS
+    _Pragma("omp critical(imresize_event)")
+#endif
+    invokeEventCallback(message);
+  }
+
+  if (n_failed > 0) {
+    throw ErrorException("Failed to process %u of %u images", n_failed, n_items);
   }
 
   result.setValue("OK");
@@ -154,10 +1042,14 @@ ResizeCommand::serialize() const noexcept
 {
     std::stringstream ss;
 
-    ss << m_source << m_output
-      << m_width << m_height
-      << round(m_fx * 1000) / 1000
-      << round(m_fy * 1000) / 1000;
+    for (auto& item : m_items) {
+      ss << item.source;
+      for (auto& t : item.targets) {
+        // Everything affecting the contents of the output: size, interpolation,
+        // crop region, encoder settings
+        ss << ' ' << t.output << ' ' << _getCacheParams(t, m_crop);
+      }
+    }
 
     return ss.str();
 }
@@ -173,12 +1065,42 @@ ResizeCommandFactory::create(const Command::Arguments& arguments) const
   double      fx            = 0.0;
   double      fy            = 0.0;
   int         interpolation = cv::INTER_LINEAR;
+  ResizeCommand::Targets targets;
+  imtools::ImageArray sources;
+  imtools::ImageArray outputs;
+  EncoderProfile encoder = getEncoderProfile(arguments);
+  ResizeCommand::Crop crop;
+  ResizeCommand::Gravity gravity = ResizeCommand::Gravity::CENTER;
+#ifdef IMTOOLS_THREADS
+  unsigned    max_threads_num = imtools::threads::max_threads();
+#else
+  unsigned    max_threads_num = 1;
+#endif
 
   for (auto& it : arguments) {
     std::string key = it.first.data();
     Command::CValuePtr value = it.second;
 
     Option option = static_cast<Option>(getOptionCode(key));
+
+    if (option == Option::TARGETS) {
+      if (value->getType() == Command::Value::Type::ARRAY) {
+        for (auto& spec : value->getArray()) {
+          targets.push_back(parseTarget(spec));
+        }
+      } else {
+        targets.push_back(parseTarget(value->getString()));
+      }
+      continue;
+    }
+    if (option == Option::SOURCES || option == Option::OUTPUTS) {
+      if (value->getType() != Command::Value::Type::ARRAY) {
+        throw ErrorException("Expected array for '%s'", key.c_str());
+      }
+      (option == Option::SOURCES ? sources : outputs) = value->getArray();
+      continue;
+    }
+
     auto str_value = value->getString();
 
     verbose_log("key: %s, value: %s, option: %d", key.c_str(), str_value.c_str(), option);
@@ -191,11 +1113,49 @@ ResizeCommandFactory::create(const Command::Arguments& arguments) const
       case Option::FX:            fx            = std::stod(str_value);            break;
       case Option::FY:            fy            = std::stod(str_value);            break;
       case Option::INTERPOLATION: interpolation = _getInterpolationCode(str_value); break;
-      default: warning_log("Skipping unknown key '%s'", key.c_str()); break;
+      case Option::CROP:          crop          = parseCrop(str_value);            break;
+      case Option::GRAVITY:       gravity       = getGravityByName(str_value);     break;
+      default:
+        if (key != "encoder" && !encoder.set(key, str_value)) {
+          warning_log("Skipping unknown key '%s'", key.c_str());
+        }
+        break;
     }
   }
 
-  return new ResizeCommand(source, output, width, height, fx, fy, interpolation);
+  if (!output.empty()) {
+    targets.insert(targets.begin(), ResizeCommand::Target(output, width, height, fx, fy, interpolation));
+  }
+
+  crop.gravity = gravity;
+
+  ResizeCommand* cmd;
+
+  if (sources.empty()) {
+    cmd = new ResizeCommand(source, targets);
+    cmd->setEncoderProfile(encoder);
+    cmd->setCrop(crop);
+    return cmd;
+  }
+
+  // Batch: each of `sources` is resized into the output of the same index
+  if (sources.size() != outputs.size()) {
+    throw ErrorException("Sizes of sources and outputs are not equal");
+  }
+
+  ResizeCommand::Items items;
+  if (!source.empty()) {
+    items.push_back(ResizeCommand::Item{source, targets});
+  }
+  for (size_t i = 0; i < sources.size(); ++i) {
+    items.push_back(ResizeCommand::Item{sources[i],
+        ResizeCommand::Targets(1, ResizeCommand::Target(outputs[i], width, height, fx, fy, interpolation))});
+  }
+
+  cmd = new ResizeCommand(items, max_threads_num);
+  cmd->setEncoderProfile(encoder);
+  cmd->setCrop(crop);
+  return cmd;
 }
 
 
@@ -18,17 +18,172 @@
 #define IMTOOLS_IMRESIZE_API_HXX
 
 #include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <cstdint>
+#include <opencv2/imgproc/imgproc.hpp>
 #include "imtools-types.hxx"
 #include "Command.hxx"
 
+#if CV_MAJOR_VERSION > 3 || (CV_MAJOR_VERSION == 3 && CV_MINOR_VERSION >= 2)
+/// Whether cv::imread() supports decoding JPEG at a reduced scale
+# define IMTOOLS_REDUCED_READ 1
+#endif
+
 namespace imtools { namespace imresize {
 
 using imtools::Command;
 
+/////////////////////////////////////////////////////////////////////
+/// Cache of resized images keyed by the source identity and resize parameters.
+/// The entries are files in a directory. The outputs are copies of the entries
+/// (reflinks, where the filesystem supports them), so they may be modified.
+class ThumbnailCache
+{
+  public:
+    struct Stats {
+      uint64_t hits;
+      uint64_t misses;
+      uint64_t evictions;
+      /// Approximate total size of the entries in bytes
+      uint64_t size;
+    };
+
+    /*!
+     * \param dir Directory of the entries. Created, if doesn't exist.
+     * \param max_size Max. total size of the entries in bytes (0 - unlimited).
+     * The least recently used entries are removed when the size is exceeded.
+     * \throws ErrorException
+     */
+    ThumbnailCache(const std::string& dir, uint64_t max_size);
+
+    ThumbnailCache() = delete;
+    ThumbnailCache(const ThumbnailCache&) = delete;
+    ThumbnailCache& operator=(const ThumbnailCache&) = delete;
+
+    /*! Makes an entry key from the identity of the `source` file (device,
+     * inode, size, modification and change times) and `params`.
+     * \param ext Extension of the entry, e.g. ".jpg"
+     * \returns empty string if `source` is not accessible */
+    static std::string makeKey(const std::string& source, const std::string& params, const std::string& ext);
+
+    /*! Copies entry `key` to `output` (a reflink, if the filesystem supports it).
+     * \returns false on miss. */
+    bool fetch(const std::string& key, const std::string& output);
+
+    /// Stores `output` as entry `key`
+    void store(const std::string& key, const std::string& output);
+
+    Stats getStats() const noexcept;
+
+  protected:
+    /// Removes the least recently used entries until the size is below the limit
+    void _evict();
+
+    /// Directory of the entries
+    std::string m_dir;
+    /// Max. total size of the entries in bytes
+    uint64_t m_max_size;
+
+    std::atomic<uint64_t> m_hits{0};
+    std::atomic<uint64_t> m_misses{0};
+    std::atomic<uint64_t> m_evictions{0};
+    std::atomic<uint64_t> m_size{0};
+    /// Serializes eviction
+    std::mutex m_evict_lock;
+};
+
+typedef std::shared_ptr<ThumbnailCache> ThumbnailCachePtr;
+
+
 /////////////////////////////////////////////////////////////////////
 class ResizeCommand : public ::imtools::Command
 {
   public:
+    /// Output image (rendition) of the source
+    struct Target {
+      Target() = default;
+      Target(const std::string& output_, uint_t width_, uint_t height_,
+          double fx_, double fy_, int interpolation_) noexcept
+        : output(output_), width(width_), height(height_),
+        fx(fx_), fy(fy_), interpolation(interpolation_) {}
+
+      /// Output image path
+      std::string output;
+      /// Output image width
+      uint_t width = 0;
+      /// Output image height
+      uint_t height = 0;
+      /// Scale factor along the horizontal axis.
+      double fx = 0.;
+      /// Scale factor along the vertical axis.
+      double fy = 0.;
+      /// Interpolation method
+      int interpolation = cv::INTER_LINEAR;
+    };
+    typedef std::vector<Target> Targets;
+
+    /// Source image with its output images
+    struct Item {
+      /// Source image path
+      std::string source;
+      /// Output images
+      Targets targets;
+    };
+    typedef std::vector<Item> Items;
+
+    /// Position of a crop region within the source
+    enum class Gravity : int {
+      CENTER,
+      NORTH,
+      NORTH_EAST,
+      EAST,
+      SOUTH_EAST,
+      SOUTH,
+      SOUTH_WEST,
+      WEST,
+      NORTH_WEST
+    };
+
+    /// Region of the sources to resize (cropped before resizing)
+    struct Crop {
+      /// Whether to crop
+      bool enabled = false;
+      /// Offset of the region in the full-scale source (negative - placed according to `gravity`)
+      int x = -1;
+      int y = -1;
+      /// Size of the region (zero - the largest region having the aspect ratio `aspect`)
+      int width = 0;
+      int height = 0;
+      /// Aspect ratio of the region of zero size (the size of the first target of an item, if empty)
+      cv::Size aspect;
+      Gravity gravity = Gravity::CENTER;
+    };
+
+    /// Min. ratio between sizes of a rendition and a smaller one derived from it
+    static const int CASCADE_MIN_RATIO = 2;
+
+    /// Min. number of source pixels for resizing while decoding (see `_resizeStream()`)
+    static const int STREAM_MIN_PIXELS = 1 << 25;
+
+    /// Number of source rows decoded at once while resizing in streaming mode
+    static const int STREAM_STRIP_ROWS = 64;
+
+    /// Resampling engine
+    enum class Resampler : int {
+      /// `imtools::resample()` where it is expected to be faster, `cv::resize()` otherwise
+      AUTO,
+      /// Always `cv::resize()`
+      OPENCV,
+      /// `imtools::resample()` for the supported image types and interpolations
+      IMTOOLS
+    };
+
+    /// Max. downscale ratio at which `Resampler::AUTO` selects `imtools::resample()`
+    static constexpr double RESAMPLE_MAX_AUTO_RATIO = 2.;
+
     // Inherit ctors
     using Command::Command;
 
@@ -40,27 +195,94 @@ class ResizeCommand : public ::imtools::Command
         double fy,
         int interpolation) noexcept;
 
+    /// Makes all of `targets` from a single decode of `source`
+    ResizeCommand(const std::string& source, const Targets& targets) noexcept;
+
+    /// Processes a batch of `items` concurrently
+    ResizeCommand(const Items& items, unsigned max_threads_num) noexcept;
+
     /// Executes the command
     virtual void run(imtools::CommandResult& result) override;
 
     /// \returns command-specific data serialized in a string
     virtual std::string serialize() const noexcept override;
 
+    /// Sets the cache used by all resize commands (`nullptr` turns the cache off)
+    static inline void setCache(const ThumbnailCachePtr& cache) noexcept { s_cache = cache; }
+    static inline const ThumbnailCachePtr& getCache() noexcept { return s_cache; }
+
+    /// Sets the resampling engine used by all resize commands
+    static inline void setResampler(Resampler resampler) noexcept { s_resampler = resampler; }
+    static inline Resampler getResampler() noexcept { return s_resampler; }
+
+    /// \returns resampler for `name` ("auto", "opencv", "imtools")
+    /// \throws ErrorException
+    static Resampler getResamplerByName(const std::string& name);
+
+    /// Resizes `src` into `dst` of `size` with the engine selected by the current resampler
+    static void resize(cv::Mat& dst, const cv::Mat& src, const cv::Size& size, int interpolation);
+
+    /// Sets the region of the sources to resize. The `fx`, `fy` scale factors of the targets
+    /// are relative to the region.
+    inline void setCrop(const Crop& crop) noexcept { m_crop = crop; }
+    inline const Crop& getCrop() const noexcept { return m_crop; }
+
+    /*! \returns region of `crop` within the source of `source_size` (the entire source,
+     * if `crop` is not enabled)
+     * \throws ErrorException, if the region is out of the source, or has no size nor aspect ratio
+     */
+    static cv::Rect getCropRect(const Crop& crop, const cv::Size& source_size);
+
   protected:
-    /// Source image path
-    std::string m_source;
-    /// Output image path
-    std::string m_output;
-    /// Output image width
-    uint_t m_width;
-    /// Output image height
-    uint_t m_height;
-    /// Scale factor along the horizontal axis.
-    double m_fx;
-    /// Scale factor along the vertical axis.
-    double m_fy;
-    /// Interpolation method
-    int m_interpolation;
+    /// \returns parameters of `target` affecting the output image contents
+    std::string _getCacheParams(const Target& target, const Crop& crop) const;
+
+    /// \returns size of `target` made from an image of size `source_size`
+    /// \throws ErrorException
+    static cv::Size _getTargetSize(const Target& target, const cv::Size& source_size);
+
+    /*! \returns the greatest scale denominator (8, 4, 2) the source of size
+     * `source_size` can be decoded at, so that it is still not smaller than
+     * any of `targets`, or 1 */
+    static int _getReduction(const Targets& targets, const cv::Size& source_size);
+
+    /*! Reads region `crop` of the source image. JPEG is decoded at a reduced
+     * scale by the codec, if all of the targets are much smaller than the region.
+     * Only the region of JPEG is decoded, if libjpeg allows.
+     * \param crop_size Size of the region at full scale
+     * \returns empty matrix on error
+     * \throws ErrorException */
+    static cv::Mat _readSource(const std::string& filename, const Targets& targets, const Crop& crop, cv::Size& crop_size);
+
+    /*! Makes `outputs` of `targets` while decoding a large JPEG or PNG source
+     * row by row, so that the source is never kept in memory entirely.
+     * \returns false, if the source is too small, or its format or any of the
+     * targets are not supported (upscale, unsupported interpolation etc.)
+     * \throws ErrorException
+     */
+    static bool _resizeStream(std::vector<cv::Mat>& outputs, const std::string& filename,
+        const Targets& targets, const Crop& crop);
+
+    /// Makes `outputs` of `targets` from the source decoded into memory
+    /// \throws ErrorException
+    static void _resizeSource(std::vector<cv::Mat>& outputs, const std::string& filename,
+        const Targets& targets, const Crop& crop);
+
+    /// Makes the targets of `item`
+    /// \throws ErrorException
+    void _processItem(const Item& item) const;
+
+    /// Source images with their outputs
+    Items m_items;
+    /// Max. number of items processed concurrently
+    unsigned m_max_threads = 4;
+    /// Region of the sources to resize
+    Crop m_crop;
+
+    /// Thumbnail cache
+    static ThumbnailCachePtr s_cache;
+    /// Resampling engine
+    static Resampler s_resampler;
 };
 
 
@@ -76,13 +298,41 @@ class ResizeCommandFactory : public ::imtools::CommandFactory
       HEIGHT,
       INTERPOLATION,
       FX,
-      FY
+      FY,
+      TARGETS,
+      SOURCES,
+      OUTPUTS,
+      CROP,
+      GRAVITY
     };
 
     using ::imtools::CommandFactory::CommandFactory;
 
     virtual ResizeCommand* create(const Command::Arguments& arguments) const override;
 
+    /*!
+     * Parses target specification in format `GEOMETRY[/INTERPOLATION]:OUTPUT`,
+     * where `GEOMETRY` is whether `WIDTHxHEIGHT`, or `FX,FY`.
+     * E.g.: `120x90:thumb.jpg`, `0.5,0.5/area:half.jpg`
+     * \throws ErrorException
+     */
+    static ResizeCommand::Target parseTarget(const std::string& spec);
+
+    /*!
+     * Parses crop region specification: `X,Y,WIDTH,HEIGHT`, `WIDTHxHEIGHT+X+Y`, `WIDTHxHEIGHT` (placed
+     * according to the gravity), or `aspect` (the largest region having the aspect
+     * ratio of the first target, placed according to the gravity).
+     * \throws ErrorException
+     */
+    static ResizeCommand::Crop parseCrop(const std::string& spec);
+
+    /*!
+     * \param name `center`, `north`, `northeast`, `east`, `southeast`, `south`,
+     * `southwest`, `west`, or `northwest`
+     * \throws ErrorException
+     */
+    static ResizeCommand::Gravity getGravityByName(const std::string& name);
+
   protected:
     /// \returns numeric representation of option name for comparisions.
     virtual int getOptionCode(const std::string& o) const noexcept override;
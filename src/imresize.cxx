@@ -20,12 +20,19 @@
  */
 
 #include "imresize.hxx"
+#include <fstream>
+#include <iostream>
+#include <cinttypes>
 #include "opencv2/highgui/highgui.hpp"
 #include "opencv2/imgproc/imgproc.hpp"
 
 using namespace imtools::imresize;
 using imtools::CommandResult;
 
+#ifdef IMTOOLS_THREADS
+using imtools::threads::max_threads;
+#endif
+
 typedef ::imtools::imresize::Command Command;
 
 
@@ -33,7 +40,68 @@ typedef ::imtools::imresize::Command Command;
 static void
 usage(bool is_error)
 {
-  fprintf(is_error ? stdout : stderr, g_usage_template, g_program_name);
+  fprintf(is_error ? stdout : stderr, g_usage_template, g_program_name
+#ifdef IMTOOLS_THREADS
+      ,max_threads()
+#endif
+      );
+}
+
+
+/*! Reads batch items from the manifest.
+ * \throws ErrorException
+ */
+static void
+load_manifest(const std::string& filename, ResizeCommand::Items& items)
+{
+  std::ifstream file;
+  if (filename != "-") {
+    file.open(filename);
+    if (!file) {
+      throw ErrorException("Failed to open manifest '%s'", filename.c_str());
+    }
+  }
+  std::istream& in = filename == "-" ? std::cin : file;
+
+  std::string line;
+  for (uint_t line_num = 1; std::getline(in, line); ++line_num) {
+    if (!line.empty() && line.back() == '\r') {
+      line.pop_back();
+    }
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+
+    std::vector<std::string> fields;
+    for (size_t pos = 0;;) {
+      size_t tab = line.find('\t', pos);
+      fields.push_back(line.substr(pos, tab == std::string::npos ? tab : tab - pos));
+      if (tab == std::string::npos) {
+        break;
+      }
+      pos = tab + 1;
+    }
+
+    ResizeCommand::Item item;
+    item.source = fields[0];
+    if (fields.size() > 1 && !fields[1].empty()) {
+      item.targets.push_back(ResizeCommand::Target(fields[1],
+            g_width, g_height, g_fx, g_fy, g_interpolation));
+    }
+    for (size_t i = 2; i < fields.size(); ++i) {
+      item.targets.push_back(ResizeCommandFactory::parseTarget(fields[i]));
+    }
+
+    if (item.source.empty() || item.targets.empty()) {
+      throw ErrorException("%s:%u: expected SOURCE<TAB>OUTPUT[<TAB>TARGET...]",
+          filename.c_str(), line_num);
+    }
+    items.push_back(item);
+  }
+
+  if (in.bad()) {
+    throw ErrorException("Failed to read manifest '%s'", filename.c_str());
+  }
 }
 
 
@@ -44,6 +112,7 @@ main(int argc, char **argv)
   int exit_code   = 0;
 
   g_program_name = argv[0];
+  imtools::set_stdio_enabled(true);
 
 #ifdef IMTOOLS_DEBUG
   setvbuf(stdout, NULL, _IONBF, 0); // turn off buffering
@@ -60,7 +129,7 @@ main(int argc, char **argv)
           exit(0);
 
         case 's':
-          if (!file_exists(optarg)) {
+          if (!is_stdio(optarg) && !file_exists(optarg)) {
             throw InvalidCliArgException("File '%s' doesn't exist", optarg);
           }
           g_source_image_filename = optarg;
@@ -100,6 +169,82 @@ main(int argc, char **argv)
           save_double_opt_arg(g_fy, "Invalid scale factor for vertical axis");
           break;
 
+        case 't':
+          try {
+            g_targets.push_back(ResizeCommandFactory::parseTarget(optarg));
+          } catch (ErrorException& e) {
+            throw InvalidCliArgException("%s", e.what());
+          }
+          break;
+
+        case 'm':
+          g_manifest_filename = optarg;
+          break;
+
+        case 'c':
+          g_cache_dir = optarg;
+          break;
+
+        case 'S':
+          save_uint_opt_arg(g_cache_size, "Invalid cache size\n");
+          break;
+
+        case 'e':
+          try {
+            imtools::Command::setDefaultEncoderProfile(imtools::EncoderProfile::get(optarg));
+          } catch (ErrorException& e) {
+            throw InvalidCliArgException("%s", e.what());
+          }
+          g_encoder = optarg;
+          break;
+
+        case 'f':
+          g_format = optarg;
+          break;
+
+        case 'R':
+          try {
+            g_resampler = ResizeCommand::getResamplerByName(optarg);
+          } catch (ErrorException& e) {
+            throw InvalidCliArgException("%s", e.what());
+          }
+          break;
+
+        case 'C':
+          {
+            ResizeCommand::Gravity gravity = g_crop.gravity;
+            try {
+              g_crop = ResizeCommandFactory::parseCrop(optarg);
+            } catch (ErrorException& e) {
+              throw InvalidCliArgException("%s", e.what());
+            }
+            g_crop.gravity = gravity;
+          }
+          break;
+
+        case 'G':
+          try {
+            g_crop.gravity = ResizeCommandFactory::getGravityByName(optarg);
+          } catch (ErrorException& e) {
+            throw InvalidCliArgException("%s", e.what());
+          }
+          break;
+
+#ifdef IMTOOLS_THREADS
+        case 'T':
+          {
+            unsigned max_thread_num = max_threads();
+
+            save_uint_opt_arg(g_max_threads, "Invalid max threads\n");
+
+            if (g_max_threads > max_thread_num) {
+              throw InvalidCliArgException("Cannot set max threads limit to %d. "
+                  "Maximum allowed value is %u", g_max_threads, max_thread_num);
+            }
+          }
+          break;
+#endif
+
         case 'v':
           verbose++;
           break;
@@ -123,6 +268,17 @@ main(int argc, char **argv)
           exit(2);
       }
     } while (next_option != -1);
+
+    if (!g_format.empty()) {
+      // Applied after --encoder, which replaces the default profile
+      imtools::EncoderProfile profile(imtools::Command::getDefaultEncoderProfile());
+      try {
+        profile.set("format", g_format);
+      } catch (ErrorException& e) {
+        throw InvalidCliArgException("%s", e.what());
+      }
+      imtools::Command::setDefaultEncoderProfile(profile);
+    }
   } catch (imtools::InvalidCliArgException& e) {
     error_log("%s", e.what());
     exit(2);
@@ -135,12 +291,65 @@ main(int argc, char **argv)
   debug_log("Source image: %s",      g_source_image_filename.c_str());
   debug_log("Output image: %s",      g_output_image_filename.c_str());
   debug_log("Thumbnail size: %ux%u", g_width, g_height);
+  debug_log("Targets: %lu",          g_targets.size());
+  debug_log("Manifest: %s",          g_manifest_filename.c_str());
+  debug_log("Cache: %s",             g_cache_dir.c_str());
+  debug_log("Cache size: %u MiB",    g_cache_size);
+  debug_log("Encoder: %s",           g_encoder.c_str());
+  debug_log("Format: %s",            g_format.c_str());
+  debug_log("Resampler: %d",         static_cast<int>(g_resampler));
+  debug_log("Crop: %d,%d,%d,%d (%d)", g_crop.x, g_crop.y, g_crop.width, g_crop.height,
+      static_cast<int>(g_crop.gravity));
+#ifdef IMTOOLS_THREADS
+  debug_log("max-threads: %d",       g_max_threads);
+#endif
+
+  if (!g_output_image_filename.empty()) {
+    g_targets.insert(g_targets.begin(), ResizeCommand::Target(g_output_image_filename,
+          g_width, g_height, g_fx, g_fy, g_interpolation));
+  }
 
   try {
-    ResizeCommand cmd(g_source_image_filename, g_output_image_filename,
-        g_width, g_height, g_fx, g_fy, g_interpolation);
+    ResizeCommand::setResampler(g_resampler);
+
+    if (!g_cache_dir.empty()) {
+      ResizeCommand::setCache(std::make_shared<ThumbnailCache>(g_cache_dir,
+            static_cast<uint64_t>(g_cache_size) << 20));
+    }
+
+    ResizeCommand::Items items;
+    bool stdio_output = false;
+    if (!g_source_image_filename.empty()) {
+      items.push_back(ResizeCommand::Item{g_source_image_filename, g_targets});
+    }
+    if (!g_manifest_filename.empty()) {
+      load_manifest(g_manifest_filename, items);
+    }
+    for (auto& item : items) {
+      for (auto& target : item.targets) {
+        if (is_stdio(target.output)) {
+          // Keep the image data intact
+          imtools::log::set_stderr_only(true);
+          stdio_output = true;
+        }
+      }
+    }
+
+    ResizeCommand cmd(items, g_max_threads);
+    cmd.setCrop(g_crop);
+    if (!g_manifest_filename.empty()) {
+      // Print the result of each item (to stderr, if stdout carries image data)
+      FILE* out = stdio_output ? stderr : stdout;
+      cmd.setEventCallback([out](const CommandResult& r) { fprintf(out, "%s\n", r.getValue().c_str()); });
+    }
     CommandResult result;
     cmd.run(result);
+
+    if (ResizeCommand::getCache()) {
+      auto stats = ResizeCommand::getCache()->getStats();
+      verbose_log("Cache hits: %" PRIu64 ", misses: %" PRIu64 ", evictions: %" PRIu64,
+          stats.hits, stats.misses, stats.evictions);
+    }
   } catch (ErrorException& e) {
     error_log("%s", e.what());
     exit_code = 1;
@@ -26,6 +26,12 @@ using namespace imtools;
 
 const char* g_program_name;
 
+#ifdef IMTOOLS_THREADS
+unsigned g_max_threads = 4;
+#else
+unsigned g_max_threads = 1;
+#endif
+
 /// Source image path
 std::string g_source_image_filename;
 /// Output image path
@@ -40,6 +46,22 @@ double g_fx = 0.;
 double g_fy = 0.;
 /// Interpolation method
 int g_interpolation = 0;
+/// Additional output images specified with --target
+ResizeCommand::Targets g_targets;
+/// Batch manifest path ("-" for stdin)
+std::string g_manifest_filename;
+/// Thumbnail cache directory
+std::string g_cache_dir;
+/// Max. size of the thumbnail cache in MiB (0 - unlimited)
+uint_t g_cache_size = 0;
+/// Encoder profile (empty - built-in settings)
+std::string g_encoder;
+/// Output format (empty - by the file extension)
+std::string g_format;
+/// Resampling engine
+ResizeCommand::Resampler g_resampler = ResizeCommand::Resampler::AUTO;
+/// Region of the sources to resize
+ResizeCommand::Crop g_crop;
 
 //////////////////////////////////////////////////////////////////////
 /// Template for `printf`-like function.
@@ -51,8 +73,8 @@ const char* g_usage_template = IMTOOLS_FULL_NAME "\n\n" IMTOOLS_COPYRIGHT "\n\n"
 " -V, --version            Print version\n"
 " -v, --verbose            Turn on verbose output. Can be used multiple times\n"
 "                          to increase verbosity (e.g. -vv). Default: off.\n"
-" -s, --source             Path to source image.\n"
-" -o, --output             Path to output image.\n"
+" -s, --source             Path to source image (\"-\" for stdin).\n"
+" -o, --output             Path to output image (\"-\" for stdout).\n"
 " -W, --width              Width of the output image.\n"
 " -H, --height             Height of the output image.\n"
 " -X, --fx                 Scale factor along the horizontal axis.\n"
@@ -65,15 +87,71 @@ const char* g_usage_template = IMTOOLS_FULL_NAME "\n\n" IMTOOLS_COPYRIGHT "\n\n"
 "               But when the image is zoomed, it is similar to the `nearest` method.\n"
 "    cubic    - a bicubic interpolation over 4x4 pixel neighborhood\n"
 "    lanczos4 - a Lanczos interpolation over 8x8 pixel neighborhood\n"
+" -t, --target             Additional output image in format GEOMETRY[/INTERPOLATION]:OUTPUT,\n"
+"                          where GEOMETRY is whether WIDTHxHEIGHT, or FX,FY.\n"
+"                          Can be used multiple times. The source is decoded only once;\n"
+"                          smaller `area` renditions are derived from the larger ones.\n"
+" -m, --manifest           Batch mode. Read the list of images to process from this file\n"
+"                          (\"-\" for stdin). Each line has the format\n"
+"                          SOURCE<TAB>OUTPUT[<TAB>TARGET...], where OUTPUT is made according to\n"
+"                          --width, --height, --fx, --fy, --interpolation options,\n"
+"                          and TARGET is in the format of --target option. OUTPUT may be empty.\n"
+"                          Empty lines and lines starting with # are ignored. The result\n"
+"                          of each item is printed to stdout (stderr, if any output is \"-\").\n"
+" -c, --cache              Thumbnail cache directory. If an output with the same parameters\n"
+"                          has already been made from the same (unmodified) source, it is\n"
+"                          copied from the cache instead of being resized again.\n"
+" -S, --cache-size         Max. size of the thumbnail cache in MiB. The least recently used\n"
+"                          entries are removed when exceeded. Default: 0 (unlimited).\n"
+" -e, --encoder            Encoder profile. Possible values:\n"
+"    fastest  - PNG compression level 1, baseline JPEG, WebP method 1\n"
+"    balanced - PNG compression level 6, optimized JPEG, WebP method 4\n"
+"    smallest - PNG compression level 9, optimized progressive JPEG,\n"
+"               WebP method 6\n"
+"                          All of the profiles encode PNG on multiple threads.\n"
+"                          Default: PNG compression level 9, baseline JPEG.\n"
+"                          The output format is chosen by the file extension (e.g. .webp).\n"
+" -f, --format             Output format overriding the file extensions: jpg, png, webp, etc.\n"
+"                          Default: by the file extension; png for stdout.\n"
+" -R, --resampler          Resampling engine. Possible values:\n"
+"    auto     - the built-in engine for `cubic` and `lanczos4` downscales by factor\n"
+"               of 2 or less, OpenCV otherwise (default)\n"
+"    opencv   - OpenCV\n"
+"    imtools  - the built-in separable antialiased engine for 8-bit 1, 3, 4-channel images\n"
+"               with `linear`, `cubic`, `lanczos4` interpolation, OpenCV otherwise\n"
+" -C, --crop               Region of the source to resize: X,Y,WIDTH,HEIGHT, WIDTHxHEIGHT+X+Y,\n"
+"                          WIDTHxHEIGHT (placed according to --gravity), or `aspect` (the largest\n"
+"                          region having the aspect ratio of the first output, placed according\n"
+"                          to --gravity). The coordinates are in pixels of the source;\n"
+"                          --fx, --fy are relative to the region. Only the rows and columns\n"
+"                          covering the region are decoded from JPEG, where libjpeg allows.\n"
+" -G, --gravity            Placement of the crop region: center (default), north, northeast,\n"
+"                          east, southeast, south, southwest, west, northwest.\n"
+#ifdef IMTOOLS_THREADS
+" -T, --max-threads        Max. number of images processed concurrently in batch mode.\n"
+"                          Default: %2$d.\n"
+#endif
 "\nEXAMPLE:\n\n"
 "The following command makes a 90x100px thumbnail from src.png and writes the result into out.png\n"
 "%1$s -s src.png -o out.png -W 90 -H 100\n\n"
 "To decimate the image by factor of 2 in each direction\n"
-"%1$s -s src.png -o out.png --fx 0.5 --fy 0.5\n";
+"%1$s -s src.png -o out.png --fx 0.5 --fy 0.5\n\n"
+"To make three renditions of src.jpg at once\n"
+"%1$s -s src.jpg -t 1200x900/area:l.jpg -t 600x450/area:m.jpg -t 0.1,0.1/area:s.jpg\n\n"
+"To make a square 200x200 thumbnail of the upper part of src.jpg\n"
+"%1$s -s src.jpg -o out.jpg -W 200 -H 200 -C aspect -G north\n\n"
+"To make a WebP thumbnail of an image read from stdin, and write it to stdout\n"
+"curl -s http://example.com/src.jpg | %1$s -s - -o - -W 120 -H 90 -f webp > out.webp\n\n"
+"To make 120x90 thumbnails of all JPEG files in the current directory\n"
+"ls *.jpg | sed 's/.*/&\\t&.thumb.jpg/' | %1$s -W 120 -H 90 -m -\n";
 
 //////////////////////////////////////////////////////////////////////
 // CLI arguments.
-const char *g_short_options = "hvVs:o:W:H:X:Y:I:";
+const char *g_short_options = "hvVs:o:W:H:X:Y:I:t:m:c:S:R:e:f:C:G:"
+#ifdef IMTOOLS_THREADS
+  "T:"
+#endif
+  ;
 const struct option g_long_options[] = {
   {"help",          no_argument,       NULL, 'h'},
   {"verbose",       no_argument,       NULL, 'v'},
@@ -85,6 +163,18 @@ const struct option g_long_options[] = {
   {"fx",            required_argument, NULL, 'X'},
   {"fy",            required_argument, NULL, 'Y'},
   {"interpolation", required_argument, NULL, 'I'},
+  {"target",        required_argument, NULL, 't'},
+  {"manifest",      required_argument, NULL, 'm'},
+  {"cache",         required_argument, NULL, 'c'},
+  {"cache-size",    required_argument, NULL, 'S'},
+  {"resampler",     required_argument, NULL, 'R'},
+  {"encoder",       required_argument, NULL, 'e'},
+  {"format",        required_argument, NULL, 'f'},
+  {"crop",          required_argument, NULL, 'C'},
+  {"gravity",       required_argument, NULL, 'G'},
+#ifdef IMTOOLS_THREADS
+  {"max-threads",   required_argument, NULL, 'T'},
+#endif
   {0,               0,                 0,    0}
 };
 
@@ -35,6 +35,8 @@
 #include <algorithm> // for std::transform()
 #include <iterator> // for std::back_inserter()
 #include <stdlib.h>
+#include <cinttypes>
+#include <thread> // std::thread::hardware_concurrency()
 #include <boost/property_tree/json_parser.hpp>
 #include <boost/property_tree/ini_parser.hpp>
 #include <boost/asio/signal_set.hpp>
@@ -47,6 +49,7 @@
 #endif
 
 #include "imtools.hxx"
+#include "threads.hxx"
 
 /////////////////////////////////////////////////////////////////////
 
@@ -70,6 +73,8 @@ using imtools::imserver::g_server;
 using imtools::imserver::g_daemonize;
 using imtools::imserver::g_config_file;
 using imtools::imserver::Action;
+using imtools::imserver::Priority;
+using imtools::imserver::PRIORITY_COUNT;
 using imtools::imserver::Config;
 using imtools::imserver::AppConfig;
 using imtools::imserver::Server;
@@ -400,12 +405,45 @@ AppConfig::getOption(const std::string& k)
 
   switch (k[0]) {
     case 'a': option = k == "allow_absolute_paths" ? Option::ALLOW_ABSOLUTE_PATHS : Option::UNKNOWN; break;
-    case 'e': option = k == "error_log"            ? Option::ERROR_LOG_FILE       : Option::UNKNOWN; break;
+    case 'e':
+      if (k == "error_log") {
+        option = Option::ERROR_LOG_FILE;
+      } else if (k == "encoder") {
+        option = Option::ENCODER;
+      } else {
+        option = Option::UNKNOWN;
+      }
+      break;
     case 'g': option = k == "group"                ? Option::GROUP                : Option::UNKNOWN; break;
     case 'h': option = k == "host"                 ? Option::HOST                 : Option::UNKNOWN; break;
     case 'k': option = k == "key"                  ? Option::PRIVATE_KEY          : Option::UNKNOWN; break;
-    case 'p': option = k == "port"                 ? Option::PORT                 : Option::UNKNOWN; break;
+    case 'm': option = k == "max_upload_size"      ? Option::MAX_UPLOAD_SIZE      : Option::UNKNOWN; break;
+    case 'o': option = k == "ordered"              ? Option::ORDERED              : Option::UNKNOWN; break;
+    case 'p':
+      if (k == "port") {
+        option = Option::PORT;
+      } else if (k == "priority_weights") {
+        option = Option::PRIORITY_WEIGHTS;
+      } else if (k.compare(0, sizeof("priority_") - 1, "priority_") == 0) {
+        // priority_<command name>
+        option = Option::PRIORITY;
+      } else {
+        option = Option::UNKNOWN;
+      }
+      break;
     case 'u': option = k == "user"                 ? Option::USER                 : Option::UNKNOWN; break;
+    case 'w': option = k == "workers"              ? Option::WORKERS              : Option::UNKNOWN; break;
+    case 'r':
+      if (k == "resize_cache") {
+        option = Option::RESIZE_CACHE;
+      } else if (k == "resize_cache_size") {
+        option = Option::RESIZE_CACHE_SIZE;
+      } else if (k == "resize_resampler") {
+        option = Option::RESIZE_RESAMPLER;
+      } else {
+        option = Option::UNKNOWN;
+      }
+      break;
     case 'c':
       if (k == "chdir") {
         option = Option::CHDIR;
@@ -568,12 +606,75 @@ AppConfig::set(const std::string& k, const std::string& v) noexcept
     case Option::USER:           m_user      = v;                                   break;
     case Option::GROUP:          m_group     = v;                                   break;
     case Option::ERROR_LOG_FILE: m_error_log = v;                                   break;
+    case Option::RESIZE_CACHE:   m_resize_cache = v;                                break;
+    case Option::RESIZE_CACHE_SIZE:
+      try {
+        // In MiB
+        m_resize_cache_size = static_cast<uint64_t>(std::stoull(v)) << 20;
+      } catch (std::logic_error& e) {
+        warning_log("%s: invalid value '%s'", k.c_str(), v.c_str());
+      }
+      break;
+    case Option::RESIZE_RESAMPLER: m_resize_resampler = v;                          break;
+    case Option::ENCODER:        m_encoder   = v;                                   break;
+    case Option::MAX_UPLOAD_SIZE:
+      try {
+        // In MiB
+        m_max_upload_size = static_cast<uint64_t>(std::stoull(v)) << 20;
+      } catch (std::logic_error& e) {
+        warning_log("%s: invalid value '%s'", k.c_str(), v.c_str());
+      }
+      break;
+    case Option::WORKERS:
+      try {
+        // 0 - one per CPU core
+        m_workers = static_cast<unsigned>(std::stoul(v));
+      } catch (std::logic_error& e) {
+        warning_log("%s: invalid value '%s'", k.c_str(), v.c_str());
+      }
+      if (!m_workers) {
+        m_workers = std::max(1u, std::thread::hardware_concurrency());
+      }
+      break;
+    case Option::ORDERED:        m_ordered   = (v == "yes");                        break;
+    case Option::PRIORITY:
+      try {
+        m_priorities[k.substr(sizeof("priority_") - 1)] = Util::getPriority(v);
+      } catch (ErrorException& e) {
+        warning_log("%s: %s", k.c_str(), e.what());
+      }
+      break;
+    case Option::PRIORITY_WEIGHTS:
+      {
+        // Comma-separated weights of the high, normal and low classes
+        std::stringstream ss(v);
+        std::string weight;
+        unsigned weights[PRIORITY_COUNT];
+        std::copy(std::begin(m_priority_weights), std::end(m_priority_weights), weights);
+        try {
+          for (int i = 0; i < PRIORITY_COUNT && std::getline(ss, weight, ','); ++i) {
+            weights[i] = std::max(1, std::stoi(weight));
+          }
+          std::copy(std::begin(weights), std::end(weights), m_priority_weights);
+        } catch (std::logic_error& e) {
+          warning_log("%s: invalid value '%s'", k.c_str(), v.c_str());
+        }
+      }
+      break;
     case Option::UNKNOWN: // no break
     default: warning_log("Unknown option code: %d", option); break;
   }
 }
 
 
+Priority
+AppConfig::getPriority(const std::string& command_name) const noexcept
+{
+  auto it = m_priorities.find(command_name);
+  return it == m_priorities.end() ? Priority::NORMAL : it->second;
+}
+
+
 AppConfigPtrList
 Config::parse(const std::string& filename)
 {
@@ -690,13 +791,62 @@ Server::sendMessage(Connection conn, const std::string& message, const std::stri
 }
 
 
+bool
+Server::sendOutput(Connection conn, const std::string& output, const std::vector<unsigned char>& data,
+    const std::string& digest) noexcept
+{
+  // Reused by the subsequent outputs sent from this thread
+  static thread_local std::string frame;
+  ptree pt;
+
+  try {
+    std::stringstream json_stream;
+    websocketpp::lib::error_code ec;
+
+    pt.put("response", output);
+    pt.put("type", (int) Server::MessageType::OUTPUT);
+    pt.put("size", data.size());
+    pt.put("digest", digest);
+    boost::property_tree::json_parser::write_json(json_stream, pt, false);
+
+    const std::string header(json_stream.str());
+    const uint32_t header_size = header.size();
+
+    frame.clear();
+    frame.reserve(4 + header_size + data.size());
+    for (int shift = 24; shift >= 0; shift -= 8) {
+      frame.push_back(static_cast<char>((header_size >> shift) & 0xFF));
+    }
+    frame.append(header);
+    frame.append(reinterpret_cast<const char*>(data.data()), data.size());
+
+    m_server.send(conn, frame.data(), frame.size(), websocketpp::frame::opcode::binary, ec);
+    if (ec) {
+      error_log("Fatal error in %s: %s", __func__, Util::getErrorMessage(ec));
+      return false;
+    }
+    return true;
+  } catch (boost::property_tree::ptree_bad_data& e) {
+    error_log("Failed to generate JSON: %s", e.what());
+  } catch (std::exception& e) {
+    error_log("Fatal error: %s", e.what());
+  } catch (...) {
+    error_log("Unknown error in %s. File a bug", __func__);
+  }
+
+  return false;
+}
+
+
 void
 Server::processMessages() noexcept
 {
+  const bool ordered = getOrdered();
+
   while (1) {
     unique_lock<mutex> lock(m_action_lock);
 
-    while (m_actions.empty()) {
+    while (_hasNoActions()) {
       IMTOOLS_SERVER_OBJECT_LOG0(debug, "Worker thread waiting for actions");
 
       unique_lock<mutex> quit_lock(m_quit_lock);
@@ -708,53 +858,211 @@ Server::processMessages() noexcept
       m_action_cond.wait(lock);
     }
 
-    Action a = m_actions.front();
-    m_actions.pop();
+    Action a = _popAction();
     IMTOOLS_SERVER_OBJECT_LOG(debug, "Worker thread got action %d", a.type);
     lock.unlock();
 
-    switch (a.type) {
-      case Action::Type::SUBSCRIBE:
-        {
-          unique_lock<mutex> con_lock(m_connection_lock);
-          m_connections.insert(a.conn);
-        }
-        break;
-      case Action::Type::UNSUBSCRIBE:
-        {
-          unique_lock<mutex> con_lock(m_connection_lock);
-          m_connections.erase(a.conn);
-        }
-        break;
-      case Action::Type::MESSAGE:
-        {
-          unique_lock<mutex> mh_lock(m_message_handler_lock);
-          _messageHandler(a.conn, a.msg);
-          mh_lock.unlock();
-        }
-        break;
+#ifdef IMTOOLS_THREADS
+    // The OpenMP team size is a per-thread setting, so the parallel regions of the
+    // commands run by this worker would otherwise use all of the CPU cores. Applied
+    // for each action, so a command changing it doesn't affect the later ones.
+    IT_INIT_OPENMP(imtools::threads::max_threads());
+#endif
+    _processAction(a);
+
+    if (!ordered || a.type != Action::Type::MESSAGE) {
+      continue;
     }
+
+    // Queue the next message of the connection in its priority class. This worker
+    // takes it (or an action of another class) on the next iteration.
+    lock.lock();
+    auto it = m_pending_actions.find(a.conn);
+    if (it->second.empty()) {
+      m_pending_actions.erase(it);
+      continue;
+    }
+    m_actions[static_cast<int>(it->second.front().priority)].push(it->second.front());
+    it->second.pop();
   }
 }
 
 
 void
-Server::onOpen(Connection conn) noexcept
+Server::_pushAction(const Action& a) noexcept
 {
   unique_lock<mutex> lock(m_action_lock);
-  m_actions.push(Action(Action::Type::SUBSCRIBE, conn));
+
+  if (getOrdered() && a.type == Action::Type::MESSAGE) {
+    // A message of this connection is queued or being processed. Hold this one until
+    // then, so it doesn't overtake the previous one from a higher priority class.
+    auto it = m_pending_actions.find(a.conn);
+    if (it != m_pending_actions.end()) {
+      it->second.push(a);
+      return;
+    }
+    m_pending_actions.emplace(a.conn, std::queue<Action>());
+  }
+
+  m_actions[static_cast<int>(a.priority)].push(a);
   lock.unlock();
   m_action_cond.notify_one();
 }
 
 
+bool
+Server::_hasNoActions() const noexcept
+{
+  for (auto& actions : m_actions) {
+    if (!actions.empty()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+Action
+Server::_popAction() noexcept
+{
+  // Smooth weighted round-robin: each non-empty class earns its weight, the richest
+  // class is served and pays the total. So the classes are served in proportion
+  // to their weights, and evenly interleaved.
+  int total = 0;
+  int selected = -1;
+  for (int i = 0; i < PRIORITY_COUNT; ++i) {
+    if (m_actions[i].empty()) {
+      m_action_credits[i] = 0;
+      continue;
+    }
+    int weight = static_cast<int>(getPriorityWeight(static_cast<Priority>(i)));
+    m_action_credits[i] += weight;
+    total += weight;
+    if (selected < 0 || m_action_credits[i] > m_action_credits[selected]) {
+      selected = i;
+    }
+  }
+  assert(selected >= 0);
+  m_action_credits[selected] -= total;
+
+  Action a = m_actions[selected].front();
+  m_actions[selected].pop();
+
+  auto wait_usec = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - a.time).count());
+  auto& stats = m_queue_stats[selected];
+  ++stats.count;
+  stats.wait_usec += wait_usec;
+  stats.max_wait_usec = std::max(stats.max_wait_usec, wait_usec);
+
+  IMTOOLS_SERVER_OBJECT_LOG(debug, "Action waited %" PRIu64 " usec in %s queue, depth: %lu",
+      wait_usec, Util::getPriorityName(a.priority),
+      static_cast<unsigned long>(m_actions[selected].size()));
+
+  return a;
+}
+
+
+Priority
+Server::_getPriority(const WebSocketServer::message_ptr& msg) const noexcept
+{
+  Priority priority = Priority::NORMAL;
+
+  try {
+    const std::string& payload = msg->get_payload();
+    std::stringstream ss;
+    ptree pt;
+
+    if (msg->get_opcode() == websocketpp::frame::opcode::binary) {
+      size_t json_size;
+      if (!Util::getJsonSize(payload, json_size)) {
+        return priority;
+      }
+      ss.str(payload.substr(4, json_size));
+    } else {
+      ss.str(payload);
+    }
+    boost::property_tree::json_parser::read_json(ss, pt);
+
+    priority = m_config->getPriority(pt.get<std::string>("command", std::string()));
+
+    // A request may only lower its priority
+    auto name = pt.get<std::string>("priority", std::string());
+    if (!name.empty()) {
+      priority = std::max(priority, Util::getPriority(name));
+    }
+  } catch (std::exception& e) {
+    // The message handler reports the errors
+  }
+
+  return priority;
+}
+
+
+std::string
+Server::_getQueueStats() noexcept
+{
+  std::string result;
+  char buf[256];
+
+  unique_lock<mutex> lock(m_action_lock);
+  for (int i = 0; i < PRIORITY_COUNT; ++i) {
+    const char* name = Util::getPriorityName(static_cast<Priority>(i));
+    const auto& stats = m_queue_stats[i];
+    snprintf(buf, sizeof(buf),
+        "queue_%s_depth: %lu\n"
+        "queue_%s_count: %" PRIu64 "\n"
+        "queue_%s_wait_usec: %" PRIu64 "\n"
+        "queue_%s_max_wait_usec: %" PRIu64 "\n",
+        name, static_cast<unsigned long>(m_actions[i].size()),
+        name, stats.count,
+        name, stats.wait_usec,
+        name, stats.max_wait_usec);
+    result += buf;
+  }
+
+  return result;
+}
+
+
+void
+Server::_processAction(const Action& a) noexcept
+{
+  switch (a.type) {
+    case Action::Type::SUBSCRIBE:
+      {
+        unique_lock<mutex> con_lock(m_connection_lock);
+        m_connections.insert(a.conn);
+      }
+      break;
+    case Action::Type::UNSUBSCRIBE:
+      {
+        unique_lock<mutex> con_lock(m_connection_lock);
+        m_connections.erase(a.conn);
+      }
+      break;
+    case Action::Type::MESSAGE:
+      try {
+        _messageHandler(a.conn, a.msg);
+      } catch (std::exception& e) {
+        error_log("Unhandled error in '%s': %s. Please file a bug.", __func__, e.what());
+      }
+      break;
+  }
+}
+
+
+void
+Server::onOpen(Connection conn) noexcept
+{
+  _pushAction(Action(Action::Type::SUBSCRIBE, conn));
+}
+
+
 void
 Server::onClose(Connection conn) noexcept
 {
-  unique_lock<mutex> lock(m_action_lock);
-  m_actions.push(Action(Action::Type::UNSUBSCRIBE, conn));
-  lock.unlock();
-  m_action_cond.notify_one();
+  _pushAction(Action(Action::Type::UNSUBSCRIBE, conn));
 }
 
 
@@ -776,10 +1084,31 @@ Server::_messageHandler(Connection conn, WebSocketServer::message_ptr msg)
   ptree pt_empty;
   std::string error;
   std::string input_digest;
+  bool binary = false;
   Command::Arguments arguments;
-  std::stringstream ss(msg->get_payload());
+  const std::string& payload = msg->get_payload();
+  const bool is_binary = msg->get_opcode() == websocketpp::frame::opcode::binary;
+  std::vector<imtools::MemoryFilePtr> uploads;
+  size_t offset = 0;
+  std::stringstream ss;
 
   try {
+    if (is_binary) {
+      // 4-byte big-endian length of the JSON request, the request, then the uploaded files
+      size_t json_size;
+      if (!Util::getJsonSize(payload, json_size)) {
+        throw ErrorException("Invalid binary message");
+      }
+      offset = 4;
+      if (payload.size() - offset - json_size > getMaxUploadSize()) {
+        throw ErrorException("Uploads exceed %lu bytes", static_cast<unsigned long>(getMaxUploadSize()));
+      }
+      ss.str(payload.substr(offset, json_size));
+      offset += json_size;
+    } else {
+      ss.str(payload);
+    }
+
     IMTOOLS_SERVER_OBJECT_LOG(debug, "Parsing JSON: %s", ss.str().c_str());
     boost::property_tree::json_parser::read_json(ss, pt);
 
@@ -787,6 +1116,7 @@ Server::_messageHandler(Connection conn, WebSocketServer::message_ptr msg)
 
     auto command_name = pt.get<std::string>("command", default_value);
     input_digest      = pt.get<std::string>("digest", default_value);
+    binary            = pt.get<bool>("binary", false);
     auto pt_arg       = pt.get_child("arguments", pt_empty);
 
     if (pt_arg.empty()) {
@@ -799,23 +1129,63 @@ Server::_messageHandler(Connection conn, WebSocketServer::message_ptr msg)
       throw ErrorException("Empty digest");
     }
 
+    // Sizes of the uploaded files following the request in a binary message. The files
+    // are referred to as "#0", "#1" etc. in the arguments.
+    for (auto& it : pt.get_child("uploads", pt_empty)) {
+      if (!is_binary) {
+        throw ErrorException("Uploads are expected in a binary message");
+      }
+      size_t size;
+      try {
+        size = std::stoull(it.second.data());
+      } catch (std::logic_error& e) {
+        throw ErrorException("Invalid upload size: '%s'", it.second.data().c_str());
+      }
+      if (size > payload.size() - offset) {
+        throw ErrorException("Upload #%lu is out of the message", static_cast<unsigned long>(uploads.size()));
+      }
+      uploads.emplace_back(new imtools::MemoryFile(payload.data() + offset, size));
+      offset += size;
+    }
+    if (is_binary && offset != payload.size()) {
+      throw ErrorException("Unexpected data after the uploads");
+    }
+
     IMTOOLS_SERVER_OBJECT_LOG0(debug, "Started Transforming ptree values");
     std::transform(std::begin(pt_arg), std::end(pt_arg),
         std::back_inserter(arguments), Util::convertPtreeValue);
     IMTOOLS_SERVER_OBJECT_LOG0(debug, "Finished transforming ptree values");
 
-    auto command_ptr = get_command(Command::getType(command_name), arguments);
+    if (Util::hasMemoryFileNames(arguments)) {
+      throw ErrorException("Arguments must not refer to %s names", imtools::MEMORY_FILE_PREFIX);
+    }
+
+    auto command_type = Command::getType(command_name);
+    auto command_ptr = get_command(command_type, arguments);
 
     IMTOOLS_SERVER_OBJECT_LOG(debug, "Checking digest for command '%s'", command_name.c_str());
     if (!checkCommandDigest(*command_ptr, input_digest)) {
       throw ErrorException("Invalid digest");
     }
 
+    if (!uploads.empty()) {
+      // The digest covers the arguments as sent. The command reads the uploads from memory.
+      command_ptr = get_command(command_type, Util::resolveUploads(arguments, uploads));
+    }
+
     IMTOOLS_SERVER_OBJECT_LOG(debug, "Running command: '%s'", command_name.c_str());
     command_ptr->setAllowAbsolutePaths(getAllowAbsolutePaths());
     command_ptr->setEventCallback([&](const CommandResult& r) {
         sendMessage(conn, r, std::string(), Server::MessageType::PROGRESS);
     });
+    if (binary) {
+      // Nothing is written to the filesystem
+      command_ptr->setOutputCallback([&](const std::string& output, const std::vector<unsigned char>& data) {
+          if (!sendOutput(conn, output, data, input_digest)) {
+            throw ErrorException("Failed to send output %s", output.c_str());
+          }
+      });
+    }
 
     CommandResult result;
     command_ptr->run(result);
@@ -843,11 +1213,7 @@ Server::_messageHandler(Connection conn, WebSocketServer::message_ptr msg)
 void
 Server::onMessage(Connection conn, WebSocketServer::message_ptr msg) noexcept
 {
-  unique_lock<mutex> lock(m_action_lock);
-  m_actions.push(Action(Action::Type::MESSAGE, conn, msg));
-  lock.unlock();
-  m_action_cond.notify_one();
-
+  _pushAction(Action(Action::Type::MESSAGE, conn, msg, _getPriority(msg)));
 }
 
 void
@@ -931,6 +1297,8 @@ Server::run()
   m_server.set_fail_handler(bind(&Server::onFail, this, ::_1));
 
   m_server.set_reuse_addr(true);
+  // websocketpp closes connections sending larger messages (32 MB by default)
+  m_server.set_max_message_size(getMaxUploadSize() + MAX_REQUEST_SIZE);
 
   m_server.init_asio(ec);
   if (ec) {
@@ -978,6 +1346,24 @@ Server::run()
     throw ErrorException("worker user/group configuration failed");
   }
 
+  // Relative to chdir, and owned by the worker user
+  if (!getResizeCacheDir().empty()) {
+    IMTOOLS_SERVER_OBJECT_LOG(verbose, "Resize cache: %s, max. size: %" PRIu64 " bytes",
+        getResizeCacheDir().c_str(), getResizeCacheSize());
+    imtools::imresize::ResizeCommand::setCache(std::make_shared<imtools::imresize::ThumbnailCache>(
+          getResizeCacheDir(), getResizeCacheSize()));
+  }
+
+  imtools::imresize::ResizeCommand::setResampler(
+      imtools::imresize::ResizeCommand::getResamplerByName(getResizeResampler()));
+
+  if (!getEncoder().empty()) {
+    IMTOOLS_SERVER_OBJECT_LOG(verbose, "Encoder profile: %s", getEncoder().c_str());
+    imtools::Command::setDefaultEncoderProfile(imtools::EncoderProfile::get(getEncoder()));
+  }
+
+  imtools::MetaCommand::setStatsProvider([this]() { return _getQueueStats(); });
+
 #ifdef HAVE_PR_SET_DUMPABLE
   if (prctl(PR_SET_DUMPABLE, 1, 0, 0, 0) != 0) {
     throw ErrorException("prctl(PR_SET_DUMPABLE): %s", strerror(errno));
@@ -1037,6 +1423,116 @@ Util::convertPtreeValue(const ptree::value_type& v) noexcept
 }
 
 
+Command::Arguments
+Util::resolveUploads(const Command::Arguments& arguments, const std::vector<imtools::MemoryFilePtr>& uploads)
+{
+  Command::Arguments result;
+
+  auto resolve = [&uploads](const std::string& value) -> std::string {
+    if (value.size() < 2 || value[0] != '#'
+        || value.find_first_not_of("0123456789", 1) != std::string::npos)
+    {
+      return value;
+    }
+    size_t index = std::stoul(value.substr(1));
+    if (index >= uploads.size()) {
+      throw ErrorException("No upload %s", value.c_str());
+    }
+    return uploads[index]->getName();
+  };
+
+  result.reserve(arguments.size());
+  for (auto& it : arguments) {
+    Command::Value* value_ptr;
+
+    if (it.second->getType() == Command::Value::Type::ARRAY) {
+      Command::Value::ArrayType array(it.second->getArray());
+      for (auto& item : array) {
+        item = resolve(item);
+      }
+      value_ptr = new Command::ArrayValue(array);
+    } else {
+      value_ptr = new Command::StringValue(resolve(it.second->getString()));
+    }
+    result.push_back(Command::ArgumentItem(it.first, Command::CValuePtr(value_ptr)));
+  }
+
+  return result;
+}
+
+
+bool
+Util::hasMemoryFileNames(const Command::Arguments& arguments) noexcept
+{
+  // Leading slashes and spaces may be trimmed from the paths (see Command::trimPath())
+  auto is_memory_file = [](const std::string& value) {
+    return value.find(imtools::MEMORY_FILE_PREFIX) != std::string::npos;
+  };
+
+  for (auto& it : arguments) {
+    if (it.second->getType() == Command::Value::Type::ARRAY) {
+      for (auto& item : it.second->getArray()) {
+        if (is_memory_file(item)) {
+          return true;
+        }
+      }
+    } else if (is_memory_file(it.second->getString())) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+bool
+Util::getJsonSize(const std::string& payload, size_t& json_size) noexcept
+{
+  if (payload.size() < 4) {
+    return false;
+  }
+
+  uint32_t size = 0;
+  for (int i = 0; i < 4; ++i) {
+    size = (size << 8) | static_cast<unsigned char>(payload[i]);
+  }
+  if (size > payload.size() - 4) {
+    return false;
+  }
+
+  json_size = size;
+  return true;
+}
+
+
+Priority
+Util::getPriority(const std::string& name)
+{
+  if (name == "high") {
+    return Priority::HIGH;
+  }
+  if (name == "normal") {
+    return Priority::NORMAL;
+  }
+  if (name == "low") {
+    return Priority::LOW;
+  }
+  throw ErrorException("Unknown priority class '%s'", name.c_str());
+}
+
+
+const char*
+Util::getPriorityName(Priority priority) noexcept
+{
+  switch (priority) {
+    case Priority::HIGH:   return "high";
+    case Priority::NORMAL: return "normal";
+    case Priority::LOW:    return "low";
+  }
+  return "unknown";
+}
+
+
 std::string
 Util::makeSHA1(const std::string& source) noexcept
 {
@@ -1312,9 +1808,20 @@ run(AppConfigPtrList& config_list)
       debug_log("replacing g_server, use count = %ld", g_server.use_count());
       g_server.reset(new Server(config));
 
-      thread worker_thread(bind(&Server::processMessages, ref(g_server)));
+#ifdef IMTOOLS_THREADS
+      // Share the CPU cores between the commands running concurrently
+      imtools::threads::set_max_threads(std::max(1u,
+            std::thread::hardware_concurrency() / g_server->getWorkers()));
+#endif
+
+      std::vector<thread> worker_threads;
+      for (unsigned i = 0; i < g_server->getWorkers(); ++i) {
+        worker_threads.emplace_back(bind(&Server::processMessages, ref(g_server)));
+      }
       g_server->run();
-      worker_thread.join();
+      for (auto& worker_thread : worker_threads) {
+        worker_thread.join();
+      }
 
       exit(EXIT_SUCCESS);
     }
@@ -26,7 +26,10 @@
 #include <string>
 #include <memory>
 #include <set>
+#include <map>
+#include <queue>
 #include <atomic>
+#include <chrono>
 
 #include <boost/property_tree/ptree.hpp>
 #include <websocketpp/config/asio_no_tls.hpp>
@@ -98,6 +101,19 @@ const struct option g_long_options[] = {
 
 /////////////////////////////////////////////////////////////////////
 
+/// Request priority classes. Each class has a separate action queue.
+enum class Priority : int
+{
+  HIGH   = 0,
+  NORMAL = 1,
+  LOW    = 2
+};
+
+/// Number of the priority classes
+const int PRIORITY_COUNT = 3;
+
+/////////////////////////////////////////////////////////////////////
+
 struct Action
 {
     enum class Type : int
@@ -111,12 +127,15 @@ struct Action
     };
 
     Action(Type t, Connection c) : type(t), conn(c) {}
-    Action(Type t, Connection c, WebSocketServer::message_ptr m)
-    : type(t), conn(c), msg(m) {}
+    Action(Type t, Connection c, WebSocketServer::message_ptr m, Priority p)
+    : type(t), conn(c), msg(m), priority(p) {}
 
     Type type;
     Connection conn;
     WebSocketServer::message_ptr msg;
+    Priority priority{Priority::HIGH};
+    /// Time when the action was queued
+    std::chrono::steady_clock::time_point time{std::chrono::steady_clock::now()};
 };
 
 /////////////////////////////////////////////////////////////////////
@@ -133,9 +152,31 @@ class Util
      * Command::ArgumentItem */
     static Command::ArgumentItem convertPtreeValue(const boost::property_tree::ptree::value_type& v) noexcept;
 
+    /*! Parses the header of a binary request message: 4-byte big-endian length of the JSON
+     * request followed by the request
+     * \returns false, if the message is too short */
+    static bool getJsonSize(const std::string& payload, size_t& json_size) noexcept;
+
+    /*! \returns priority class by name ("high", "normal", "low")
+     * \throws ErrorException, if the name is unknown */
+    static Priority getPriority(const std::string& name);
+    /// \returns name of the priority class
+    static const char* getPriorityName(Priority priority) noexcept;
+
     /*! \returns SHA-1 digest for `source` message in hexadecimal format */
     static std::string makeSHA1(const std::string& source) noexcept;
 
+    /*! \returns copy of `arguments` where the values (or array items) `#N` are replaced
+     * with the names of `uploads[N]`
+     * \throws ErrorException, if `N` is out of range */
+    static Command::Arguments resolveUploads(const Command::Arguments& arguments,
+        const std::vector<imtools::MemoryFilePtr>& uploads);
+
+    /*! \returns whether any of the values (or array items) of `arguments` refers to
+     * a `MemoryFile` (see `imtools::MEMORY_FILE_PREFIX`). The clients refer to their
+     * uploads only by `#N`, so such arguments are rejected. */
+    static bool hasMemoryFileNames(const Command::Arguments& arguments) noexcept;
+
     /*! Retrieves user information from `/etc/passwd`
      * \param name user name
      * \param pwd output container
@@ -170,7 +211,16 @@ class AppConfig
       CHROOT,
       USER,
       GROUP,
-      ERROR_LOG_FILE
+      ERROR_LOG_FILE,
+      RESIZE_CACHE,
+      RESIZE_CACHE_SIZE,
+      RESIZE_RESAMPLER,
+      ENCODER,
+      MAX_UPLOAD_SIZE,
+      WORKERS,
+      ORDERED,
+      PRIORITY,
+      PRIORITY_WEIGHTS
     };
 
   public:
@@ -202,6 +252,19 @@ class AppConfig
     inline const std::string& getUser() const noexcept { return m_user; }
     inline const std::string& getGroup() const noexcept { return m_group; }
     inline const std::string& getErrorLogFile() const noexcept { return m_error_log; }
+    inline const std::string& getResizeCacheDir() const noexcept { return m_resize_cache; }
+    inline uint64_t getResizeCacheSize() const noexcept { return m_resize_cache_size; }
+    inline const std::string& getResizeResampler() const noexcept { return m_resize_resampler; }
+    inline const std::string& getEncoder() const noexcept { return m_encoder; }
+    inline uint64_t getMaxUploadSize() const noexcept { return m_max_upload_size; }
+    inline unsigned getWorkers() const noexcept { return m_workers; }
+    inline bool getOrdered() const noexcept { return m_ordered; }
+    inline unsigned getPriorityWeight(Priority priority) const noexcept
+    {
+      return m_priority_weights[static_cast<int>(priority)];
+    }
+    /// \returns priority class of the command (`Priority::NORMAL` by default)
+    Priority getPriority(const std::string& command_name) const noexcept;
 
   protected:
     /*! \param k Option name
@@ -231,6 +294,24 @@ class AppConfig
     std::string m_group;
     /// Path to error log file
     std::string m_error_log;
+    /// Thumbnail cache directory for `resize` command (empty - no cache)
+    std::string m_resize_cache;
+    /// Max. size of the thumbnail cache in bytes (0 - unlimited)
+    uint64_t m_resize_cache_size = 0;
+    /// Resampling engine for `resize` command ("auto", "opencv", "imtools")
+    std::string m_resize_resampler{"auto"};
+    /// Encoder profile ("fastest", "balanced", "smallest"; empty - built-in settings)
+    std::string m_encoder;
+    /// Max. total size of the files uploaded with a request in bytes
+    uint64_t m_max_upload_size = 32 << 20;
+    /// Number of threads processing the requests
+    unsigned m_workers = 1;
+    /// Whether the requests of a connection are processed one after another (in order)
+    bool m_ordered = true;
+    /// Priority classes of the commands by command name
+    std::map<std::string, Priority> m_priorities;
+    /// Shares of the workers' time given to the priority classes, when all are busy
+    unsigned m_priority_weights[PRIORITY_COUNT] = {4, 2, 1};
 
 };
 
@@ -302,6 +383,8 @@ class Server
       ERROR    = 1,
       SUCCESS  = 2,
       PROGRESS = 3,
+      /// Encoded output image sent in a binary frame
+      OUTPUT   = 4,
     };
 
     enum class CommandType : int
@@ -311,6 +394,9 @@ class Server
       RESTART
     };
 
+    /// Max. size of a message in addition to the uploads (the JSON request and its header)
+    static const uint64_t MAX_REQUEST_SIZE = 1 << 20;
+
   public:
     virtual ~Server() {}
     explicit Server(const AppConfigPtr& config) noexcept;
@@ -324,7 +410,7 @@ class Server
     void run();
     /// Stops accepting connections, closes all active connections
     void stop();
-    /// Thread function for actual work
+    /// Thread function for actual work. Runs on each of `getWorkers()` threads.
     void processMessages() noexcept;
 
   public:
@@ -355,6 +441,14 @@ class Server
     inline const std::string& getUser() const noexcept { return m_config->getUser(); }
     inline const std::string& getGroup() const noexcept { return m_config->getGroup(); }
     inline const std::string& getErrorLogFile() const noexcept { return m_config->getErrorLogFile(); }
+    inline const std::string& getResizeCacheDir() const noexcept { return m_config->getResizeCacheDir(); }
+    inline uint64_t getResizeCacheSize() const noexcept { return m_config->getResizeCacheSize(); }
+    inline const std::string& getResizeResampler() const noexcept { return m_config->getResizeResampler(); }
+    inline const std::string& getEncoder() const noexcept { return m_config->getEncoder(); }
+    inline uint64_t getMaxUploadSize() const noexcept { return m_config->getMaxUploadSize(); }
+    inline unsigned getWorkers() const noexcept { return m_config->getWorkers(); }
+    inline bool getOrdered() const noexcept { return m_config->getOrdered(); }
+    inline unsigned getPriorityWeight(Priority priority) const noexcept { return m_config->getPriorityWeight(priority); }
 
     /// \returns numeric representation of the server command name
     static CommandType getCommandType(const char* name) noexcept;
@@ -362,6 +456,12 @@ class Server
   protected:
     /// Sends response message to the client.
     void sendMessage(Connection conn, const std::string& message, const std::string& digest, MessageType type) noexcept;
+    /*! Sends encoded output image `data` to the client in a binary frame: 4-byte big-endian
+     * length of the JSON header, the header (output name, size and the request digest), and
+     * the data.
+     * \returns false on error */
+    bool sendOutput(Connection conn, const std::string& output, const std::vector<unsigned char>& data,
+        const std::string& digest) noexcept;
     /// \returns whether `digest` corresponds to the `command`
     bool checkCommandDigest(const imtools::Command& command, const std::string& digest) const noexcept;
     /// Configures UID/GID for the worker process
@@ -383,12 +483,52 @@ class Server
     /// Linux group ID
     gid_t m_gid{0};
 
+  private:
+    /// Processes action `a`
+    void _processAction(const Action& a) noexcept;
+    /*! Queues action `a` into the queue of its priority class. In ordered mode, a message
+     * is held in `m_pending_actions` while the previous message of the connection is
+     * queued or processed. */
+    void _pushAction(const Action& a) noexcept;
+    /*! Takes the next action from the queues by weighted round-robin over the non-empty
+     * priority classes. Should be called with `m_action_lock` held. */
+    Action _popAction() noexcept;
+    /// \returns whether all action queues are empty. Should be called with `m_action_lock` held.
+    bool _hasNoActions() const noexcept;
+    /*! \returns priority class of the request in `msg`: the class of the command, or lower
+     * class from the optional `priority` field of the request */
+    Priority _getPriority(const WebSocketServer::message_ptr& msg) const noexcept;
+    /// \returns action queue statistics in `name: value` lines
+    std::string _getQueueStats() noexcept;
+
   protected:
-    std::queue<Action> m_actions;
+    /*! Messages of the connections waiting for the previous message of the connection
+     * to be processed (in ordered mode) */
+    typedef std::map<Connection, std::queue<Action>, std::owner_less<Connection>> PendingActions;
+
+    /// Per-class action queue statistics
+    struct QueueStats
+    {
+      /// Number of actions taken from the queue
+      uint64_t count{0};
+      /// Total time the actions waited in the queue in microseconds
+      uint64_t wait_usec{0};
+      /// Max. time an action waited in the queue in microseconds
+      uint64_t max_wait_usec{0};
+    };
+
+    /// Action queues by priority class (guarded by `m_action_lock`)
+    std::queue<Action> m_actions[PRIORITY_COUNT];
+    /// Current weights of the smooth weighted round-robin (guarded by `m_action_lock`)
+    int m_action_credits[PRIORITY_COUNT] = {0};
+    /// Guarded by `m_action_lock`
+    QueueStats m_queue_stats[PRIORITY_COUNT];
+    /*! Connections with a message queued or being processed (guarded by `m_action_lock`).
+     * Only one message of such connection is in `m_actions` or processed at a time. */
+    PendingActions m_pending_actions;
     websocketpp::lib::mutex m_action_lock;
     websocketpp::lib::mutex m_connection_lock;
     websocketpp::lib::mutex m_quit_lock;
-    websocketpp::lib::mutex m_message_handler_lock;
     websocketpp::lib::condition_variable m_action_cond;
 
     bool m_stop_requested{false};
@@ -72,8 +72,29 @@
 # define IMTOOLS_DEBUG_PROFILER_FEATURE "NoDebugProfiler"
 #endif
 
+#ifdef IMTOOLS_HAVE_LIBWEBP
+# define IMTOOLS_WEBP_FEATURE "LibWebP"
+#else
+# define IMTOOLS_WEBP_FEATURE "NoLibWebP"
+#endif
+
+#ifdef IMTOOLS_HAVE_ZLIB
+# define IMTOOLS_PNG_FEATURE "ParallelPNG"
+#else
+# define IMTOOLS_PNG_FEATURE "NoParallelPNG"
+#endif
+
+#if defined(IMTOOLS_HAVE_LIBJPEG) && defined(IMTOOLS_THREADS)
+# define IMTOOLS_JPEG_FEATURE "ParallelJPEG"
+#else
+# define IMTOOLS_JPEG_FEATURE "NoParallelJPEG"
+#endif
+
 #define IMTOOLS_FEATURES \
   IMTOOLS_THREADS_FEATURE " " \
+  IMTOOLS_WEBP_FEATURE " " \
+  IMTOOLS_PNG_FEATURE " " \
+  IMTOOLS_JPEG_FEATURE " " \
   IMTOOLS_EXTRA_FEATURE " " \
   IMTOOLS_DEBUG_FEATURE " " \
   IMTOOLS_DEBUG_PROFILER_FEATURE
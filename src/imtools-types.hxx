@@ -39,6 +39,24 @@ enum Blur {
   BLUR_MEDIAN = 3
 };
 
+/// Image formats recognized by `probe_image()`
+enum class ImageFormat : int {
+  UNKNOWN,
+  JPEG,
+  PNG,
+  GIF,
+  BMP,
+  WEBP,
+  TIFF
+};
+
+/// Image properties read from the header
+struct ImageInfo {
+  ImageFormat format = ImageFormat::UNKNOWN;
+  int width  = 0;
+  int height = 0;
+};
+
 enum Threshold {
   /// Default modification threshold (in percents).
   //THRESHOLD_MOD = 25,
@@ -14,15 +14,46 @@
  * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
  */
 #include <sys/stat.h>
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <map>
+#include <atomic>
+#include <random>
 
 #include "imtools.hxx"
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
+#ifdef IMTOOLS_HAVE_LIBJPEG
+# include "jpegreader.hxx"
+#endif
 
 namespace imtools {
 
 uint_t verbose = 0;
 
+/// Whether `STDIO_FILENAME` refers to stdin/stdout
+static bool g_stdio_enabled = false;
+
+/// Contents of stdin read by `read_stdin()`
+static std::vector<unsigned char> g_stdin_data;
+static std::once_flag g_stdin_once;
+
+/// Data of the existing `MemoryFile` objects by name
+typedef std::map<std::string, std::pair<const unsigned char*, size_t>> MemoryFileMap;
+static MemoryFileMap g_memory_files;
+static std::mutex g_memory_files_lock;
+static std::atomic<uint64_t> g_memory_file_count{0};
+
+/// Number of pixels beyond a pixel which affect the morphological closing in `bound_boxes()`
+static const int BOUND_BOXES_HALO = 2;
+/// Number of pixels beyond a pixel which affect the morphological closing in `_merge_small_boxes()`
+static const int SMALL_BOXES_HALO = 16;
+
+
 /////////////////////////////////////////////////////////////////////
 
 bool
@@ -40,6 +71,445 @@ file_exists(const std::string& filename)
 }
 
 
+void
+set_stdio_enabled(bool enabled) noexcept
+{
+  g_stdio_enabled = enabled;
+}
+
+
+bool
+is_stdio(const std::string& filename) noexcept
+{
+  return g_stdio_enabled && filename == STDIO_FILENAME;
+}
+
+
+const std::vector<unsigned char>&
+read_stdin()
+{
+  std::call_once(g_stdin_once, []() {
+      unsigned char buf[65536];
+      size_t n;
+
+      while ((n = fread(buf, 1, sizeof(buf), stdin)) > 0) {
+        g_stdin_data.insert(g_stdin_data.end(), buf, buf + n);
+      }
+      if (ferror(stdin)) {
+        g_stdin_data.clear();
+        throw ErrorException("Failed to read stdin");
+      }
+      debug_log("Read %lu bytes from stdin", static_cast<unsigned long>(g_stdin_data.size()));
+  });
+
+  return g_stdin_data;
+}
+
+
+MemoryFile::MemoryFile(const void* data, size_t size)
+{
+  std::lock_guard<std::mutex> lock(g_memory_files_lock);
+
+  // The random part makes the name known only to the owner of the object
+  std::random_device rd;
+  char token[32];
+  snprintf(token, sizeof(token), "%08x%08x", rd(), rd());
+  m_name = MEMORY_FILE_PREFIX + std::to_string(++g_memory_file_count) + '-' + token;
+
+  g_memory_files[m_name] = std::make_pair(static_cast<const unsigned char*>(data), size);
+}
+
+
+MemoryFile::~MemoryFile()
+{
+  std::lock_guard<std::mutex> lock(g_memory_files_lock);
+  g_memory_files.erase(m_name);
+}
+
+
+bool
+MemoryFile::find(const std::string& name, const unsigned char*& data, size_t& size) noexcept
+{
+  if (name.compare(0, strlen(MEMORY_FILE_PREFIX), MEMORY_FILE_PREFIX) != 0) {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(g_memory_files_lock);
+  auto it = g_memory_files.find(name);
+  if (it == g_memory_files.end()) {
+    return false;
+  }
+  data = it->second.first;
+  size = it->second.second;
+
+  return true;
+}
+
+
+FILE*
+open_file(const std::string& filename) noexcept
+{
+  const unsigned char* data;
+  size_t size;
+
+  if (MemoryFile::find(filename, data, size)) {
+    return size ? fmemopen(const_cast<unsigned char*>(data), size, "rb") : nullptr;
+  }
+  if (!is_stdio(filename)) {
+    return fopen(filename.c_str(), "rb");
+  }
+
+  try {
+    const std::vector<unsigned char>& input = read_stdin();
+    if (input.empty()) {
+      return nullptr;
+    }
+    return fmemopen(const_cast<unsigned char*>(input.data()), input.size(), "rb");
+  } catch (ErrorException& e) {
+    warning_log("%s", e.what());
+    return nullptr;
+  }
+}
+
+
+uint64_t
+hash_bytes(const void* data, size_t size, uint64_t hash)
+{
+  const uint64_t prime = 0x100000001b3ULL;
+  auto p = static_cast<const unsigned char*>(data);
+
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= p[i];
+    hash *= prime;
+  }
+
+  return hash;
+}
+
+
+uint64_t
+hash_file(const std::string& filename, uint64_t hash)
+{
+  FILE* fp = open_file(filename);
+  if (!fp) {
+    throw ErrorException("Failed to open file %s", filename.c_str());
+  }
+
+  char buf[65536];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+    hash = hash_bytes(buf, n, hash);
+  }
+
+  bool failed = ferror(fp);
+  fclose(fp);
+  if (failed) {
+    throw ErrorException("Failed to read file %s", filename.c_str());
+  }
+
+  return hash;
+}
+
+
+bool
+files_equal(const std::string& a, const std::string& b)
+{
+  if (a == b) {
+    return true;
+  }
+
+  std::unique_ptr<FILE, int (*)(FILE*)> fa(open_file(a), fclose);
+  if (!fa) {
+    throw ErrorException("Failed to open file %s", a.c_str());
+  }
+  std::unique_ptr<FILE, int (*)(FILE*)> fb(open_file(b), fclose);
+  if (!fb) {
+    throw ErrorException("Failed to open file %s", b.c_str());
+  }
+
+  char buf_a[32768];
+  char buf_b[32768];
+  size_t n_a, n_b;
+  do {
+    n_a = fread(buf_a, 1, sizeof(buf_a), fa.get());
+    n_b = fread(buf_b, 1, sizeof(buf_b), fb.get());
+    if (n_a != n_b || memcmp(buf_a, buf_b, n_a) != 0) {
+      return false;
+    }
+  } while (n_a > 0);
+
+  if (ferror(fa.get()) || ferror(fb.get())) {
+    throw ErrorException("Failed to read file %s or %s", a.c_str(), b.c_str());
+  }
+
+  return true;
+}
+
+
+static inline uint32_t
+_be16(const unsigned char* p)
+{
+  return (p[0] << 8) | p[1];
+}
+
+
+static inline uint32_t
+_le16(const unsigned char* p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+
+static inline uint32_t
+_be32(const unsigned char* p)
+{
+  return (static_cast<uint32_t>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+
+static inline uint32_t
+_le32(const unsigned char* p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+
+/// Finds the first SOFn segment of a JPEG stream positioned after SOI
+static bool
+_probe_jpeg(ImageInfo& info, FILE* fp)
+{
+  unsigned char buf[7];
+  int c;
+
+  for (;;) {
+    // Markers may be preceded by any number of fill bytes
+    if ((c = fgetc(fp)) != 0xFF) {
+      return false;
+    }
+    while ((c = fgetc(fp)) == 0xFF)
+      ;
+    if (c == EOF) {
+      return false;
+    }
+
+    // Standalone markers
+    if (c == 0x01 || (c >= 0xD0 && c <= 0xD8)) {
+      continue;
+    }
+    if (c == 0xD9 || c == 0xDA) {
+      // EOI or SOS before SOF
+      return false;
+    }
+
+    if (fread(buf, 1, 2, fp) != 2) {
+      return false;
+    }
+    uint32_t length = _be16(buf);
+    if (length < 2) {
+      return false;
+    }
+
+    // SOF0..SOF15 except DHT, JPG and DAC
+    if (c >= 0xC0 && c <= 0xCF && c != 0xC4 && c != 0xC8 && c != 0xCC) {
+      if (length < 7 || fread(buf, 1, 5, fp) != 5) {
+        return false;
+      }
+      info.height = _be16(buf + 1);
+      info.width  = _be16(buf + 3);
+      return true;
+    }
+
+    if (fseek(fp, length - 2, SEEK_CUR) != 0) {
+      return false;
+    }
+  }
+}
+
+
+/// Reads dimensions from the first IFD of a TIFF file
+static bool
+_probe_tiff(ImageInfo& info, FILE* fp, const unsigned char* header)
+{
+  const bool le = header[0] == 'I';
+  auto u16 = [le](const unsigned char* p) { return le ? _le16(p) : _be16(p); };
+  auto u32 = [le](const unsigned char* p) { return le ? _le32(p) : _be32(p); };
+  unsigned char buf[12];
+
+  if (fseek(fp, u32(header + 4), SEEK_SET) != 0 || fread(buf, 1, 2, fp) != 2) {
+    return false;
+  }
+
+  for (uint32_t n = u16(buf); n > 0; --n) {
+    if (fread(buf, 1, 12, fp) != 12) {
+      return false;
+    }
+
+    uint32_t tag   = u16(buf);
+    uint32_t type  = u16(buf + 2);
+    uint32_t value = type == 3 ? u16(buf + 8) : u32(buf + 8); // SHORT or LONG
+
+    if (tag == 256) {
+      info.width = value;
+    } else if (tag == 257) {
+      info.height = value;
+    }
+    if (info.width > 0 && info.height > 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+bool
+probe_image(ImageInfo& info, const std::string& filename)
+{
+  FILE* fp = open_file(filename);
+  if (!fp) {
+    return false;
+  }
+
+  unsigned char h[32];
+  size_t n = fread(h, 1, sizeof(h), fp);
+
+  info = ImageInfo();
+
+  if (n >= 3 && h[0] == 0xFF && h[1] == 0xD8 && h[2] == 0xFF) {
+    info.format = ImageFormat::JPEG;
+    if (fseek(fp, 2, SEEK_SET) != 0 || !_probe_jpeg(info, fp)) {
+      info.width = info.height = 0;
+    }
+  } else if (n >= 24 && memcmp(h, "\x89PNG\r\n\x1a\n", 8) == 0 && memcmp(h + 12, "IHDR", 4) == 0) {
+    info.format = ImageFormat::PNG;
+    info.width  = _be32(h + 16);
+    info.height = _be32(h + 20);
+  } else if (n >= 10 && (memcmp(h, "GIF87a", 6) == 0 || memcmp(h, "GIF89a", 6) == 0)) {
+    info.format = ImageFormat::GIF;
+    info.width  = _le16(h + 6);
+    info.height = _le16(h + 8);
+  } else if (n >= 26 && h[0] == 'B' && h[1] == 'M') {
+    info.format = ImageFormat::BMP;
+    if (_le32(h + 14) == 12) { // BITMAPCOREHEADER
+      info.width  = _le16(h + 18);
+      info.height = _le16(h + 20);
+    } else {
+      info.width  = static_cast<int32_t>(_le32(h + 18));
+      info.height = std::abs(static_cast<int32_t>(_le32(h + 22))); // negative for top-down
+    }
+  } else if (n >= 30 && memcmp(h, "RIFF", 4) == 0 && memcmp(h + 8, "WEBP", 4) == 0) {
+    info.format = ImageFormat::WEBP;
+    if (memcmp(h + 12, "VP8 ", 4) == 0 && h[23] == 0x9D && h[24] == 0x01 && h[25] == 0x2A) {
+      info.width  = _le16(h + 26) & 0x3FFF;
+      info.height = _le16(h + 28) & 0x3FFF;
+    } else if (memcmp(h + 12, "VP8L", 4) == 0 && h[20] == 0x2F) {
+      info.width  = 1 + (h[21] | ((h[22] & 0x3F) << 8));
+      info.height = 1 + ((h[22] >> 6) | (h[23] << 2) | ((h[24] & 0x0F) << 10));
+    } else if (memcmp(h + 12, "VP8X", 4) == 0) {
+      info.width  = 1 + (h[24] | (h[25] << 8) | (h[26] << 16));
+      info.height = 1 + (h[27] | (h[28] << 8) | (h[29] << 16));
+    }
+  } else if (n >= 8 && (memcmp(h, "II*\0", 4) == 0 || memcmp(h, "MM\0*", 4) == 0)) {
+    info.format = ImageFormat::TIFF;
+    if (!_probe_tiff(info, fp, h)) {
+      info.width = info.height = 0;
+    }
+  }
+
+  fclose(fp);
+
+  return (info.format != ImageFormat::UNKNOWN && info.width > 0 && info.height > 0);
+}
+
+
+cv::Mat
+read_image(const std::string& filename)
+{
+#ifdef IMTOOLS_HAVE_LIBJPEG
+  ImageInfo info;
+
+  if (probe_image(info, filename) && info.format == ImageFormat::JPEG
+      && static_cast<int64_t>(info.width) * info.height >= JPEG_PARALLEL_MIN_PIXELS)
+  {
+    cv::Mat img = read_jpeg(filename);
+    if (!img.empty()) {
+      return img;
+    }
+  }
+#endif
+
+  return decode_image(filename, 1);
+}
+
+
+cv::Mat
+decode_image(const std::string& filename, int flags)
+{
+  const unsigned char* data;
+  size_t size;
+
+  if (MemoryFile::find(filename, data, size)) {
+    if (size == 0) {
+      return cv::Mat();
+    }
+    // Decoded in place
+    return cv::imdecode(cv::Mat(1, static_cast<int>(size), CV_8UC1, const_cast<unsigned char*>(data)), flags);
+  }
+  if (!is_stdio(filename)) {
+    return cv::imread(filename, flags);
+  }
+
+  try {
+    const std::vector<unsigned char>& input = read_stdin();
+    if (input.empty()) {
+      return cv::Mat();
+    }
+    return cv::imdecode(cv::Mat(input), flags);
+  } catch (ErrorException& e) {
+    warning_log("%s", e.what());
+    return cv::Mat();
+  }
+}
+
+
+std::string
+get_file_ext(const std::string& filename)
+{
+  auto dot = filename.find_last_of('.');
+  auto slash = filename.find_last_of('/');
+
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+    return std::string();
+  }
+
+  std::string ext(filename, dot);
+  std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+  return ext;
+}
+
+
+void
+write_file(const std::string& filename, const void* data, size_t size)
+{
+  if (is_stdio(filename)) {
+    if (fwrite(data, 1, size, stdout) != size || fflush(stdout) != 0) {
+      throw FileWriteErrorException("stdout");
+    }
+    return;
+  }
+
+  FILE* fp = fopen(filename.c_str(), "wb");
+  if (!fp) {
+    throw FileWriteErrorException(filename);
+  }
+
+  bool failed = fwrite(data, 1, size, fp) != size;
+  if (fclose(fp) != 0 || failed) {
+    throw FileWriteErrorException(filename);
+  }
+}
+
+
 void
 print_version()
 {
@@ -88,18 +558,188 @@ diff(cv::Mat& result, const cv::Mat& a, const cv::Mat& b)
   // We could do fancy things with `result` after cv::absdiff() such as
   // "magically" adjusting contrast and brightness. However, cv::absdiff()
   // works just fine with current tests.
-  cv::absdiff(a, b, result);
-
-  // Convert to grayscale
-  debug_log("diff: cvtColor() to grayscale, channels = %d", result.channels());
-  if (result.channels() > 1) {
-    cv::cvtColor(result, result, CV_BGR2GRAY);
+  if (a.channels() == 1) {
+    cv::absdiff(a, b, result);
+  } else {
+    // Convert to grayscale band by band. So the full-color difference never
+    // resides in memory entirely.
+    debug_log("diff: cvtColor() to grayscale, channels = %d", a.channels());
+    cv::Mat band;
+    result.create(a.rows, a.cols, CV_MAKETYPE(a.depth(), 1));
+    for (int y = 0; y < a.rows; y += DEFAULT_BAND_ROWS) {
+      int y_end = std::min(y + DEFAULT_BAND_ROWS, a.rows);
+      cv::Mat result_band(result.rowRange(y, y_end));
+
+      cv::absdiff(a.rowRange(y, y_end), b.rowRange(y, y_end), band);
+      cv::cvtColor(band, result_band, CV_BGR2GRAY);
+    }
   }
 
   debug_timer_end(t1, t2, imtools::diff);
 }
 
 
+/*! Groups adjacent (8-connected) flagged tiles into rectangles.
+ * \param regions Output vector.
+ * \param flags Grid of tile flags, non-zero for changed tiles.
+ * \param tile_size Size of a tile in pixels.
+ * \param bounds Image rectangle.
+ * \param margin Number of pixels to add on each side of a region.
+ */
+static void
+_group_tiles(BoundBoxVector& regions, const std::vector<unsigned char>& flags, int grid_cols,
+    int tile_size, const cv::Rect& bounds, int margin)
+{
+  const int grid_rows = static_cast<int>(flags.size()) / grid_cols;
+  std::vector<unsigned char> visited(flags.size(), 0);
+  std::vector<int> stack;
+
+  for (size_t i = 0; i < flags.size(); ++i) {
+    if (!flags[i] || visited[i]) {
+      continue;
+    }
+
+    cv::Rect region;
+    bool first = true;
+
+    visited[i] = 1;
+    stack.push_back(i);
+    while (!stack.empty()) {
+      int t = stack.back();
+      stack.pop_back();
+
+      int tx = t % grid_cols;
+      int ty = t / grid_cols;
+      cv::Rect tile(tx * tile_size, ty * tile_size, tile_size, tile_size);
+      if (first) {
+        region = tile;
+        first = false;
+      } else {
+        region |= tile;
+      }
+
+      for (int ny = std::max(ty - 1, 0); ny <= std::min(ty + 1, grid_rows - 1); ++ny) {
+        for (int nx = std::max(tx - 1, 0); nx <= std::min(tx + 1, grid_cols - 1); ++nx) {
+          int n = ny * grid_cols + nx;
+          if (flags[n] && !visited[n]) {
+            visited[n] = 1;
+            stack.push_back(n);
+          }
+        }
+      }
+    }
+
+    region.x      -= margin;
+    region.y      -= margin;
+    region.width  += 2 * margin;
+    region.height += 2 * margin;
+    regions.push_back(region & bounds);
+  }
+
+  // Margins may cause overlapping regions. Merge them.
+  for (bool merged = true; merged;) {
+    merged = false;
+    for (size_t i = 0; i < regions.size() && !merged; ++i) {
+      for (size_t j = i + 1; j < regions.size(); ++j) {
+        if ((regions[i] & regions[j]).area() > 0) {
+          regions[i] |= regions[j];
+          regions.erase(regions.begin() + j);
+          merged = true;
+          break;
+        }
+      }
+    }
+  }
+}
+
+
+/*! \returns whether no channel values of `a` and `b` differ by more than `threshold`.
+ * Identical rows are skipped by `memcmp()`, which stops at the first difference.
+ * The max. norm is computed for the rest of the rows only.
+ */
+static bool
+_tile_matches(const cv::Mat& a, const cv::Mat& b, int threshold)
+{
+  const size_t row_size = a.cols * a.elemSize();
+
+  for (int y = 0; y < a.rows; ++y) {
+    if (memcmp(a.ptr(y), b.ptr(y), row_size) != 0) {
+      return threshold > 0
+        && cv::norm(a.rowRange(y, a.rows), b.rowRange(y, b.rows), cv::NORM_INF) <= threshold;
+    }
+  }
+  return true;
+}
+
+
+void
+diff(cv::Mat& result, BoundBoxVector& regions, const cv::Mat& a, const cv::Mat& b,
+    int threshold, int scale, int tile_size)
+{
+  debug_timer_init(t1, t2);
+  debug_timer_start(t1);
+
+  assert(a.size() == b.size() && a.type() == b.type());
+  assert(scale > 0 && tile_size > 0);
+
+  if (scale > tile_size) {
+    scale = tile_size;
+  }
+
+  // Coarse difference
+  cv::Mat coarse_a, coarse_b;
+  cv::Size coarse_size((a.cols + scale - 1) / scale, (a.rows + scale - 1) / scale);
+  cv::resize(a, coarse_a, coarse_size, 0, 0, cv::INTER_AREA);
+  cv::resize(b, coarse_b, coarse_size, 0, 0, cv::INTER_AREA);
+
+  const int grid_cols = (a.cols + tile_size - 1) / tile_size;
+  const int grid_rows = (a.rows + tile_size - 1) / tile_size;
+  const cv::Rect bounds(0, 0, a.cols, a.rows);
+  const cv::Rect coarse_bounds(0, 0, coarse_size.width, coarse_size.height);
+  std::vector<unsigned char> flags(grid_cols * grid_rows, 0);
+  int n_changed = 0;
+
+  result.create(a.rows, a.cols, CV_MAKETYPE(a.depth(), 1));
+  result = cv::Scalar(0);
+
+  cv::Mat band;
+  for (int ty = 0; ty < grid_rows; ++ty) {
+    for (int tx = 0; tx < grid_cols; ++tx) {
+      cv::Rect tile = cv::Rect(tx * tile_size, ty * tile_size, tile_size, tile_size) & bounds;
+      cv::Rect coarse_tile = cv::Rect(tile.x / scale, tile.y / scale,
+          (tile.width + scale - 1) / scale, (tile.height + scale - 1) / scale) & coarse_bounds;
+
+      // Channel differences within `threshold` never survive the noise
+      // suppression in `bound_boxes()`, since a grayscale value doesn't exceed
+      // the maximum of the channel values. An area average of the difference
+      // doesn't exceed its maximum either. So a coarse difference above
+      // `threshold` means a change, and the rest of the tiles need the exact check.
+      if (cv::norm(coarse_a(coarse_tile), coarse_b(coarse_tile), cv::NORM_INF) <= threshold
+          && _tile_matches(a(tile), b(tile), threshold))
+      {
+        continue;
+      }
+
+      flags[ty * grid_cols + tx] = 1;
+      ++n_changed;
+
+      cv::Mat result_tile(result, tile);
+      if (a.channels() == 1) {
+        cv::absdiff(a(tile), b(tile), result_tile);
+      } else {
+        cv::absdiff(a(tile), b(tile), band);
+        cv::cvtColor(band, result_tile, CV_BGR2GRAY);
+      }
+    }
+  }
+  debug_log("diff: %d of %d tiles changed", n_changed, grid_cols * grid_rows);
+
+  // Margins are required for the morphological operations in `bound_boxes()`
+  _group_tiles(regions, flags, grid_cols, tile_size, bounds, BOUND_BOXES_HALO + SMALL_BOXES_HALO);
+
+  debug_timer_end(t1, t2, imtools::diff);
+}
+
 void
 blur(cv::Mat& target, const Blur type)
 {
@@ -177,6 +817,77 @@ match_template(cv::Point& match_loc, const cv::Mat& img, const cv::Mat& tpl)
 }
 
 
+void
+match_template_tiled(cv::Point& match_loc, const cv::Mat& img, const cv::Mat& tpl, int tile_size)
+{
+  debug_timer_init(t1, t2);
+  debug_timer_start(t1);
+
+  assert(tile_size > 0);
+
+  const int result_cols = img.cols - tpl.cols + 1;
+  const int result_rows = img.rows - tpl.rows + 1;
+  if (result_cols <= 0 || result_rows <= 0) {
+    throw ErrorException("Template %dx%d doesn't fit image %dx%d",
+        tpl.cols, tpl.rows, img.cols, img.rows);
+  }
+
+  const int grid_cols = (result_cols + tile_size - 1) / tile_size;
+  const int grid_rows = (result_rows + tile_size - 1) / tile_size;
+  const int n_tiles   = grid_cols * grid_rows;
+  std::vector<double> min_vals(n_tiles);
+  std::vector<cv::Point> min_locs(n_tiles);
+  bool failed = false;
+
+#ifdef IMTOOLS_THREADS
+  _Pragma("omp parallel for schedule(dynamic, 1)")
+#endif
+  for (int t = 0; t < n_tiles; ++t) {
+    try {
+      int x = (t % grid_cols) * tile_size;
+      int y = (t / grid_cols) * tile_size;
+      int w = std::min(tile_size, result_cols - x);
+      int h = std::min(tile_size, result_rows - y);
+
+      // Image areas of adjacent tiles overlap by the template size minus one
+      cv::Mat area(img, cv::Rect(x, y, w + tpl.cols - 1, h + tpl.rows - 1));
+      cv::Mat result;
+      cv::matchTemplate(area, tpl, result, CV_TM_SQDIFF);
+
+      cv::minMaxLoc(result, &min_vals[t], NULL, &min_locs[t], NULL);
+      min_locs[t].x += x;
+      min_locs[t].y += y;
+    } catch (cv::Exception& e) {
+      error_log("match_template_tiled: %s", e.what());
+#ifdef IMTOOLS_THREADS
+      _Pragma("omp atomic write")
+#endif
+      failed = true;
+    }
+  }
+
+  if (failed) {
+    throw ErrorException("Failed to match template %dx%d", tpl.cols, tpl.rows);
+  }
+
+  // For SQDIFF the best matches are lower values. Prefer the first one in raster
+  // order, as `cv::minMaxLoc()` does.
+  int best = 0;
+  for (int t = 1; t < n_tiles; ++t) {
+    const cv::Point& a = min_locs[t];
+    const cv::Point& b = min_locs[best];
+    if (min_vals[t] < min_vals[best]
+        || (min_vals[t] == min_vals[best] && (a.y < b.y || (a.y == b.y && a.x < b.x))))
+    {
+      best = t;
+    }
+  }
+  match_loc = min_locs[best];
+
+  debug_timer_end(t1, t2, imtools::match_template_tiled);
+}
+
+
 void
 patch(cv::Mat& out_mat, const cv::Mat& tpl_mat, const cv::Rect& roi)
 {
@@ -210,6 +921,62 @@ patch(cv::Mat& out_mat, const cv::Mat& tpl_mat, const cv::Rect& roi)
 }
 
 
+/// Structuring element for the morphological closing in `_merge_small_boxes()`
+static inline cv::Mat
+_get_small_boxes_kernel()
+{
+  int morph_size = 4;
+  return cv::getStructuringElement(cv::MORPH_RECT,
+      cv::Size(2 * morph_size + 1, 2 * morph_size + 1),
+      cv::Point(morph_size, morph_size));
+}
+
+
+/*! Suppresses noise on a grayscale difference image.
+ * I.e. applies threshold followed by morphological closing (dilate, then erode).
+ */
+static void
+_suppress_noise(cv::Mat& mask, int min_threshold, int max_threshold)
+{
+  debug_log("bound_boxes: threshold(%d, %d)", min_threshold, max_threshold);
+  cv::threshold(mask, mask, min_threshold, max_threshold, cv::THRESH_BINARY);
+#if 0
+  cv::Canny(mask, mask, min_threshold, min_threshold * 3, 3);
+#endif
+
+  int morph_size = 1;
+  cv::Mat kern = cv::getStructuringElement(cv::MORPH_RECT, cv::Size(2 * morph_size + 1, 2 * morph_size + 1), cv::Point(morph_size, morph_size));
+  cv::morphologyEx(mask, mask, cv::MORPH_CLOSE, kern, cv::Point(-1, -1), 1);
+}
+
+
+/*! Collects rectangles bounding external contours on `mask`.
+ * \param boxes Output vector.
+ * \param mask Binary image. Note, the function modifies it.
+ * \param offset Offset of the boxes relative to `mask`.
+ */
+static void
+_contour_boxes(BoundBoxVector& boxes, cv::Mat& mask, const cv::Point& offset = cv::Point())
+{
+  std::vector<std::vector<cv::Point> > contours;
+  std::vector<cv::Vec4i> hierarchy;
+
+  cv::findContours(mask, contours, hierarchy, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_SIMPLE, offset);
+
+  // Approximate contours to polygons, get bounding boxes
+  std::vector<std::vector<cv::Point> > contours_poly(contours.size());
+  boxes.reserve(boxes.size() + contours.size());
+  for (size_t i = 0; i < contours.size(); ++i) {
+    cv::approxPolyDP(cv::Mat(contours[i]), contours_poly[i], 1, true);
+
+    auto m = cv::Mat(contours_poly[i]);
+    auto rect = cv::boundingRect(m);
+
+    boxes.push_back(rect);
+  }
+}
+
+
 /*! Merge small rectangles into larger rectangles.
  * \param result Output vector. Must be empty on input.
  * \param boxes Input vector of rectangles.
@@ -238,27 +1005,10 @@ _merge_small_boxes(BoundBoxVector& result, BoundBoxVector& boxes, const cv::Mat&
 
   // Apply morphological closing operation, i.e. erode(dilate(src, kern), kern).
   // With this operation the small boxes should be merged.
-  int morph_size = 4;
-  cv::Mat kern = cv::getStructuringElement(cv::MORPH_RECT,
-      cv::Size(2 * morph_size + 1, 2 * morph_size + 1),
-      cv::Point(morph_size, morph_size));
-  cv::morphologyEx(tmp_mask, tmp_mask, cv::MORPH_CLOSE, kern, cv::Point(-1, -1), 2);
+  cv::morphologyEx(tmp_mask, tmp_mask, cv::MORPH_CLOSE, _get_small_boxes_kernel(), cv::Point(-1, -1), 2);
 
-  // Find new contours the the merged areas
-  std::vector<std::vector<cv::Point> > contours;
-  std::vector<cv::Vec4i> hierarchy;
-  cv::findContours(tmp_mask, contours, hierarchy, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_SIMPLE);
-
-  // Collect bounding boxes covering larger areas.
-  // Approximate contours to polygons, get bounding rects
-  std::vector<std::vector<cv::Point> > contours_poly(contours.size());
-  result.reserve(result.size() + contours.size());
-  for (size_t i = 0; i < contours.size(); ++i) {
-    cv::approxPolyDP(cv::Mat(contours[i]), contours_poly[i], 1, true);
-    auto m = cv::Mat(contours_poly[i]);
-    auto rect = cv::boundingRect(m);
-    result.push_back(rect);
-  }
+  // Collect bounding boxes covering the merged areas.
+  _contour_boxes(result, tmp_mask);
 
   result.shrink_to_fit();
 }
@@ -348,8 +1098,6 @@ bound_boxes(BoundBoxVector& result, const cv::Mat& in_mask, int min_threshold, i
 
   BoundBoxVector boxes;
   cv::Mat mask;
-  std::vector<std::vector<cv::Point> > contours;
-  std::vector<cv::Vec4i> hierarchy;
 
   assert(min_threshold >= 0 && min_threshold <= max_threshold);
 
@@ -361,38 +1109,268 @@ bound_boxes(BoundBoxVector& result, const cv::Mat& in_mask, int min_threshold, i
     cv::cvtColor(in_mask, mask, CV_BGR2GRAY);
   }
 
-  // Suppress noise
-  debug_log("bound_boxes: threshold(%d, %d)", min_threshold, max_threshold);
-  cv::threshold(mask, mask, min_threshold, max_threshold, cv::THRESH_BINARY);
-#if 0
-  cv::Canny(mask, mask, min_threshold, min_threshold * 3, 3);
-#endif
-
-  // Apply morphological closing operation, i.e. dilate, then erode (more noise suppression).
-  int morph_size = 1;
-  cv::Mat kern = cv::getStructuringElement(cv::MORPH_RECT, cv::Size(2 * morph_size + 1, 2 * morph_size + 1), cv::Point(morph_size, morph_size));
-  cv::morphologyEx(mask, mask, cv::MORPH_CLOSE, kern, cv::Point(-1, -1), 1);
+  // Suppress noise: threshold, then apply morphological closing operation
+  _suppress_noise(mask, min_threshold, max_threshold);
 
   // Detect contours of modified areas
-  cv::findContours(mask, contours, hierarchy, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_SIMPLE);
+  _contour_boxes(boxes, mask);
+  debug_log("bound_boxes number: %ld", boxes.size());
 
-  // Approximate contours to polygons, get bounding boxes
-  std::vector<std::vector<cv::Point> > contours_poly(contours.size());
+  _merge_small_boxes(result, boxes, mask);
+  debug_log("bound_boxes number after merging small boxes: %ld", result.size());
+
+  debug_timer_end(t1, t2, imtools::bound_boxes);
+}
+
+
+void
+bound_boxes(BoundBoxVector& result, const cv::Mat& mask, const BoundBoxVector& regions,
+    int min_threshold, int max_threshold)
+{
+  BoundBoxVector boxes;
+
+  for (auto& region : regions) {
+    boxes.clear();
+    bound_boxes(boxes, cv::Mat(mask, region), min_threshold, max_threshold);
+
+    result.reserve(result.size() + boxes.size());
+    for (auto& box : boxes) {
+      result.push_back(box + region.tl());
+    }
+  }
+}
+
+/*! Collects boxes found in consecutive row bands. Boxes of the components
+ * which are 8-connected across band edges are merged back by means of union-find.
+ */
+class BandBoxStitcher
+{
+  public:
+    /*! Adds boxes found within a band.
+     * Bands must be added in top-to-bottom order.
+     * \param top Indices of the `boxes` covering the pixels of the first row of the band
+     * (-1 - no box), one per column
+     * \param bottom Same for the last row of the band
+     */
+    void add(const BoundBoxVector& boxes, const std::vector<int>& top, const std::vector<int>& bottom)
+    {
+      const int base = static_cast<int>(m_boxes.size());
+
+      for (auto& box : boxes) {
+        m_parent.push_back(static_cast<int>(m_boxes.size()));
+        m_boxes.push_back(box);
+      }
+
+      // Join the components whose pixels touch across the band edge
+      const int cols = static_cast<int>(m_bottom.size());
+      for (int x = 0; x < cols; ++x) {
+        if (top[x] < 0) {
+          continue;
+        }
+        for (int px = std::max(x - 1, 0); px <= std::min(x + 1, cols - 1); ++px) {
+          if (m_bottom[px] >= 0) {
+            m_parent[_find(m_bottom[px])] = _find(base + top[x]);
+          }
+        }
+      }
+
+      m_bottom.resize(bottom.size());
+      for (size_t x = 0; x < bottom.size(); ++x) {
+        m_bottom[x] = bottom[x] < 0 ? -1 : base + bottom[x];
+      }
+    }
+
+    /// Appends stitched boxes to `result`
+    void get(BoundBoxVector& result)
+    {
+      std::vector<int> index(m_boxes.size(), -1);
+
+      result.reserve(result.size() + m_boxes.size());
+      for (size_t i = 0; i < m_boxes.size(); ++i) {
+        int root = _find(i);
+        if (index[root] < 0) {
+          index[root] = static_cast<int>(result.size());
+          result.push_back(m_boxes[i]);
+        } else {
+          result[index[root]] |= m_boxes[i];
+        }
+      }
+    }
+
+  private:
+    int _find(int i)
+    {
+      while (m_parent[i] != i) {
+        i = m_parent[i] = m_parent[m_parent[i]];
+      }
+      return i;
+    }
+
+  private:
+    /// Boxes as they have been found within the bands
+    BoundBoxVector m_boxes;
+    /// Union-find forest over `m_boxes`
+    std::vector<int> m_parent;
+    /// Indices of the boxes covering the pixels of the last row of the last band
+    std::vector<int> m_bottom;
+};
+
+
+/*! Computes `diff()` for rows [y0, y1) of the images and suppresses noise
+ * the same way as `bound_boxes()` does. */
+static inline void
+_band_mask(cv::Mat& mask, const cv::Mat& old_img, const cv::Mat& new_img,
+    int y0, int y1, int min_threshold, int max_threshold)
+{
+  diff(mask, old_img.rowRange(y0, y1), new_img.rowRange(y0, y1));
+  _suppress_noise(mask, min_threshold, max_threshold);
+}
+
+
+/*! Collects boxes bounding contours on `band` which starts at row `y` of the image.
+ * The band is framed with zero pixels, since `cv::findContours()` ignores the
+ * 1-pixel border of the image, whereas band edges are usually not the image edges.
+ * \param top Output indices of the boxes covering the pixels of the first row (see BandBoxStitcher)
+ * \param bottom Same for the last row
+ */
+static void
+_band_contour_boxes(BoundBoxVector& boxes, std::vector<int>& top, std::vector<int>& bottom,
+    const cv::Mat& band, int y)
+{
+  cv::Mat framed;
+  cv::copyMakeBorder(band, framed, 1, 1, 1, 1, cv::BORDER_CONSTANT, cv::Scalar(0));
+
+  std::vector<std::vector<cv::Point> > contours;
+  std::vector<cv::Vec4i> hierarchy;
+  cv::findContours(framed, contours, hierarchy, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_SIMPLE, cv::Point(-1, 0));
+
+  top.assign(band.cols, -1);
+  bottom.assign(band.cols, -1);
+  // Edge rows labelled by filling the contours, offset so that band rows 0 and
+  // `band.rows - 1` fall onto row 0 of the label images
+  cv::Mat top_labels(1, band.cols, CV_32S, top.data());
+  cv::Mat bottom_labels(1, band.cols, CV_32S, bottom.data());
+
+  std::vector<cv::Point> poly;
+  boxes.clear();
   boxes.reserve(contours.size());
   for (size_t i = 0; i < contours.size(); ++i) {
-    cv::approxPolyDP(cv::Mat(contours[i]), contours_poly[i], 1, true);
-
-    auto m = cv::Mat(contours_poly[i]);
-    auto rect = cv::boundingRect(m);
+    const int index = static_cast<int>(i);
 
+    // The same box as _contour_boxes() would make
+    cv::approxPolyDP(cv::Mat(contours[i]), poly, 1, true);
+    cv::Rect rect = cv::boundingRect(cv::Mat(poly));
+    rect.y += y - 1;
     boxes.push_back(rect);
+
+    cv::Rect extent = cv::boundingRect(cv::Mat(contours[i]));
+    if (extent.y <= 1) {
+      cv::drawContours(top_labels, contours, index, cv::Scalar(index), -1 /* filled */, 8,
+          std::vector<cv::Vec4i>(), 0, cv::Point(0, -1));
+    }
+    if (extent.y + extent.height > band.rows) {
+      cv::drawContours(bottom_labels, contours, index, cv::Scalar(index), -1 /* filled */, 8,
+          std::vector<cv::Vec4i>(), 0, cv::Point(0, -band.rows));
+    }
   }
-  debug_log("bound_boxes number: %ld", boxes.size());
 
-  _merge_small_boxes(result, boxes, mask);
-  debug_log("bound_boxes number after merging small boxes: %ld", result.size());
+  // The filled contours also cover their holes
+  const unsigned char* top_row    = band.ptr(0);
+  const unsigned char* bottom_row = band.ptr(band.rows - 1);
+  for (int x = 0; x < band.cols; ++x) {
+    if (!top_row[x]) {
+      top[x] = -1;
+    }
+    if (!bottom_row[x]) {
+      bottom[x] = -1;
+    }
+  }
+}
 
-  debug_timer_end(t1, t2, imtools::bound_boxes);
+
+void
+bound_boxes_tiled(BoundBoxVector& result, const cv::Mat& old_img, const cv::Mat& new_img,
+    int band_rows, int min_threshold, int max_threshold)
+{
+  debug_timer_init(t1, t2);
+  debug_timer_start(t1);
+
+  assert(min_threshold >= 0 && min_threshold <= max_threshold);
+  assert(old_img.size() == new_img.size());
+
+  const int rows = old_img.rows;
+  cv::Mat mask;
+  BoundBoxVector boxes;
+  BoundBoxVector band_boxes;
+  std::vector<int> top;
+  std::vector<int> bottom;
+
+  if (band_rows <= 0) {
+    band_rows = DEFAULT_BAND_ROWS;
+  }
+
+  // Pass 1: detect contours of modified areas band by band
+  {
+    BandBoxStitcher stitcher;
+
+    for (int y0 = 0; y0 < rows; y0 += band_rows) {
+      int y1     = std::min(y0 + band_rows, rows);
+      int ext_y0 = std::max(y0 - BOUND_BOXES_HALO, 0);
+      int ext_y1 = std::min(y1 + BOUND_BOXES_HALO, rows);
+
+      _band_mask(mask, old_img, new_img, ext_y0, ext_y1, min_threshold, max_threshold);
+
+      _band_contour_boxes(band_boxes, top, bottom, mask.rowRange(y0 - ext_y0, y1 - ext_y0), y0);
+      stitcher.add(band_boxes, top, bottom);
+    }
+
+    stitcher.get(boxes);
+  }
+  debug_log("bound_boxes_tiled number: %ld", boxes.size());
+
+  // Pass 2: merge small boxes band by band (see _merge_small_boxes())
+  BoundBoxVector big_boxes;
+  for (auto& box : boxes) {
+    if (box.area() >= MIN_BOUND_BOX_AREA) {
+      result.push_back(box);
+      big_boxes.push_back(box);
+    }
+  }
+
+  {
+    BandBoxStitcher stitcher;
+    const cv::Mat kern = _get_small_boxes_kernel();
+    const int halo = BOUND_BOXES_HALO + SMALL_BOXES_HALO;
+
+    for (int y0 = 0; y0 < rows; y0 += band_rows) {
+      int y1     = std::min(y0 + band_rows, rows);
+      int ext_y0 = std::max(y0 - halo, 0);
+      int ext_y1 = std::min(y1 + halo, rows);
+      cv::Rect ext_rect(0, ext_y0, old_img.cols, ext_y1 - ext_y0);
+
+      _band_mask(mask, old_img, new_img, ext_y0, ext_y1, min_threshold, max_threshold);
+
+      // Erase the areas of big enough boxes
+      for (auto& box : big_boxes) {
+        cv::Rect r = box & ext_rect;
+        if (r.area() > 0) {
+          r.y -= ext_y0;
+          cv::Mat m(mask, r);
+          m = cv::Scalar(0);
+        }
+      }
+
+      cv::morphologyEx(mask, mask, cv::MORPH_CLOSE, kern, cv::Point(-1, -1), 2);
+
+      _band_contour_boxes(band_boxes, top, bottom, mask.rowRange(y0 - ext_y0, y1 - ext_y0), y0);
+      stitcher.add(band_boxes, top, bottom);
+    }
+
+    stitcher.get(result);
+  }
+  debug_log("bound_boxes_tiled number after merging small boxes: %ld", result.size());
+
+  debug_timer_end(t1, t2, imtools::bound_boxes_tiled);
 }
 
 
@@ -403,36 +1381,66 @@ get_avg_MSSIM(const cv::Mat& i1, const cv::Mat& i2)
   return (mssim.val[0] + mssim.val[1] + mssim.val[2]) / 3;
 }
 
+
+double
+get_avg_MSSIM(const MSSIMStats& s1, const cv::Mat& i2)
+{
+  auto mssim = get_MSSIM(s1, i2);
+  return (mssim.val[0] + mssim.val[1] + mssim.val[2]) / 3;
+}
+
+
+void
+get_MSSIM_stats(MSSIMStats& stats, const cv::Mat& i1)
+{
+  i1.convertTo(stats.I, CV_32F); // cannot calculate on one byte large values
+
+  cv::Mat I1_2 = stats.I.mul(stats.I); // I1^2
+
+  cv::GaussianBlur(stats.I, stats.mu, cv::Size(11, 11), 1.5);
+  stats.mu_2 = stats.mu.mul(stats.mu);
+
+  cv::GaussianBlur(I1_2, stats.sigma_2, cv::Size(11, 11), 1.5);
+  stats.sigma_2 -= stats.mu_2;
+}
+
+
+cv::Scalar
+get_MSSIM(const cv::Mat& i1, const cv::Mat& i2)
+{
+  MSSIMStats s1;
+  get_MSSIM_stats(s1, i1);
+  return get_MSSIM(s1, i2);
+}
+
+
 /// Computes structural similarity coefficient.
 /// The code is borrowed from
 /// http://docs.opencv.org/doc/tutorials/highgui/video-input-psnr-ssim/video-input-psnr-ssim.html#image-similarity-psnr-and-ssim
 cv::Scalar
-get_MSSIM(const cv::Mat& i1, const cv::Mat& i2)
+get_MSSIM(const MSSIMStats& s1, const cv::Mat& i2)
 {
   const double C1 = 6.5025, C2 = 58.5225;
   int d           = CV_32F;
 
-  cv::Mat I1, I2;
-  i1.convertTo(I1, d); // cannot calculate on one byte large values
+  const cv::Mat& I1       = s1.I;
+  const cv::Mat& mu1      = s1.mu;
+  const cv::Mat& mu1_2    = s1.mu_2;
+  const cv::Mat& sigma1_2 = s1.sigma_2;
+
+  cv::Mat I2;
   i2.convertTo(I2, d);
 
   cv::Mat I2_2  = I2.mul(I2); // I2^2
-  cv::Mat I1_2  = I1.mul(I1); // I1^2
   cv::Mat I1_I2 = I1.mul(I2); // I1 * I2
 
-
-  cv::Mat mu1, mu2;
-  cv::GaussianBlur(I1, mu1, cv::Size(11, 11), 1.5);
+  cv::Mat mu2;
   cv::GaussianBlur(I2, mu2, cv::Size(11, 11), 1.5);
 
-  cv::Mat mu1_2   = mu1.mul(mu1);
   cv::Mat mu2_2   = mu2.mul(mu2);
   cv::Mat mu1_mu2 = mu1.mul(mu2);
 
-  cv::Mat sigma1_2, sigma2_2, sigma12;
-
-  cv::GaussianBlur(I1_2, sigma1_2, cv::Size(11, 11), 1.5);
-  sigma1_2 -= mu1_2;
+  cv::Mat sigma2_2, sigma12;
 
   cv::GaussianBlur(I2_2, sigma2_2, cv::Size(11, 11), 1.5);
   sigma2_2 -= mu2_2;
@@ -20,6 +20,9 @@
 #ifndef IMTOOLS_HXX
 #define IMTOOLS_HXX
 
+#include <cstdint>
+#include <cstdio>
+#include <memory>
 #include <opencv2/core/core.hpp>
 
 #include "template.cxx"
@@ -58,6 +61,15 @@ namespace imtools {
 /// Bounding boxes having smaller area will be merged together by means of morphological operations.
 const int MIN_BOUND_BOX_AREA = 2800;
 
+/// Default number of rows in a band processed by `bound_boxes_tiled()`
+const int DEFAULT_BAND_ROWS = 512;
+
+/// Default size of a tile (in pixels) for the multi-resolution `diff()`
+const int DEFAULT_DIFF_TILE_SIZE = 256;
+
+/// Default number of template positions along each side of a tile in `match_template_tiled()`
+const int DEFAULT_MATCH_TILE_SIZE = 1024;
+
 
 /// Verbose mode for CLI output:
 /// - 0 - off
@@ -70,6 +82,91 @@ void print_version();
 
 bool file_exists(const char* filename);
 bool file_exists(const std::string& filename);
+
+/// Filename referring to stdin for the sources, and to stdout for the outputs
+const char* const STDIO_FILENAME = "-";
+
+/// Makes `STDIO_FILENAME` refer to stdin/stdout rather than to a file named "-".
+/// Off by default, so the server never touches its standard streams.
+void set_stdio_enabled(bool enabled) noexcept;
+
+/// \returns whether `filename` refers to stdin or stdout
+bool is_stdio(const std::string& filename) noexcept;
+
+/*! Reads entire stdin on the first call. The subsequent calls return the same data,
+ * so the source can be read multiple times (e.g. probed, then decoded).
+ * \throws ErrorException */
+const std::vector<unsigned char>& read_stdin();
+
+/*! Data of a file kept in memory (e.g. an uploaded image), which is read by name
+ * with `open_file()`, `probe_image()`, `read_image()` etc. while the object exists.
+ * The data is not copied, so it should outlive the object. */
+class MemoryFile
+{
+  public:
+    /*! Registers `size` bytes of `data` under a name unique within the process.
+     * The name contains a random token, so it can't be guessed by the other users
+     * of the process (e.g. the other clients of imserver). */
+    MemoryFile(const void* data, size_t size);
+    ~MemoryFile();
+
+    MemoryFile() = delete;
+    MemoryFile(const MemoryFile&) = delete;
+    MemoryFile& operator=(const MemoryFile&) = delete;
+
+    inline const std::string& getName() const noexcept { return m_name; }
+
+    /// Finds the data registered under `name`. \returns false, if not found
+    static bool find(const std::string& name, const unsigned char*& data, size_t& size) noexcept;
+
+  private:
+    std::string m_name;
+};
+typedef std::unique_ptr<MemoryFile> MemoryFilePtr;
+
+/// Prefix of the names of `MemoryFile` objects
+const char* const MEMORY_FILE_PREFIX = "mem://";
+
+/*! Opens `filename` for reading like `fopen(filename, "rb")`. For stdin and
+ * `MemoryFile` names, the stream reads the data from memory, so it is seekable.
+ * \returns nullptr on error */
+FILE* open_file(const std::string& filename) noexcept;
+
+/// Initial value of the FNV-1a 64-bit hash
+const uint64_t FNV1A_64_INIT = 0xcbf29ce484222325ULL;
+
+/// Updates FNV-1a 64-bit `hash` with `size` bytes of `data`
+uint64_t hash_bytes(const void* data, size_t size, uint64_t hash = FNV1A_64_INIT);
+
+/// Updates FNV-1a 64-bit `hash` with contents of file `filename`
+/// \throws ErrorException if the file can't be read
+uint64_t hash_file(const std::string& filename, uint64_t hash = FNV1A_64_INIT);
+
+/// \returns whether files `a` and `b` have the same contents
+/// \throws ErrorException if a file can't be read
+bool files_equal(const std::string& a, const std::string& b);
+
+/// Reads format and dimensions of an image from its header without decoding it.
+/// \returns false if the file can't be read, or its format is not recognized,
+/// or the header is invalid
+bool probe_image(ImageInfo& info, const std::string& filename);
+
+/*! Reads 8-bit 3-channel image from file `filename` like `cv::imread(filename, 1)`.
+ * Large JPEG files having restart markers are decoded on multiple threads.
+ * \returns empty matrix, if the file can't be read or decoded */
+cv::Mat read_image(const std::string& filename);
+
+/*! Reads image from file `filename` like `cv::imread(filename, flags)`, or decodes
+ * the data of stdin or a `MemoryFile` in place with `cv::imdecode()`.
+ * \returns empty matrix, if the file can't be read or decoded */
+cv::Mat decode_image(const std::string& filename, int flags);
+
+/// \returns lowercase extension of `filename` including the dot, or empty string
+std::string get_file_ext(const std::string& filename);
+
+/// Writes `size` bytes of `data` to file `filename` (or stdout, see `is_stdio()`)
+/// \throws FileWriteErrorException
+void write_file(const std::string& filename, const void* data, size_t size);
 const char* get_features();
 
 /// Computes difference between two image matrices.
@@ -80,8 +177,23 @@ const char* get_features();
 /// \param result Result of the comparison; 1-channel binary image where differences have high values.
 /// \param a First input matrix
 /// \param b Second input matrix
+///
+/// Multi-channel input is converted to grayscale band by band, so only a band
+/// of the full-color difference is kept in memory.
 void diff(cv::Mat& result , const cv::Mat& old_img, const cv::Mat& new_img);
 
+/// Multi-resolution version of `diff()`.
+///
+/// Computes the difference on the images downscaled by `scale` first. Tiles of
+/// `tile_size` pixels with a coarse difference above `threshold` are changed.
+/// The rest are compared at full resolution row by row, and skipped (left zero
+/// in `result`), if no channel differs by more than `threshold`. The full
+/// resolution difference is computed within the changed tiles only.
+/// \param regions Output vector of rectangles covering groups of adjacent
+/// changed tiles (can be passed to `bound_boxes()`).
+void diff(cv::Mat& result, BoundBoxVector& regions, const cv::Mat& old_img, const cv::Mat& new_img,
+    int threshold, int scale, int tile_size = DEFAULT_DIFF_TILE_SIZE);
+
 /// Reduces noise by means of blurring the `target` image.
 void blur(cv::Mat& target, const Blur type);
 
@@ -93,6 +205,21 @@ void threshold(cv::Mat& target, const int threshold = THRESHOLD_MIN,
 
 void match_template(cv::Point& match_loc, const cv::Mat& img, const cv::Mat& tpl);
 
+/// Tiled version of `match_template()`.
+///
+/// The positions of the template are split into tiles of `tile_size`x`tile_size`.
+/// Each tile is searched within the overlapping area of the image (in parallel),
+/// then the results are reduced to the global best match. So the result map
+/// takes at most `tile_size`^2 floats per thread regardless of the image size.
+///
+/// Unlike `match_template()`, the raw SQDIFF values are compared, since the
+/// global min-max normalization needs the entire map. The normalization may
+/// round near-ties to equal values, which are then resolved in raster order.
+/// So on ties and near-ties the location may differ from `match_template()`,
+/// while the SQDIFF at it is never greater.
+void match_template_tiled(cv::Point& match_loc, const cv::Mat& img, const cv::Mat& tpl,
+    int tile_size = DEFAULT_MATCH_TILE_SIZE);
+
 /// Patch OUT_MAT at position (X, Y) with contents of TPL_MAT.
 void patch(cv::Mat& out_mat, const cv::Mat& tpl_mat, const cv::Rect& roi);
 
@@ -100,12 +227,45 @@ void patch(cv::Mat& out_mat, const cv::Mat& tpl_mat, const cv::Rect& roi);
 void bound_boxes(BoundBoxVector& boxes, const cv::Mat& mask,
     int min_threshold = THRESHOLD_MIN, int max_threshold = THRESHOLD_MAX);
 
+/// Find bounding boxes in `mask` within `regions` only (see multi-resolution `diff()`)
+void bound_boxes(BoundBoxVector& boxes, const cv::Mat& mask, const BoundBoxVector& regions,
+    int min_threshold = THRESHOLD_MIN, int max_threshold = THRESHOLD_MAX);
+
+/// Bounded-memory equivalent of `diff()` followed by `bound_boxes()`.
+///
+/// The images are processed in bands of `band_rows` rows. Every band is extended
+/// with the halo rows required by the morphological operations, so intermediate
+/// matrices never exceed the size of an extended band. Boxes split by band edges
+/// are stitched together.
+void bound_boxes_tiled(BoundBoxVector& boxes, const cv::Mat& old_img, const cv::Mat& new_img,
+    int band_rows = DEFAULT_BAND_ROWS,
+    int min_threshold = THRESHOLD_MIN, int max_threshold = THRESHOLD_MAX);
+
+/// Statistics of the first operand of `get_MSSIM()` which don't depend on the second one.
+/// Useful when the same image is compared with many others.
+struct MSSIMStats {
+  /// Image converted to floating point values
+  cv::Mat I;
+  /// Gaussian mean
+  cv::Mat mu;
+  /// Squared Gaussian mean
+  cv::Mat mu_2;
+  /// Gaussian variance
+  cv::Mat sigma_2;
+};
+
+/// Computes the statistics of `i1` required by `get_MSSIM()`
+void get_MSSIM_stats(MSSIMStats& stats, const cv::Mat& i1);
+
 /// Get average of the value computed by `get_MSSIM()`
 double get_avg_MSSIM(const cv::Mat& i1, const cv::Mat& i2);
+double get_avg_MSSIM(const MSSIMStats& s1, const cv::Mat& i2);
 
 /// Computes structural similarity coefficient, i.e. similarity between i1 and i2 matrices.
 /// Each item of the return value is a number between 0 and 1, where 1 is the perfect match.
 cv::Scalar get_MSSIM(const cv::Mat& i1, const cv::Mat& i2);
+/// Version of `get_MSSIM()` accepting precomputed statistics of the first image
+cv::Scalar get_MSSIM(const MSSIMStats& s1, const cv::Mat& i2);
 
 /// Detect whether SRC is homogeneous within boundaries of RECT.
 /// Enlarge RECT until it is heterogeneous, or SRC boundaries are reached.
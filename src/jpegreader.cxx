@@ -0,0 +1,698 @@
+/* Copyright © 2014,2015 - Ruslan Osmanov <rrosmanov@gmail.com>
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include "jpegreader.hxx"
+
+#include <cstdio>
+#include <cstring>
+#include <csetjmp>
+#include <algorithm>
+#include <vector>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <jpeglib.h>
+
+#include "imtools.hxx"
+#include "log.hxx"
+#include "exceptions.hxx"
+#include "threads.hxx"
+
+#if defined(IMTOOLS_THREADS) && (defined(MEM_SRCDST_SUPPORTED) || JPEG_LIB_VERSION >= 80)
+/// Whether `read_jpeg()` is supported
+# define IMTOOLS_JPEG_PARALLEL 1
+#endif
+
+#if defined(LIBJPEG_TURBO_VERSION_NUMBER) && LIBJPEG_TURBO_VERSION_NUMBER >= 1005000
+/// Whether libjpeg can skip rows and crop scanlines
+# define IMTOOLS_JPEG_CROP 1
+#endif
+
+namespace imtools {
+/////////////////////////////////////////////////////////////////////
+
+namespace {
+
+struct ErrorManager {
+  struct jpeg_error_mgr pub;
+  jmp_buf setjmp_buffer;
+};
+
+
+void
+on_error(j_common_ptr cinfo)
+{
+  ErrorManager* err = reinterpret_cast<ErrorManager*>(cinfo->err);
+  char buf[JMSG_LENGTH_MAX];
+
+  (*cinfo->err->format_message)(cinfo, buf);
+  debug_log("libjpeg: %s", buf);
+  longjmp(err->setjmp_buffer, 1);
+}
+
+
+void
+on_message(j_common_ptr cinfo)
+{
+  char buf[JMSG_LENGTH_MAX];
+
+  (*cinfo->err->format_message)(cinfo, buf);
+  debug_log("libjpeg: %s", buf);
+}
+
+
+inline unsigned
+be16(const unsigned char* p)
+{
+  return (p[0] << 8) | p[1];
+}
+
+
+/// \returns EXIF orientation from APP1 segment `seg` of `len` bytes, or 0
+int
+exif_orientation(const unsigned char* seg, size_t len)
+{
+  if (len < 14 || memcmp(seg, "Exif\0\0", 6) != 0) {
+    return 0;
+  }
+
+  const unsigned char* tiff = seg + 6;
+  const size_t size = len - 6;
+  bool le;
+
+  if (tiff[0] == 'I' && tiff[1] == 'I') {
+    le = true;
+  } else if (tiff[0] == 'M' && tiff[1] == 'M') {
+    le = false;
+  } else {
+    return 0;
+  }
+
+  auto u16 = [&](size_t o) -> unsigned {
+    return le ? (tiff[o] | (tiff[o + 1] << 8)) : be16(tiff + o);
+  };
+  auto u32 = [&](size_t o) -> size_t {
+    return le ? (u16(o) | (static_cast<size_t>(u16(o + 2)) << 16))
+      : ((static_cast<size_t>(u16(o)) << 16) | u16(o + 2));
+  };
+
+  size_t ifd = u32(4);
+  if (ifd + 2 > size) {
+    return 0;
+  }
+
+  unsigned n = u16(ifd);
+  for (unsigned i = 0; i < n; ++i) {
+    size_t entry = ifd + 2 + i * 12;
+    if (entry + 12 > size) {
+      break;
+    }
+    if (u16(entry) == 0x0112) {
+      return u16(entry + 8);
+    }
+  }
+
+  return 0;
+}
+
+
+#ifdef IMTOOLS_JPEG_PARALLEL
+/// Layout of a baseline JPEG file
+struct JpegLayout {
+  int width = 0;
+  int height = 0;
+  int n_components = 0;
+  int mcu_width = 0;
+  int mcu_height = 0;
+  int mcus_per_row = 0;
+  int mcu_rows = 0;
+  /// Number of MCUs between restart markers (0 - none)
+  int restart_interval = 0;
+  /// Offset of the image height field in the SOF segment
+  size_t sof_height_offset = 0;
+  /// Offset of the entropy-coded data
+  size_t scan_offset = 0;
+  /// Offsets of the restart intervals of the entropy-coded data (end is exclusive)
+  std::vector<size_t> interval_begin;
+  std::vector<size_t> interval_end;
+  /// Whether EXIF orientation requires a transformation
+  bool oriented = false;
+  /// Whether some of the components are vertically subsampled
+  bool v_subsampled = false;
+};
+
+
+/// Parses headers and restart intervals of `data`. \returns false, if the file is not supported
+bool
+parse_jpeg(JpegLayout& layout, const unsigned char* data, size_t size)
+{
+  if (size < 4 || data[0] != 0xFF || data[1] != 0xD8) {
+    return false;
+  }
+
+  int h_max = 0;
+  int v_max = 0;
+  size_t pos = 2;
+
+  // Marker segments up to the start of scan
+  for (;;) {
+    if (pos + 4 > size || data[pos] != 0xFF) {
+      return false;
+    }
+    const unsigned char marker = data[pos + 1];
+    if (marker == 0xFF) {
+      ++pos; // fill byte
+      continue;
+    }
+    pos += 2;
+    if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD8)) {
+      continue; // no length
+    }
+
+    const size_t len = be16(data + pos);
+    if (len < 2 || pos + len > size) {
+      return false;
+    }
+    const unsigned char* seg = data + pos + 2;
+    const size_t seg_len = len - 2;
+
+    switch (marker) {
+      case 0xC0: // baseline
+      case 0xC1: // extended sequential, Huffman
+        if (seg_len < 6 || seg[0] != 8) {
+          return false;
+        }
+        layout.height = be16(seg + 1);
+        layout.width = be16(seg + 3);
+        layout.n_components = seg[5];
+        layout.sof_height_offset = pos + 3;
+        if (seg_len < 6 + 3u * layout.n_components) {
+          return false;
+        }
+        for (int i = 0; i < layout.n_components; ++i) {
+          h_max = std::max(h_max, seg[6 + i * 3 + 1] >> 4);
+          v_max = std::max(v_max, seg[6 + i * 3 + 1] & 0x0F);
+        }
+        for (int i = 0; i < layout.n_components; ++i) {
+          layout.v_subsampled |= (seg[6 + i * 3 + 1] & 0x0F) != v_max;
+        }
+        break;
+
+      case 0xC2: case 0xC3: case 0xC5: case 0xC6: case 0xC7:
+      case 0xC9: case 0xCA: case 0xCB: case 0xCD: case 0xCE: case 0xCF:
+        // Progressive, lossless, hierarchical, or arithmetic coding
+        return false;
+
+      case 0xDD: // DRI
+        if (seg_len < 2) {
+          return false;
+        }
+        layout.restart_interval = be16(seg);
+        break;
+
+      case 0xE1: // APP1
+        {
+          int orientation = exif_orientation(seg, seg_len);
+          layout.oriented = orientation > 1;
+        }
+        break;
+
+      case 0xDA: // SOS
+        // A single scan with all of the components
+        if (seg_len < 1 || seg[0] != layout.n_components) {
+          return false;
+        }
+        layout.scan_offset = pos + len;
+        break;
+
+      case 0xD9: // EOI
+        return false;
+
+      default:
+        break;
+    }
+    pos += len;
+
+    if (layout.scan_offset) {
+      break;
+    }
+  }
+
+  if (layout.width <= 0 || layout.height <= 0 || (layout.n_components != 1 && layout.n_components != 3)
+      || h_max <= 0 || v_max <= 0 || layout.restart_interval <= 0)
+  {
+    return false;
+  }
+
+  if (layout.n_components == 1) {
+    // Non-interleaved scan: an MCU is a single block
+    layout.mcu_width = layout.mcu_height = 8;
+  } else {
+    layout.mcu_width = 8 * h_max;
+    layout.mcu_height = 8 * v_max;
+  }
+  layout.mcus_per_row = (layout.width + layout.mcu_width - 1) / layout.mcu_width;
+  layout.mcu_rows = (layout.height + layout.mcu_height - 1) / layout.mcu_height;
+
+  // Restart intervals of the entropy-coded data
+  size_t begin = layout.scan_offset;
+  bool eoi = false;
+  for (pos = begin; pos + 1 < size; ++pos) {
+    if (data[pos] != 0xFF) {
+      continue;
+    }
+    const unsigned char m = data[pos + 1];
+    if (m == 0x00) {
+      ++pos; // stuffed byte
+    } else if (m >= 0xD0 && m <= 0xD7) {
+      layout.interval_begin.push_back(begin);
+      layout.interval_end.push_back(pos);
+      begin = pos + 2;
+      ++pos;
+    } else if (m != 0xFF) {
+      layout.interval_begin.push_back(begin);
+      layout.interval_end.push_back(pos);
+      eoi = true;
+      break;
+    }
+  }
+  if (!eoi) {
+    return false;
+  }
+
+  const size_t n_mcus = static_cast<size_t>(layout.mcus_per_row) * layout.mcu_rows;
+  const size_t n_intervals = (n_mcus + layout.restart_interval - 1) / layout.restart_interval;
+
+  return layout.interval_begin.size() == n_intervals;
+}
+
+
+/*! Decodes JPEG `data` of `size` bytes of `height` rows. Rows starting from
+ * `first_row` are stored into `dst`, the rest of the rows is dropped.
+ * \returns false on error, or if the output doesn't match `dst` */
+bool
+decode_part(cv::Mat& dst, int first_row, int height, const unsigned char* data, size_t size, int denom)
+{
+  struct jpeg_decompress_struct cinfo;
+  ErrorManager err;
+  std::vector<unsigned char> scratch(static_cast<size_t>(dst.cols) * dst.channels());
+
+  cinfo.err = jpeg_std_error(&err.pub);
+  err.pub.error_exit = on_error;
+  err.pub.output_message = on_message;
+  if (setjmp(err.setjmp_buffer)) {
+    jpeg_destroy_decompress(&cinfo);
+    return false;
+  }
+
+  jpeg_create_decompress(&cinfo);
+  jpeg_mem_src(&cinfo, const_cast<unsigned char*>(data), size);
+  jpeg_read_header(&cinfo, TRUE);
+
+  cinfo.scale_num = 1;
+  cinfo.scale_denom = denom;
+  if (dst.channels() == 1) {
+    cinfo.out_color_space = JCS_GRAYSCALE;
+  } else {
+#ifdef JCS_EXTENSIONS
+    cinfo.out_color_space = JCS_EXT_BGR;
+#else
+    cinfo.out_color_space = JCS_RGB;
+#endif
+  }
+  jpeg_start_decompress(&cinfo);
+
+  if (static_cast<int>(cinfo.output_width) != dst.cols
+      || static_cast<int>(cinfo.output_height) != height
+      || cinfo.output_components != dst.channels())
+  {
+    jpeg_destroy_decompress(&cinfo);
+    return false;
+  }
+
+  while (cinfo.output_scanline < cinfo.output_height) {
+    const int y = static_cast<int>(cinfo.output_scanline) - first_row;
+    JSAMPROW row = (y >= 0 && y < dst.rows) ? dst.ptr(y) : scratch.data();
+    jpeg_read_scanlines(&cinfo, &row, 1);
+  }
+
+  // Corrupt data is reported as warnings
+  bool success = cinfo.err->num_warnings == 0;
+  jpeg_finish_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+
+#ifndef JCS_EXTENSIONS
+  if (success && dst.channels() == 3) {
+    cv::cvtColor(dst, dst, CV_RGB2BGR);
+  }
+#endif
+
+  return success;
+}
+
+
+/// Reads whole file into `buf`. \returns false on error
+bool
+read_file(std::vector<unsigned char>& buf, const std::string& filename)
+{
+  FILE* fp = open_file(filename);
+  if (!fp) {
+    return false;
+  }
+
+  bool success = fseek(fp, 0, SEEK_END) == 0;
+  long size = success ? ftell(fp) : -1;
+  if (size > 0 && fseek(fp, 0, SEEK_SET) == 0) {
+    buf.resize(size);
+    success = fread(buf.data(), 1, size, fp) == static_cast<size_t>(size);
+  } else {
+    success = false;
+  }
+  fclose(fp);
+
+  return success;
+}
+
+#endif // IMTOOLS_JPEG_PARALLEL
+
+
+/// Decodes JPEG file row by row
+class JpegRowReader : public RowReader
+{
+  public:
+    JpegRowReader() noexcept
+    {
+      memset(&m_cinfo, 0, sizeof(m_cinfo));
+    }
+
+    virtual ~JpegRowReader()
+    {
+      if (m_created) {
+        jpeg_destroy_decompress(&m_cinfo);
+      }
+      if (m_fp) {
+        fclose(m_fp);
+      }
+    }
+
+    /*! \param roi Region of the image at 1/`denom` scale to decode (empty - entire image)
+     * \returns false, if the file can't be decoded row by row */
+    bool open(const std::string& filename, int denom, const cv::Rect& roi)
+    {
+      m_filename = filename;
+      m_fp = open_file(filename);
+      if (!m_fp) {
+        return false;
+      }
+
+      m_cinfo.err = jpeg_std_error(&m_err.pub);
+      m_err.pub.error_exit = on_error;
+      m_err.pub.output_message = on_message;
+      if (setjmp(m_err.setjmp_buffer)) {
+        return false;
+      }
+
+      jpeg_create_decompress(&m_cinfo);
+      m_created = true;
+      jpeg_stdio_src(&m_cinfo, m_fp);
+      jpeg_save_markers(&m_cinfo, JPEG_APP0 + 1, 0xFFFF);
+      jpeg_read_header(&m_cinfo, TRUE);
+
+      // OpenCV applies the EXIF orientation
+      for (jpeg_saved_marker_ptr m = m_cinfo.marker_list; m; m = m->next) {
+        if (exif_orientation(m->data, m->data_length) > 1) {
+          return false;
+        }
+      }
+
+      // libjpeg keeps all coefficients of a progressive image in memory
+      if (jpeg_has_multiple_scans(&m_cinfo)) {
+        return false;
+      }
+
+      switch (m_cinfo.jpeg_color_space) {
+        case JCS_GRAYSCALE:
+          m_cinfo.out_color_space = JCS_GRAYSCALE;
+          m_type = CV_8UC1;
+          break;
+        case JCS_YCbCr:
+        case JCS_RGB:
+#ifdef JCS_EXTENSIONS
+          m_cinfo.out_color_space = JCS_EXT_BGR;
+#else
+          m_cinfo.out_color_space = JCS_RGB;
+#endif
+          m_type = CV_8UC3;
+          break;
+        default:
+          // CMYK etc.
+          return false;
+      }
+
+      m_cinfo.scale_num = 1;
+      m_cinfo.scale_denom = denom;
+      jpeg_start_decompress(&m_cinfo);
+
+      const cv::Rect whole(0, 0, m_cinfo.output_width, m_cinfo.output_height);
+      const cv::Rect region(roi.area() > 0 ? roi : whole);
+      if ((region & whole) != region) {
+        return false;
+      }
+      m_size = region.size();
+      m_top = region.y;
+      m_bottom = region.y + region.height;
+      m_left = region.x;
+
+#ifdef IMTOOLS_JPEG_CROP
+      if (region != whole) {
+        // Fancy upsampling of the columns at the edges of the cropped
+        // scanlines uses replicated samples. So one more column on each side
+        // is decoded.
+        JDIMENSION x = std::max(region.x - 1, 0);
+        JDIMENSION width = std::min(region.x + region.width + 1, whole.width) - x;
+        jpeg_crop_scanline(&m_cinfo, &x, &width);
+        m_left = region.x - x;
+        if (region.y > 0 && jpeg_skip_scanlines(&m_cinfo, region.y) != static_cast<JDIMENSION>(region.y)) {
+          return false;
+        }
+      }
+#endif
+
+      if (m_left > 0 || static_cast<int>(m_cinfo.output_width) != m_size.width) {
+        m_buf.resize(static_cast<size_t>(m_cinfo.output_width) * m_cinfo.output_components);
+      }
+
+      return true;
+    }
+
+    virtual int read(cv::Mat& rows) override
+    {
+      if (setjmp(m_err.setjmp_buffer)) {
+        throw ErrorException("Failed to decode JPEG %s", m_filename.c_str());
+      }
+
+      const int cn = m_cinfo.output_components;
+      int n = 0;
+      while (n < rows.rows && static_cast<int>(m_cinfo.output_scanline) < m_bottom) {
+        JSAMPROW row = m_buf.empty() ? rows.ptr(n) : m_buf.data();
+        if (jpeg_read_scanlines(&m_cinfo, &row, 1) != 1) {
+          throw ErrorException("Failed to decode JPEG %s", m_filename.c_str());
+        }
+        // The rows above the region are decoded, if they can't be skipped
+        if (static_cast<int>(m_cinfo.output_scanline) <= m_top) {
+          continue;
+        }
+        if (!m_buf.empty()) {
+          memcpy(rows.ptr(n), m_buf.data() + m_left * cn, static_cast<size_t>(m_size.width) * cn);
+        }
+        ++n;
+      }
+
+#ifndef JCS_EXTENSIONS
+      if (m_type == CV_8UC3) {
+        cv::Mat bgr(rows.rowRange(0, n));
+        cv::cvtColor(bgr, bgr, CV_RGB2BGR);
+      }
+#endif
+
+      return n;
+    }
+
+  private:
+    struct jpeg_decompress_struct m_cinfo;
+    ErrorManager m_err;
+    FILE* m_fp = nullptr;
+    bool m_created = false;
+    std::string m_filename;
+    /// Rows of the region [m_top, m_bottom) of the output
+    int m_top = 0;
+    int m_bottom = 0;
+    /// Offset of the region in the decoded scanlines
+    int m_left = 0;
+    /// Decoded scanline, if it is wider than the region
+    std::vector<unsigned char> m_buf;
+};
+
+} // anonymous namespace
+
+/////////////////////////////////////////////////////////////////////
+
+cv::Mat
+read_jpeg(const std::string& filename, int denom)
+{
+#ifdef IMTOOLS_JPEG_PARALLEL
+  if (denom != 1 && denom != 2 && denom != 4 && denom != 8) {
+    return cv::Mat();
+  }
+
+  // The threads are already busy, if called from a parallel region
+  if (omp_in_parallel()) {
+    debug_log("%s: not decoding in parallel within a parallel region", filename.c_str());
+    return cv::Mat();
+  }
+  // Outside of a parallel region, a single thread means the team size has been
+  // lowered for this thread (e.g. by omp_set_num_threads() in a caller)
+  const int n_threads = omp_get_max_threads();
+  if (n_threads < 2) {
+    verbose_log("%s: not decoding in parallel, thread limit is %d", filename.c_str(), n_threads);
+    return cv::Mat();
+  }
+
+  std::vector<unsigned char> data;
+  JpegLayout layout;
+  if (!read_file(data, filename) || !parse_jpeg(layout, data.data(), data.size())) {
+    return cv::Mat();
+  }
+  if (layout.oriented || static_cast<long>(layout.width) * layout.height < JPEG_PARALLEL_MIN_PIXELS) {
+    return cv::Mat();
+  }
+
+  // Restart intervals starting whole MCU rows
+  const int ri = layout.restart_interval;
+  const int n_intervals = static_cast<int>(layout.interval_begin.size());
+  std::vector<int> bound_interval;
+  std::vector<int> bound_row;
+  for (int k = 0; k < n_intervals; ++k) {
+    const long mcu = static_cast<long>(k) * ri;
+    if (mcu % layout.mcus_per_row == 0) {
+      bound_interval.push_back(k);
+      bound_row.push_back(static_cast<int>(mcu / layout.mcus_per_row));
+    }
+  }
+  bound_interval.push_back(n_intervals);
+  bound_row.push_back(layout.mcu_rows);
+
+  // Split the image at the boundaries into parts, one part per thread
+  const int n_bounds = static_cast<int>(bound_row.size());
+  std::vector<int> parts(1, 0);
+  for (int p = 1, b = 1; p < n_threads && b < n_bounds - 1; ++p) {
+    const long target_row = static_cast<long>(p) * layout.mcu_rows / n_threads;
+    while (b < n_bounds - 1 && bound_row[b] < target_row) {
+      ++b;
+    }
+    if (b < n_bounds - 1) {
+      parts.push_back(b++);
+    }
+  }
+  if (parts.size() < 2) {
+    debug_log("%s: restart intervals are not aligned to MCU rows", filename.c_str());
+    return cv::Mat();
+  }
+  parts.push_back(n_bounds - 1);
+
+  // Fancy upsampling of vertically subsampled components uses the adjacent
+  // rows. So the parts are decoded along with the neighbouring intervals, and
+  // the extra rows are dropped.
+  const int overlap = layout.v_subsampled ? 1 : 0;
+  const int n = static_cast<int>(parts.size()) - 1;
+  const int cn = layout.n_components;
+  const int mh = layout.mcu_height;
+  cv::Mat img((layout.height + denom - 1) / denom, (layout.width + denom - 1) / denom, cn == 1 ? CV_8UC1 : CV_8UC3);
+  int n_failed = 0;
+
+  _Pragma("omp parallel for schedule(static, 1) reduction(+:n_failed)")
+  for (int p = 0; p < n; ++p) {
+    const int b0 = std::max(0, parts[p] - overlap);
+    const int b1 = std::min(n_bounds - 1, parts[p + 1] + overlap);
+
+    // Make a JPEG image of the intervals: the headers with the height of the
+    // part, the intervals with restart markers renumbered from zero, and EOI.
+    const int y0 = bound_row[b0] * mh;
+    const int height = std::min(layout.height, bound_row[b1] * mh) - y0;
+    std::vector<unsigned char> part(data.begin(), data.begin() + layout.scan_offset);
+
+    part[layout.sof_height_offset]     = height >> 8;
+    part[layout.sof_height_offset + 1] = height & 0xFF;
+    for (int k = bound_interval[b0]; k < bound_interval[b1]; ++k) {
+      if (k > bound_interval[b0]) {
+        part.push_back(0xFF);
+        part.push_back(0xD0 + (k - bound_interval[b0] - 1) % 8);
+      }
+      part.insert(part.end(), data.begin() + layout.interval_begin[k], data.begin() + layout.interval_end[k]);
+    }
+    part.push_back(0xFF);
+    part.push_back(0xD9);
+
+    // The MCU height is a multiple of `denom`
+    const int row_begin = bound_row[parts[p]] * mh / denom;
+    const int row_end = std::min(img.rows, bound_row[parts[p + 1]] * mh / denom);
+    cv::Mat rows(img.rowRange(row_begin, row_end));
+    if (!decode_part(rows, row_begin - y0 / denom, (height + denom - 1) / denom,
+          part.data(), part.size(), denom))
+    {
+      ++n_failed;
+    }
+  }
+
+  if (n_failed) {
+    warning_log("%s: failed to decode %d of %d parts, falling back to the regular decoder",
+        filename.c_str(), n_failed, n);
+    return cv::Mat();
+  }
+
+  debug_log("%s: decoded %dx%d (1/%d) in %d parts", filename.c_str(), img.cols, img.rows, denom, n);
+
+  if (cn == 1) {
+    cv::Mat bgr;
+    cv::cvtColor(img, bgr, CV_GRAY2BGR);
+    return bgr;
+  }
+
+  return img;
+#else
+  (void) filename;
+  (void) denom;
+  return cv::Mat();
+#endif
+}
+
+
+
+RowReaderPtr
+open_jpeg_reader(const std::string& filename, int denom, const cv::Rect& roi)
+{
+  if (denom != 1 && denom != 2 && denom != 4 && denom != 8) {
+    return nullptr;
+  }
+
+  std::unique_ptr<JpegRowReader> reader(new JpegRowReader());
+  if (!reader->open(filename, denom, roi)) {
+    return nullptr;
+  }
+
+  return RowReaderPtr(reader.release());
+}
+
+/////////////////////////////////////////////////////////////////////
+} // namespace imtools
+// vim: et ts=2 sts=2 sw=2
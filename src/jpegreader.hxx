@@ -0,0 +1,58 @@
+/* Copyright © 2014,2015 - Ruslan Osmanov <rrosmanov@gmail.com>
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#pragma once
+#ifndef IMTOOLS_JPEGREADER_HXX
+#define IMTOOLS_JPEGREADER_HXX
+
+#include <string>
+#include <opencv2/core/core.hpp>
+#include "rowreader.hxx"
+
+namespace imtools {
+/////////////////////////////////////////////////////////////////////
+
+/// Min. number of pixels of a JPEG image worth decoding on multiple threads
+const int JPEG_PARALLEL_MIN_PIXELS = 1 << 20;
+
+/*! Decodes a baseline JPEG file with restart markers on multiple threads.
+ * The entropy-coded data is split at the restart markers starting whole MCU
+ * rows into a few parts (one per thread). Each part is decoded by libjpeg as
+ * a separate image of the corresponding height, directly into the rows of
+ * the result.
+ *
+ * \param denom Scale denominator: 1, 2, 4, or 8
+ * \returns 8-bit 3-channel (BGR) image, or empty matrix, if the file is not
+ * suitable (no restart markers, progressive, has EXIF orientation, too small,
+ * no spare threads etc.), or on error. The caller should fall back to
+ * `cv::imread()` then.
+ */
+cv::Mat read_jpeg(const std::string& filename, int denom = 1);
+
+/*! Opens a JPEG file for decoding row by row at 1/`denom` scale (1, 2, 4, or 8)
+ * \param roi Region of the scaled image to decode (empty - entire image).
+ * With libjpeg-turbo 1.5 or newer, the rows above the region are skipped
+ * without color conversion and upsampling, and only the MCU columns covering
+ * the region are decoded.
+ * \returns nullptr, if the file can't be read, or can't be decoded row by row
+ * with bounded memory (progressive, CMYK, or has EXIF orientation), or `roi`
+ * is out of the image
+ */
+RowReaderPtr open_jpeg_reader(const std::string& filename, int denom = 1, const cv::Rect& roi = cv::Rect());
+
+/////////////////////////////////////////////////////////////////////
+} // namespace imtools
+#endif // IMTOOLS_JPEGREADER_HXX
+// vim: et ts=2 sts=2 sw=2
@@ -18,6 +18,7 @@
  * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
  */
 #include <string.h>
+#include <mutex>
 #include "log.hxx"
 
 namespace imtools { namespace log {
@@ -26,7 +27,9 @@ namespace imtools { namespace log {
 #define MAX_LINE_LENGTH 1024
 
 typedef std::vector<std::string> ErrorStack;
+/// Errors pushed from the threads of a parallel region (guarded by `g_error_stack_lock`)
 static ErrorStack g_error_stack;
+static std::mutex g_error_stack_lock;
 
 #ifdef IMTOOLS_DEBUG
 static Level g_level{Level::DEBUG};
@@ -34,6 +37,9 @@ static Level g_level{Level::DEBUG};
 static Level g_level{Level::NOTICE};
 #endif
 
+/// Whether to write all messages to stderr
+static bool g_stderr_only{false};
+
 static const char* g_level_names[] = {
   [Level::ERROR]   = "Error",
   [Level::WARNING] = "Warning",
@@ -48,6 +54,7 @@ static const char* g_level_names[] = {
 void
 push_error(const std::string& msg) noexcept
 {
+  std::lock_guard<std::mutex> lock(g_error_stack_lock);
   g_error_stack.push_back(msg);
 }
 
@@ -60,8 +67,14 @@ push_error(const char* format, ...) noexcept
     va_start(args, format);
     char message[1024];
     int message_len = vsnprintf(message, sizeof(message), format, args);
-    g_error_stack.push_back(std::string(message, message_len));
     va_end(args);
+
+    if (message_len >= static_cast<int>(sizeof(message))) {
+      message_len = sizeof(message) - 1;
+    }
+    if (message_len >= 0) {
+      push_error(std::string(message, message_len));
+    }
   }
 }
 
@@ -69,11 +82,14 @@ push_error(const char* format, ...) noexcept
 void
 warn_all() noexcept
 {
-  if (!g_error_stack.empty()) {
-    for (auto& it : g_error_stack) {
-      warning_log("%s", it.c_str());
-    }
-    g_error_stack.clear();
+  ErrorStack errors;
+  {
+    std::lock_guard<std::mutex> lock(g_error_stack_lock);
+    errors.swap(g_error_stack);
+  }
+
+  for (auto& it : errors) {
+    warning_log("%s", it.c_str());
   }
 }
 
@@ -112,7 +128,7 @@ write(Level level, const char* format, ...) noexcept
 
     buf[len++] = '\n';
 
-    if (::write(level < Level::WARNING ? STDOUT_FILENO : STDERR_FILENO, buf, len) == -1) {
+    if (::write(level < Level::WARNING && !g_stderr_only ? STDOUT_FILENO : STDERR_FILENO, buf, len) == -1) {
       fprintf(stderr, "write: %s\n", strerror(errno));
     }
   }
@@ -125,6 +141,13 @@ set_level(Level level) noexcept
   g_level = level;
 }
 
+
+void
+set_stderr_only(bool stderr_only) noexcept
+{
+  g_stderr_only = stderr_only;
+}
+
 /////////////////////////////////////////////////////////////////////
 }} // namespace imtools::log
 // vim: et ts=2 sts=2 sw=2
@@ -115,6 +115,8 @@ void push_error(const char* msg, ...) noexcept;
 void warn_all() noexcept;
 void write(Level level, const char* format, ...) noexcept;
 void set_level(Level level) noexcept;
+/// Makes all messages go to stderr (when stdout carries image data)
+void set_stderr_only(bool stderr_only) noexcept;
 
 /////////////////////////////////////////////////////////////////////
 }} // namespace imtools::log
@@ -0,0 +1,345 @@
+/* Copyright © 2014,2015 - Ruslan Osmanov <rrosmanov@gmail.com>
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include "pngreader.hxx"
+
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <algorithm>
+#include <vector>
+#include <zlib.h>
+
+#include "imtools.hxx"
+#include "log.hxx"
+#include "exceptions.hxx"
+
+namespace imtools {
+/////////////////////////////////////////////////////////////////////
+
+namespace {
+
+/// Size of the buffer for compressed data
+const size_t INPUT_BUFFER_SIZE = 65536;
+
+const unsigned char PNG_SIGNATURE[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+
+enum ColorType : int {
+  COLOR_GRAY       = 0,
+  COLOR_RGB        = 2,
+  COLOR_PALETTE    = 3,
+  COLOR_GRAY_ALPHA = 4,
+  COLOR_RGBA       = 6
+};
+
+
+inline uint32_t
+get_be32(const unsigned char* p)
+{
+  return (static_cast<uint32_t>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+
+inline int
+paeth(int a, int b, int c)
+{
+  const int p = a + b - c;
+  const int pa = std::abs(p - a);
+  const int pb = std::abs(p - b);
+  const int pc = std::abs(p - c);
+
+  return (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+}
+
+
+/// Decodes non-interlaced PNG file row by row
+class PngRowReader : public RowReader
+{
+  public:
+    PngRowReader() noexcept
+    {
+      memset(&m_zs, 0, sizeof(m_zs));
+    }
+
+    virtual ~PngRowReader()
+    {
+      if (m_zinit) {
+        inflateEnd(&m_zs);
+      }
+      if (m_fp) {
+        fclose(m_fp);
+      }
+    }
+
+    /// \returns false, if the file can't be decoded row by row
+    bool open(const std::string& filename)
+    {
+      unsigned char header[13];
+
+      m_filename = filename;
+      m_fp = open_file(filename);
+      if (!m_fp || fread(header, 1, 8, m_fp) != 8 || memcmp(header, PNG_SIGNATURE, 8) != 0) {
+        return false;
+      }
+
+      // Read the chunks up to the first IDAT
+      uint32_t len;
+      char type[5] = {0};
+      bool have_ihdr = false;
+      while (_readChunkHeader(len, type)) {
+        if (memcmp(type, "IHDR", 4) == 0) {
+          if (len != 13 || fread(header, 1, 13, m_fp) != 13 || fseek(m_fp, 4, SEEK_CUR) != 0) {
+            return false;
+          }
+          m_size = cv::Size(get_be32(header), get_be32(header + 4));
+          m_depth = header[8];
+          m_color = header[9];
+          // Compression and filter methods, interlace
+          if (header[10] != 0 || header[11] != 0 || header[12] != 0) {
+            return false;
+          }
+          have_ihdr = true;
+        } else if (memcmp(type, "PLTE", 4) == 0) {
+          if (len > m_palette.size() || len % 3 != 0
+              || fread(m_palette.data(), 1, len, m_fp) != len || fseek(m_fp, 4, SEEK_CUR) != 0)
+          {
+            return false;
+          }
+        } else if (memcmp(type, "IDAT", 4) == 0) {
+          m_idat_left = len;
+          break;
+        } else if (memcmp(type, "IEND", 4) == 0 || fseek(m_fp, len + 4, SEEK_CUR) != 0) {
+          return false;
+        }
+      }
+      if (!have_ihdr || m_idat_left == 0 || m_size.width <= 0 || m_size.height <= 0) {
+        return false;
+      }
+
+      switch (m_color) {
+        case COLOR_GRAY:       m_channels = 1; break;
+        case COLOR_GRAY_ALPHA: m_channels = 2; break;
+        case COLOR_RGB:        m_channels = 3; break;
+        case COLOR_RGBA:       m_channels = 4; break;
+        case COLOR_PALETTE:    m_channels = 1; break;
+        default: return false;
+      }
+      if (!(m_depth == 8 || (m_depth == 16 && m_color != COLOR_PALETTE))) {
+        return false;
+      }
+      m_type = (m_color == COLOR_GRAY || m_color == COLOR_GRAY_ALPHA) ? CV_8UC1 : CV_8UC3;
+
+      m_bpp = m_channels * m_depth / 8;
+      const size_t row_bytes = static_cast<size_t>(m_size.width) * m_bpp + 1;
+      m_prev.assign(row_bytes, 0);
+      m_cur.assign(row_bytes, 0);
+      m_input.resize(INPUT_BUFFER_SIZE);
+
+      if (inflateInit(&m_zs) != Z_OK) {
+        return false;
+      }
+      m_zinit = true;
+
+      return true;
+    }
+
+    virtual int read(cv::Mat& rows) override
+    {
+      int n = 0;
+
+      for (; n < rows.rows && m_row < m_size.height; ++n, ++m_row) {
+        m_cur.swap(m_prev);
+        _inflate(m_cur.data(), m_cur.size());
+        _unfilter();
+        _convert(rows.ptr(n));
+      }
+
+      return n;
+    }
+
+  private:
+    /// Reads length and type of the next chunk. \returns false on EOF
+    bool _readChunkHeader(uint32_t& len, char* type)
+    {
+      unsigned char buf[8];
+
+      if (fread(buf, 1, 8, m_fp) != 8) {
+        return false;
+      }
+      len = get_be32(buf);
+      memcpy(type, buf + 4, 4);
+
+      return len <= 0x7FFFFFFF;
+    }
+
+    /// Inflates `size` bytes of the image data into `dst`
+    /// \throws ErrorException
+    void _inflate(unsigned char* dst, size_t size)
+    {
+      m_zs.next_out = dst;
+      m_zs.avail_out = static_cast<uInt>(size);
+
+      while (m_zs.avail_out > 0) {
+        if (m_zs.avail_in == 0) {
+          // The data may be split into any number of IDAT chunks
+          uint32_t len;
+          char type[4];
+          while (m_idat_left == 0) {
+            if (fseek(m_fp, 4, SEEK_CUR) != 0 || !_readChunkHeader(len, type) || memcmp(type, "IDAT", 4) != 0) {
+              throw ErrorException("PNG %s: unexpected end of image data", m_filename.c_str());
+            }
+            m_idat_left = len;
+          }
+
+          size_t n = std::min(static_cast<size_t>(m_idat_left), m_input.size());
+          if (fread(m_input.data(), 1, n, m_fp) != n) {
+            throw ErrorException("PNG %s: unexpected end of file", m_filename.c_str());
+          }
+          m_idat_left -= n;
+          m_zs.next_in = m_input.data();
+          m_zs.avail_in = static_cast<uInt>(n);
+        }
+
+        int ret = inflate(&m_zs, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END && m_zs.avail_out > 0) {
+          throw ErrorException("PNG %s: unexpected end of image data", m_filename.c_str());
+        }
+        if (ret != Z_OK && ret != Z_STREAM_END) {
+          throw ErrorException("PNG %s: %s", m_filename.c_str(), m_zs.msg ? m_zs.msg : "inflate failed");
+        }
+      }
+    }
+
+    /// Reverts the filter of the current row
+    /// \throws ErrorException
+    void _unfilter()
+    {
+      unsigned char* cur = m_cur.data() + 1;
+      const unsigned char* prev = m_prev.data() + 1;
+      const int bpp = m_bpp;
+      const int len = static_cast<int>(m_cur.size()) - 1;
+      int i;
+
+      switch (m_cur[0]) {
+        case 0: // None
+          break;
+        case 1: // Sub
+          for (i = bpp; i < len; ++i) {
+            cur[i] += cur[i - bpp];
+          }
+          break;
+        case 2: // Up
+          for (i = 0; i < len; ++i) {
+            cur[i] += prev[i];
+          }
+          break;
+        case 3: // Average
+          for (i = 0; i < bpp; ++i) {
+            cur[i] += prev[i] >> 1;
+          }
+          for (; i < len; ++i) {
+            cur[i] += (cur[i - bpp] + prev[i]) >> 1;
+          }
+          break;
+        case 4: // Paeth
+          for (i = 0; i < bpp; ++i) {
+            cur[i] += prev[i];
+          }
+          for (; i < len; ++i) {
+            cur[i] += paeth(cur[i - bpp], prev[i], prev[i - bpp]);
+          }
+          break;
+        default:
+          throw ErrorException("PNG %s: invalid filter type %d", m_filename.c_str(), m_cur[0]);
+      }
+    }
+
+    /// Converts the current row to `CV_8UC1` or `CV_8UC3` (BGR) into `dst`
+    void _convert(unsigned char* dst) const
+    {
+      const unsigned char* p = m_cur.data() + 1;
+      // The most significant byte of a 16-bit sample comes first
+      const int step = m_depth / 8;
+      const int width = m_size.width;
+
+      switch (m_color) {
+        case COLOR_GRAY:
+        case COLOR_GRAY_ALPHA:
+          for (int x = 0; x < width; ++x, p += m_bpp) {
+            dst[x] = p[0];
+          }
+          break;
+        case COLOR_RGB:
+        case COLOR_RGBA:
+          for (int x = 0; x < width; ++x, p += m_bpp, dst += 3) {
+            dst[0] = p[2 * step];
+            dst[1] = p[step];
+            dst[2] = p[0];
+          }
+          break;
+        case COLOR_PALETTE:
+          for (int x = 0; x < width; ++x, dst += 3) {
+            const unsigned char* c = &m_palette[p[x] * 3];
+            dst[0] = c[2];
+            dst[1] = c[1];
+            dst[2] = c[0];
+          }
+          break;
+      }
+    }
+
+    FILE* m_fp = nullptr;
+    std::string m_filename;
+    z_stream m_zs;
+    bool m_zinit = false;
+    /// Compressed data
+    std::vector<unsigned char> m_input;
+    /// Number of bytes of the current IDAT chunk not read yet
+    uint32_t m_idat_left = 0;
+    int m_depth = 0;
+    int m_color = 0;
+    /// Number of samples per pixel
+    int m_channels = 0;
+    /// Number of bytes per pixel
+    int m_bpp = 0;
+    /// Colors of the palette (RGB). Missing entries are black.
+    std::vector<unsigned char> m_palette = std::vector<unsigned char>(256 * 3, 0);
+    /// Filter type and data of the previous and current rows
+    std::vector<unsigned char> m_prev;
+    std::vector<unsigned char> m_cur;
+    /// Index of the next row
+    int m_row = 0;
+};
+
+} // anonymous namespace
+
+/////////////////////////////////////////////////////////////////////
+
+RowReaderPtr
+open_png_reader(const std::string& filename)
+{
+  std::unique_ptr<PngRowReader> reader(new PngRowReader());
+
+  if (!reader->open(filename)) {
+    return nullptr;
+  }
+
+  return RowReaderPtr(reader.release());
+}
+
+/////////////////////////////////////////////////////////////////////
+} // namespace imtools
+// vim: et ts=2 sts=2 sw=2
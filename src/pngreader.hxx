@@ -0,0 +1,37 @@
+/* Copyright © 2014,2015 - Ruslan Osmanov <rrosmanov@gmail.com>
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#pragma once
+#ifndef IMTOOLS_PNGREADER_HXX
+#define IMTOOLS_PNGREADER_HXX
+
+#include <string>
+#include "rowreader.hxx"
+
+namespace imtools {
+/////////////////////////////////////////////////////////////////////
+
+/*! Opens a PNG file for decoding row by row. The rows are converted the same
+ * way as by `cv::imread(filename, 1)`: 16-bit samples are reduced to 8 bits,
+ * palette is expanded to BGR, and alpha is dropped.
+ * \returns nullptr, if the file can't be read, or is not supported (interlaced,
+ * or less than 8 bits per sample)
+ */
+RowReaderPtr open_png_reader(const std::string& filename);
+
+/////////////////////////////////////////////////////////////////////
+} // namespace imtools
+#endif // IMTOOLS_PNGREADER_HXX
+// vim: et ts=2 sts=2 sw=2
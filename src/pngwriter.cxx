@@ -0,0 +1,378 @@
+/* Copyright © 2014,2015 - Ruslan Osmanov <rrosmanov@gmail.com>
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include "pngwriter.hxx"
+
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <algorithm>
+#include <zlib.h>
+
+#include "log.hxx"
+#include "threads.hxx"
+
+namespace imtools {
+/////////////////////////////////////////////////////////////////////
+
+namespace {
+
+/// Max. distance of deflate back-references
+const size_t DICT_SIZE = 32768;
+/// Max. size of an IDAT chunk
+const size_t MAX_IDAT_SIZE = 1 << 20;
+
+const unsigned char PNG_SIGNATURE[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+
+enum Filter : unsigned char {
+  FILTER_NONE,
+  FILTER_SUB,
+  FILTER_UP,
+  FILTER_AVERAGE,
+  FILTER_PAETH,
+  N_FILTERS
+};
+
+
+inline void
+put_be32(unsigned char* p, uint32_t v)
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+
+/// Appends PNG chunk of `type` with `size` bytes of `data` to `buf`
+void
+append_chunk(std::vector<unsigned char>& buf, const char* type, const unsigned char* data, size_t size)
+{
+  size_t start = buf.size();
+
+  buf.resize(start + 8 + size + 4);
+  unsigned char* p = &buf[start];
+
+  put_be32(p, static_cast<uint32_t>(size));
+  memcpy(p + 4, type, 4);
+  if (size) {
+    memcpy(p + 8, data, size);
+  }
+  put_be32(p + 8 + size, static_cast<uint32_t>(crc32(crc32(0L, Z_NULL, 0), p + 4, static_cast<uInt>(size + 4))));
+}
+
+
+/// Converts row `y` of `img` to PNG sample order (RGB(A), big-endian 16-bit samples)
+void
+convert_row(unsigned char* dst, const cv::Mat& img, int y)
+{
+  const int cn = img.channels();
+  const int n = img.cols * cn;
+
+  if (img.depth() == CV_8U) {
+    const unsigned char* src = img.ptr<unsigned char>(y);
+
+    if (cn == 1) {
+      memcpy(dst, src, n);
+      return;
+    }
+    for (int i = 0; i < n; i += cn) {
+      dst[i]     = src[i + 2];
+      dst[i + 1] = src[i + 1];
+      dst[i + 2] = src[i];
+      if (cn == 4) {
+        dst[i + 3] = src[i + 3];
+      }
+    }
+  } else {
+    const uint16_t* src = img.ptr<uint16_t>(y);
+
+    for (int i = 0; i < n; i += cn) {
+      for (int c = 0; c < cn; ++c) {
+        uint16_t v = src[i + (cn >= 3 && c < 3 ? 2 - c : c)];
+        dst[(i + c) * 2]     = v >> 8;
+        dst[(i + c) * 2 + 1] = v & 0xff;
+      }
+    }
+  }
+}
+
+
+inline unsigned char
+paeth(int a, int b, int c)
+{
+  int p  = a + b - c;
+  int pa = std::abs(p - a);
+  int pb = std::abs(p - b);
+  int pc = std::abs(p - c);
+
+  if (pa <= pb && pa <= pc) {
+    return a;
+  }
+  return pb <= pc ? b : c;
+}
+
+
+/// Applies `filter` to `row` of `len` bytes (`prev` is the previous row, or zeros)
+void
+apply_filter(unsigned char* out, Filter filter, const unsigned char* row,
+    const unsigned char* prev, size_t len, size_t bpp)
+{
+  size_t i;
+
+  switch (filter) {
+    case FILTER_NONE:
+      memcpy(out, row, len);
+      break;
+    case FILTER_SUB:
+      for (i = 0; i < bpp; ++i)   out[i] = row[i];
+      for (; i < len; ++i)        out[i] = row[i] - row[i - bpp];
+      break;
+    case FILTER_UP:
+      for (i = 0; i < len; ++i)   out[i] = row[i] - prev[i];
+      break;
+    case FILTER_AVERAGE:
+      for (i = 0; i < bpp; ++i)   out[i] = row[i] - (prev[i] >> 1);
+      for (; i < len; ++i)        out[i] = row[i] - ((row[i - bpp] + prev[i]) >> 1);
+      break;
+    case FILTER_PAETH:
+      for (i = 0; i < bpp; ++i)   out[i] = row[i] - paeth(0, prev[i], 0);
+      for (; i < len; ++i)        out[i] = row[i] - paeth(row[i - bpp], prev[i], prev[i - bpp]);
+      break;
+    default:
+      break;
+  }
+}
+
+
+/// \returns sum of absolute values of `data` interpreted as signed bytes
+inline size_t
+abs_sum(const unsigned char* data, size_t len)
+{
+  size_t sum = 0;
+  for (size_t i = 0; i < len; ++i) {
+    sum += std::abs(static_cast<int>(static_cast<signed char>(data[i])));
+  }
+  return sum;
+}
+
+
+/*! Filters `raw` rows into `out` (filter type byte followed by the filtered
+ * row). The filter is chosen per row by the minimum sum of absolute
+ * differences heuristic (the libpng default), unless `adaptive` is false. */
+void
+filter_rows(std::vector<unsigned char>& out, const std::vector<unsigned char>& raw,
+    int rows, size_t row_len, size_t bpp, bool adaptive)
+{
+  const std::vector<unsigned char> zeros(row_len, 0);
+
+  out.resize(rows * (row_len + 1));
+
+#ifdef IMTOOLS_THREADS
+  _Pragma("omp parallel")
+#endif
+  {
+    std::vector<unsigned char> tmp(row_len);
+
+#ifdef IMTOOLS_THREADS
+    _Pragma("omp for schedule(static)")
+#endif
+    for (int y = 0; y < rows; ++y) {
+      const unsigned char* row = &raw[y * row_len];
+      const unsigned char* prev = y > 0 ? &raw[(y - 1) * row_len] : zeros.data();
+      unsigned char* o = &out[y * (row_len + 1)];
+
+      if (!adaptive) {
+        o[0] = FILTER_NONE;
+        memcpy(o + 1, row, row_len);
+        continue;
+      }
+
+      size_t best_sum = static_cast<size_t>(-1);
+      for (int f = FILTER_NONE; f < N_FILTERS; ++f) {
+        apply_filter(tmp.data(), static_cast<Filter>(f), row, prev, row_len, bpp);
+        size_t sum = abs_sum(tmp.data(), row_len);
+        if (sum < best_sum) {
+          best_sum = sum;
+          o[0] = static_cast<unsigned char>(f);
+          memcpy(o + 1, tmp.data(), row_len);
+        }
+      }
+    }
+  }
+}
+
+
+/*! Deflates `len` bytes of `data` at `offset` into raw deflate stream `out`.
+ * Up to 32 KiB preceding `offset` are used as a dictionary. The output of a
+ * non-last piece ends with a sync flush, so the pieces can be concatenated.
+ * \returns false on zlib error */
+bool
+deflate_piece(std::vector<unsigned char>& out, const unsigned char* data, size_t offset, size_t len,
+    bool last, int level, int strategy)
+{
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+
+  if (deflateInit2(&zs, level, Z_DEFLATED, -MAX_WBITS, 8, strategy) != Z_OK) {
+    return false;
+  }
+
+  bool success = true;
+  if (offset > 0 && level > 0) {
+    size_t dict_size = std::min(DICT_SIZE, offset);
+    success = deflateSetDictionary(&zs, data + offset - dict_size, static_cast<uInt>(dict_size)) == Z_OK;
+  }
+
+  out.resize(deflateBound(&zs, static_cast<uLong>(len)) + 16);
+  zs.next_in  = const_cast<Bytef*>(data + offset);
+  zs.avail_in = static_cast<uInt>(len);
+
+  int ret = Z_OK;
+  while (success) {
+    zs.next_out  = &out[zs.total_out];
+    zs.avail_out = static_cast<uInt>(out.size() - zs.total_out);
+
+    ret = deflate(&zs, last ? Z_FINISH : Z_SYNC_FLUSH);
+    if (ret == Z_STREAM_ERROR) {
+      success = false;
+    } else if (zs.avail_out != 0) {
+      break;
+    } else {
+      out.resize(out.size() * 2);
+    }
+  }
+  if (success && last && ret != Z_STREAM_END) {
+    success = false;
+  }
+
+  out.resize(zs.total_out);
+  deflateEnd(&zs);
+
+  return success;
+}
+
+} // anonymous namespace
+
+/////////////////////////////////////////////////////////////////////
+
+bool
+encode_png(std::vector<unsigned char>& buf, const cv::Mat& img, int level, int strategy)
+{
+  const int cn = img.channels();
+  const int depth = img.depth();
+
+  if ((depth != CV_8U && depth != CV_16U) || (cn != 1 && cn != 3 && cn != 4)
+      || img.empty() || level < 0 || level > 9)
+  {
+    return false;
+  }
+
+  const size_t bpp = cn * (depth == CV_8U ? 1 : 2);
+  const size_t row_len = img.cols * bpp;
+  const int rows = img.rows;
+
+  // Convert the samples and filter the rows
+  std::vector<unsigned char> raw(rows * row_len);
+#ifdef IMTOOLS_THREADS
+  _Pragma("omp parallel for schedule(static)")
+#endif
+  for (int y = 0; y < rows; ++y) {
+    convert_row(&raw[y * row_len], img, y);
+  }
+
+  std::vector<unsigned char> filtered;
+  filter_rows(filtered, raw, rows, row_len, bpp, level > 0);
+  std::vector<unsigned char>().swap(raw);
+
+  // Deflate the pieces concurrently
+  const size_t total = filtered.size();
+  const int n_pieces = static_cast<int>((total + PNG_CHUNK_SIZE - 1) / PNG_CHUNK_SIZE);
+  std::vector<std::vector<unsigned char> > pieces(n_pieces);
+  std::vector<uLong> adlers(n_pieces);
+  int n_failed = 0;
+
+#ifdef IMTOOLS_THREADS
+  _Pragma("omp parallel for schedule(dynamic, 1) reduction(+:n_failed)")
+#endif
+  for (int i = 0; i < n_pieces; ++i) {
+    size_t offset = i * PNG_CHUNK_SIZE;
+    size_t len = std::min(PNG_CHUNK_SIZE, total - offset);
+
+    if (!deflate_piece(pieces[i], filtered.data(), offset, len, i == n_pieces - 1, level, strategy)) {
+      ++n_failed;
+    }
+    adlers[i] = adler32(adler32(0L, Z_NULL, 0), &filtered[offset], static_cast<uInt>(len));
+  }
+  if (n_failed) {
+    warning_log("PNG: failed to deflate %d of %d pieces", n_failed, n_pieces);
+    return false;
+  }
+
+  // zlib stream: header, the pieces, and Adler-32 of the whole data
+  uLong adler = adler32(0L, Z_NULL, 0);
+  size_t stream_size = 2 + 4;
+  for (int i = 0; i < n_pieces; ++i) {
+    size_t len = std::min(PNG_CHUNK_SIZE, total - i * PNG_CHUNK_SIZE);
+    adler = adler32_combine(adler, adlers[i], static_cast<z_off_t>(len));
+    stream_size += pieces[i].size();
+  }
+
+  std::vector<unsigned char> stream;
+  stream.reserve(stream_size);
+
+  const unsigned cmf = 0x78; // deflate, 32 KiB window
+  unsigned flg = (level < 2 ? 0 : (level < 6 ? 1 : (level == 6 ? 2 : 3))) << 6;
+  if ((cmf * 256 + flg) % 31) {
+    flg += 31 - (cmf * 256 + flg) % 31;
+  }
+  stream.push_back(cmf);
+  stream.push_back(flg & 0xff);
+  for (auto& piece : pieces) {
+    stream.insert(stream.end(), piece.begin(), piece.end());
+    std::vector<unsigned char>().swap(piece);
+  }
+  unsigned char trailer[4];
+  put_be32(trailer, static_cast<uint32_t>(adler));
+  stream.insert(stream.end(), trailer, trailer + 4);
+
+  // PNG file
+  unsigned char ihdr[13];
+  put_be32(ihdr, img.cols);
+  put_be32(ihdr + 4, rows);
+  ihdr[8]  = depth == CV_8U ? 8 : 16;
+  ihdr[9]  = cn == 1 ? 0 : (cn == 3 ? 2 : 6); // grayscale, RGB, RGBA
+  ihdr[10] = 0; // deflate
+  ihdr[11] = 0; // adaptive filtering
+  ihdr[12] = 0; // no interlace
+
+  buf.clear();
+  buf.reserve(sizeof(PNG_SIGNATURE) + 25 + stream.size() + (stream.size() / MAX_IDAT_SIZE + 1) * 12 + 12);
+  buf.insert(buf.end(), PNG_SIGNATURE, PNG_SIGNATURE + sizeof(PNG_SIGNATURE));
+  append_chunk(buf, "IHDR", ihdr, sizeof(ihdr));
+  for (size_t offset = 0; offset < stream.size(); offset += MAX_IDAT_SIZE) {
+    append_chunk(buf, "IDAT", &stream[offset], std::min(MAX_IDAT_SIZE, stream.size() - offset));
+  }
+  append_chunk(buf, "IEND", nullptr, 0);
+
+  debug_log("PNG: %dx%d, %d pieces, %lu bytes", img.cols, rows, n_pieces,
+      static_cast<unsigned long>(buf.size()));
+
+  return true;
+}
+
+/////////////////////////////////////////////////////////////////////
+} // namespace imtools
+// vim: et ts=2 sts=2 sw=2
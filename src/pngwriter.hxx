@@ -0,0 +1,46 @@
+/* Copyright © 2014,2015 - Ruslan Osmanov <rrosmanov@gmail.com>
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#pragma once
+#ifndef IMTOOLS_PNGWRITER_HXX
+#define IMTOOLS_PNGWRITER_HXX
+
+#include <vector>
+#include <cstddef>
+#include <opencv2/core/core.hpp>
+
+namespace imtools {
+/////////////////////////////////////////////////////////////////////
+
+/// Size of the pieces of filtered image data deflated concurrently
+const size_t PNG_CHUNK_SIZE = 128 * 1024;
+
+/*! Encodes `img` to PNG. The rows are filtered concurrently, then the
+ * filtered data is split into pieces of `PNG_CHUNK_SIZE` bytes, which are
+ * deflated concurrently. Each piece is primed with the last 32 KiB of the
+ * preceding one as a dictionary, so the compression ratio stays close to the
+ * one of a single stream. The result is a standard PNG file.
+ *
+ * \param img 8 or 16-bit image with 1, 3 (BGR) or 4 (BGRA) channels
+ * \param level zlib compression level: 0 - none, 9 - full
+ * \param strategy zlib compression strategy (the same values as `cv::IMWRITE_PNG_STRATEGY_*`)
+ * \returns false, if the image type is not supported, or on zlib error
+ */
+bool encode_png(std::vector<unsigned char>& buf, const cv::Mat& img, int level, int strategy);
+
+/////////////////////////////////////////////////////////////////////
+} // namespace imtools
+#endif // IMTOOLS_PNGWRITER_HXX
+// vim: et ts=2 sts=2 sw=2
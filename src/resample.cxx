@@ -0,0 +1,522 @@
+/* Copyright © 2014,2015 - Ruslan Osmanov <rrosmanov@gmail.com>
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include "resample.hxx"
+
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <vector>
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+# include <immintrin.h>
+#endif
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "log.hxx"
+#include "exceptions.hxx"
+#include "threads.hxx"
+
+namespace imtools {
+/////////////////////////////////////////////////////////////////////
+
+/// Filter coefficients for one axis
+struct ResampleCoeffs {
+  /// Max. number of taps
+  int ksize;
+  /// First source index and number of taps for each output index
+  std::vector<int> bounds;
+  /// `ksize` weights for each output index
+  std::vector<int16_t> weights;
+};
+
+namespace {
+
+/// Number of fractional bits of the fixed-point weights
+const int PRECISION_BITS = 14;
+const int32_t ROUNDING = 1 << (PRECISION_BITS - 1);
+const double PI = 3.14159265358979323846;
+
+typedef ResampleCoeffs Coeffs;
+typedef std::shared_ptr<const Coeffs> CoeffsPtr;
+
+
+inline double
+sinc(double x)
+{
+  if (x == 0.0) {
+    return 1.0;
+  }
+  x *= PI;
+  return std::sin(x) / x;
+}
+
+
+inline double
+filter_linear(double x)
+{
+  x = std::fabs(x);
+  return x < 1.0 ? 1.0 - x : 0.0;
+}
+
+
+/// Cubic convolution with a = -0.75 as in `cv::resize()`
+inline double
+filter_cubic(double x)
+{
+  const double a = -0.75;
+
+  x = std::fabs(x);
+  if (x < 1.0) {
+    return ((a + 2.0) * x - (a + 3.0)) * x * x + 1.0;
+  }
+  if (x < 2.0) {
+    return (((x - 5.0) * x + 8.0) * x - 4.0) * a;
+  }
+  return 0.0;
+}
+
+
+inline double
+filter_lanczos4(double x)
+{
+  return (x > -4.0 && x < 4.0) ? sinc(x) * sinc(x / 4.0) : 0.0;
+}
+
+
+/// Box filter. Stretched on downscale, it averages the covered pixels like `cv::INTER_AREA`.
+inline double
+filter_box(double x)
+{
+  x = std::fabs(x);
+  return x < 0.5 ? 1.0 : (x == 0.5 ? 0.5 : 0.0);
+}
+
+
+inline uint8_t
+clip8(int32_t v)
+{
+  return v < 0 ? 0 : (v > 255 ? 255 : static_cast<uint8_t>(v));
+}
+
+
+/// \returns two 16-bit weights packed for `madd` instructions
+inline int32_t
+weight_pair(int16_t a, int16_t b)
+{
+  return static_cast<int32_t>(static_cast<uint16_t>(a) | (static_cast<uint32_t>(static_cast<uint16_t>(b)) << 16));
+}
+
+
+CoeffsPtr
+compute_coeffs(int src_len, int dst_len, int interpolation)
+{
+  double (*filter)(double);
+  double support;
+
+  switch (interpolation) {
+    case cv::INTER_LINEAR:   filter = filter_linear;   support = 1.0; break;
+    case cv::INTER_CUBIC:    filter = filter_cubic;    support = 2.0; break;
+    case cv::INTER_LANCZOS4: filter = filter_lanczos4; support = 4.0; break;
+    case cv::INTER_AREA:     filter = filter_box;      support = 0.5; break;
+    default: throw ErrorException("Unsupported interpolation: %d", interpolation);
+  }
+
+  // Stretch the filter on downscale in order to cover all source pixels
+  const double scale = static_cast<double>(src_len) / dst_len;
+  const double filter_scale = scale > 1.0 ? scale : 1.0;
+  support *= filter_scale;
+
+  auto coeffs = std::make_shared<Coeffs>();
+  const int ksize = std::min(static_cast<int>(std::ceil(support)) * 2 + 1, src_len);
+  coeffs->ksize = ksize;
+  coeffs->bounds.resize(dst_len * 2);
+  coeffs->weights.assign(static_cast<size_t>(dst_len) * ksize, 0);
+
+  std::vector<double> w(ksize);
+
+  for (int x = 0; x < dst_len; ++x) {
+    const double center = (x + 0.5) * scale;
+    const int xmin = std::max(static_cast<int>(center - support + 0.5), 0);
+    const int xmax = std::min(static_cast<int>(center + support + 0.5), src_len);
+    const int count = std::max(std::min(xmax - xmin, ksize), 1);
+
+    double sum = 0.0;
+    for (int k = 0; k < count; ++k) {
+      w[k] = filter((xmin + k - center + 0.5) / filter_scale);
+      sum += w[k];
+    }
+    if (sum == 0.0) {
+      std::fill(w.begin(), w.begin() + count, 0.0);
+      w[0] = sum = 1.0;
+    }
+
+    // Make the sum exact, so that flat areas are preserved
+    int16_t* iw = &coeffs->weights[static_cast<size_t>(x) * ksize];
+    int32_t isum = 0;
+    int kmax = 0;
+    for (int k = 0; k < count; ++k) {
+      iw[k] = static_cast<int16_t>(std::lround(w[k] / sum * (1 << PRECISION_BITS)));
+      isum += iw[k];
+      if (iw[k] > iw[kmax]) {
+        kmax = k;
+      }
+    }
+    iw[kmax] += (1 << PRECISION_BITS) - isum;
+
+    coeffs->bounds[2 * x]     = xmin;
+    coeffs->bounds[2 * x + 1] = count;
+  }
+
+  return coeffs;
+}
+
+
+/// \returns cached coefficients for the axis
+CoeffsPtr
+get_coeffs(int src_len, int dst_len, int interpolation)
+{
+  static std::mutex lock;
+  static std::map<std::tuple<int, int, int>, CoeffsPtr> cache;
+
+  std::lock_guard<std::mutex> guard(lock);
+
+  auto key = std::make_tuple(src_len, dst_len, interpolation);
+  auto it = cache.find(key);
+  if (it != cache.end()) {
+    return it->second;
+  }
+
+  if (cache.size() >= static_cast<size_t>(MAX_CACHED_COEFFS)) {
+    cache.clear();
+  }
+  CoeffsPtr coeffs = compute_coeffs(src_len, dst_len, interpolation);
+  cache.emplace(key, coeffs);
+
+  return coeffs;
+}
+
+
+#ifdef __SSE2__
+/// Loads a pixel of `cn` (<= 4) channels into the low 32 bits
+inline __m128i
+load_pixel(const uint8_t* p, int cn)
+{
+  int32_t v = 0;
+  memcpy(&v, p, cn);
+  return _mm_cvtsi32_si128(v);
+}
+#endif
+
+
+/// Resamples rows [y0, y1) of `src` horizontally into rows [0, y1 - y0) of `dst`
+void
+resample_horizontal(uint8_t* dst, size_t dst_step, const uint8_t* src, size_t src_step,
+    int y0, int y1, int dst_width, int cn, const Coeffs& coeffs)
+{
+  const int ksize = coeffs.ksize;
+
+#ifdef IMTOOLS_THREADS
+  _Pragma("omp parallel for")
+#endif
+  for (int y = y0; y < y1; ++y) {
+    const uint8_t* s = src + y * src_step;
+    uint8_t* d = dst + (y - y0) * dst_step;
+
+    for (int x = 0; x < dst_width; ++x) {
+      const int count = coeffs.bounds[2 * x + 1];
+      const int16_t* w = &coeffs.weights[static_cast<size_t>(x) * ksize];
+      const uint8_t* p = s + coeffs.bounds[2 * x] * cn;
+
+#ifdef __SSE2__
+      if (cn == 3 || cn == 4) {
+        // All channels of a pixel at once, two taps per `madd`
+        const __m128i zero = _mm_setzero_si128();
+        __m128i acc = _mm_set1_epi32(ROUNDING);
+        int k = 0;
+
+        for (; k + 1 < count; k += 2) {
+          __m128i p0 = _mm_unpacklo_epi8(load_pixel(p + k * cn, cn), zero);
+          __m128i p1 = _mm_unpacklo_epi8(load_pixel(p + (k + 1) * cn, cn), zero);
+          __m128i ww = _mm_set1_epi32(weight_pair(w[k], w[k + 1]));
+          acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpacklo_epi16(p0, p1), ww));
+        }
+        if (k < count) {
+          __m128i p0 = _mm_unpacklo_epi8(load_pixel(p + k * cn, cn), zero);
+          __m128i ww = _mm_set1_epi32(weight_pair(w[k], 0));
+          acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpacklo_epi16(p0, zero), ww));
+        }
+
+        acc = _mm_srai_epi32(acc, PRECISION_BITS);
+        acc = _mm_packs_epi32(acc, acc);
+        acc = _mm_packus_epi16(acc, acc);
+        int32_t v = _mm_cvtsi128_si32(acc);
+        memcpy(d + x * cn, &v, cn);
+        continue;
+      }
+#endif
+
+      for (int c = 0; c < cn; ++c) {
+        int32_t acc = ROUNDING;
+        for (int k = 0; k < count; ++k) {
+          acc += p[k * cn + c] * w[k];
+        }
+        d[x * cn + c] = clip8(acc >> PRECISION_BITS);
+      }
+    }
+  }
+}
+
+
+/*! Resamples `src` vertically into rows [y0, y1) of `dst`
+ * \param y_offset Index of the source row stored in the first row of `src`
+ * \param row_len Number of bytes in a row
+ */
+void
+resample_vertical(uint8_t* dst, size_t dst_step, const uint8_t* src, size_t src_step,
+    int y_offset, int y0, int y1, int row_len, const Coeffs& coeffs)
+{
+  const int ksize = coeffs.ksize;
+
+#ifdef IMTOOLS_THREADS
+  _Pragma("omp parallel for")
+#endif
+  for (int y = y0; y < y1; ++y) {
+    const int count = coeffs.bounds[2 * y + 1];
+    const int16_t* w = &coeffs.weights[static_cast<size_t>(y) * ksize];
+    const uint8_t* s = src + (coeffs.bounds[2 * y] - y_offset) * src_step;
+    uint8_t* d = dst + y * dst_step;
+    int i = 0;
+
+    // Two rows per `madd`. Unpacking and packing work within 128-bit lanes
+    // in the same way, so the order of bytes is preserved.
+#ifdef __AVX2__
+    for (; i + 32 <= row_len; i += 32) {
+      const __m256i zero = _mm256_setzero_si256();
+      __m256i acc0 = _mm256_set1_epi32(ROUNDING);
+      __m256i acc1 = acc0, acc2 = acc0, acc3 = acc0;
+
+      for (int k = 0; k < count; k += 2) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + k * src_step + i));
+        __m256i b = k + 1 < count
+          ? _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + (k + 1) * src_step + i))
+          : zero;
+        __m256i ww = _mm256_set1_epi32(weight_pair(w[k], k + 1 < count ? w[k + 1] : 0));
+        __m256i lo = _mm256_unpacklo_epi8(a, b);
+        __m256i hi = _mm256_unpackhi_epi8(a, b);
+        acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(_mm256_unpacklo_epi8(lo, zero), ww));
+        acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(_mm256_unpackhi_epi8(lo, zero), ww));
+        acc2 = _mm256_add_epi32(acc2, _mm256_madd_epi16(_mm256_unpacklo_epi8(hi, zero), ww));
+        acc3 = _mm256_add_epi32(acc3, _mm256_madd_epi16(_mm256_unpackhi_epi8(hi, zero), ww));
+      }
+
+      __m256i p01 = _mm256_packs_epi32(_mm256_srai_epi32(acc0, PRECISION_BITS),
+          _mm256_srai_epi32(acc1, PRECISION_BITS));
+      __m256i p23 = _mm256_packs_epi32(_mm256_srai_epi32(acc2, PRECISION_BITS),
+          _mm256_srai_epi32(acc3, PRECISION_BITS));
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(d + i), _mm256_packus_epi16(p01, p23));
+    }
+#endif
+
+#ifdef __SSE2__
+    for (; i + 16 <= row_len; i += 16) {
+      const __m128i zero = _mm_setzero_si128();
+      __m128i acc0 = _mm_set1_epi32(ROUNDING);
+      __m128i acc1 = acc0, acc2 = acc0, acc3 = acc0;
+
+      for (int k = 0; k < count; k += 2) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + k * src_step + i));
+        __m128i b = k + 1 < count
+          ? _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + (k + 1) * src_step + i))
+          : zero;
+        __m128i ww = _mm_set1_epi32(weight_pair(w[k], k + 1 < count ? w[k + 1] : 0));
+        __m128i lo = _mm_unpacklo_epi8(a, b);
+        __m128i hi = _mm_unpackhi_epi8(a, b);
+        acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi8(lo, zero), ww));
+        acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi8(lo, zero), ww));
+        acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(_mm_unpacklo_epi8(hi, zero), ww));
+        acc3 = _mm_add_epi32(acc3, _mm_madd_epi16(_mm_unpackhi_epi8(hi, zero), ww));
+      }
+
+      __m128i p01 = _mm_packs_epi32(_mm_srai_epi32(acc0, PRECISION_BITS),
+          _mm_srai_epi32(acc1, PRECISION_BITS));
+      __m128i p23 = _mm_packs_epi32(_mm_srai_epi32(acc2, PRECISION_BITS),
+          _mm_srai_epi32(acc3, PRECISION_BITS));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(d + i), _mm_packus_epi16(p01, p23));
+    }
+#endif
+
+    for (; i < row_len; ++i) {
+      int32_t acc = ROUNDING;
+      for (int k = 0; k < count; ++k) {
+        acc += s[k * src_step + i] * w[k];
+      }
+      d[i] = clip8(acc >> PRECISION_BITS);
+    }
+  }
+}
+
+} // anonymous namespace
+
+/////////////////////////////////////////////////////////////////////
+
+bool
+resample_supported(int type, int interpolation) noexcept
+{
+  return (type == CV_8UC1 || type == CV_8UC3 || type == CV_8UC4)
+    && (interpolation == cv::INTER_LINEAR
+        || interpolation == cv::INTER_CUBIC
+        || interpolation == cv::INTER_LANCZOS4);
+}
+
+
+void
+resample(cv::Mat& dst, const cv::Mat& src, const cv::Size& size, int interpolation)
+{
+  if (!resample_supported(src.type(), interpolation)) {
+    throw ErrorException("resample: unsupported image type %d or interpolation %d",
+        src.type(), interpolation);
+  }
+  if (src.empty() || size.width <= 0 || size.height <= 0) {
+    throw ErrorException("resample: invalid size %dx%d", size.width, size.height);
+  }
+
+  const int cn = src.channels();
+  CoeffsPtr cy = get_coeffs(src.rows, size.height, interpolation);
+
+  // Source rows needed for the vertical pass
+  const int last = size.height - 1;
+  const int y0 = cy->bounds[0];
+  const int y1 = cy->bounds[2 * last] + cy->bounds[2 * last + 1];
+
+  cv::Mat tmp;
+  if (size.width == src.cols) {
+    tmp = src.rowRange(y0, y1);
+  } else {
+    CoeffsPtr cx = get_coeffs(src.cols, size.width, interpolation);
+    tmp.create(y1 - y0, size.width, src.type());
+    resample_horizontal(tmp.data, tmp.step, src.data, src.step, y0, y1, size.width, cn, *cx);
+  }
+
+  if (size.height == src.rows) {
+    dst = size.width == src.cols ? src.clone() : tmp;
+    return;
+  }
+
+  cv::Mat out(size, src.type());
+  resample_vertical(out.data, out.step, tmp.data, tmp.step, y0, 0, size.height, size.width * cn, *cy);
+  dst = out;
+}
+
+/////////////////////////////////////////////////////////////////////
+
+StreamResampler::StreamResampler(const cv::Size& src_size, int type, const cv::Size& size, int interpolation)
+  : m_src_size(src_size),
+  m_cn(CV_MAT_CN(type))
+{
+  if (!supported(type, interpolation)) {
+    throw ErrorException("StreamResampler: unsupported image type %d or interpolation %d",
+        type, interpolation);
+  }
+  if (size.width <= 0 || size.height <= 0 || size.width > src_size.width || size.height > src_size.height) {
+    throw ErrorException("StreamResampler: invalid size %dx%d", size.width, size.height);
+  }
+
+  if (size.width != src_size.width) {
+    m_cx = get_coeffs(src_size.width, size.width, interpolation);
+  }
+  m_cy = get_coeffs(src_size.height, size.height, interpolation);
+
+  // The window of the next output row is always below `m_cy->ksize` rows.
+  // The rest of the buffer is filled by one push.
+  m_rows.create(m_cy->ksize * 2, size.width, type);
+  m_dst.create(size, type);
+}
+
+
+bool
+StreamResampler::supported(int type, int interpolation) noexcept
+{
+  return resample_supported(type, interpolation) || (interpolation == cv::INTER_AREA
+      && (type == CV_8UC1 || type == CV_8UC3 || type == CV_8UC4));
+}
+
+
+void
+StreamResampler::push(const cv::Mat& rows)
+{
+  const Coeffs& cy = *m_cy;
+  const int dst_height = m_dst.rows;
+  const int last = dst_height - 1;
+  // Source rows covered by the vertical filter
+  const int src_end = cy.bounds[2 * last] + cy.bounds[2 * last + 1];
+
+  for (int i = 0; i < rows.rows;) {
+    // Drop the rows preceding the window of the next output row
+    const int first = m_next_dst < dst_height ? cy.bounds[2 * m_next_dst] : m_next_src;
+    const int drop = std::min(std::max(first - m_first, 0), m_count);
+    if (drop > 0) {
+      m_count -= drop;
+      m_first += drop;
+      if (m_count > 0) {
+        memmove(m_rows.ptr(0), m_rows.ptr(drop), m_count * m_rows.step);
+      }
+    }
+
+    // Rows outside of the filter windows are skipped
+    const int n = std::min(rows.rows - i, m_rows.rows - m_count);
+    const int begin = std::max(m_next_src, std::min(first, src_end));
+    const int end = std::min(m_next_src + n, src_end);
+    if (m_count == 0) {
+      m_first = begin;
+    }
+    if (begin < end) {
+      const int y0 = i + begin - m_next_src;
+      const int y1 = i + end - m_next_src;
+      if (m_cx) {
+        resample_horizontal(m_rows.ptr(m_count), m_rows.step, rows.data, rows.step,
+            y0, y1, m_rows.cols, m_cn, *m_cx);
+      } else {
+        cv::Mat part(m_rows.rowRange(m_count, m_count + y1 - y0));
+        rows.rowRange(y0, y1).copyTo(part);
+      }
+      m_count += y1 - y0;
+    }
+    m_next_src += n;
+    i += n;
+
+    // Output rows having complete windows
+    int y = m_next_dst;
+    while (y < dst_height && cy.bounds[2 * y] + cy.bounds[2 * y + 1] <= m_first + m_count) {
+      ++y;
+    }
+    if (y > m_next_dst) {
+      resample_vertical(m_dst.data, m_dst.step, m_rows.data, m_rows.step, m_first,
+          m_next_dst, y, m_dst.cols * m_cn, cy);
+      m_next_dst = y;
+    }
+  }
+}
+
+/////////////////////////////////////////////////////////////////////
+} // namespace imtools
+// vim: et ts=2 sts=2 sw=2
@@ -0,0 +1,97 @@
+/* Copyright © 2014,2015 - Ruslan Osmanov <rrosmanov@gmail.com>
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#pragma once
+#ifndef IMTOOLS_RESAMPLE_HXX
+#define IMTOOLS_RESAMPLE_HXX
+
+#include <memory>
+#include <opencv2/core/core.hpp>
+
+namespace imtools {
+/////////////////////////////////////////////////////////////////////
+
+/// Max. number of cached filter coefficient tables
+const int MAX_CACHED_COEFFS = 64;
+
+/// \returns whether `resample()` supports images of `type` with `interpolation` method
+bool resample_supported(int type, int interpolation) noexcept;
+
+/*! Resizes `src` into `dst` of `size` by means of separable horizontal and
+ * vertical passes with fixed-point arithmetic. Unlike `cv::resize()`, the
+ * filter support grows with the scale factor on downscale, so the result is
+ * antialiased. The filter coefficients are cached per (source length, output
+ * length, interpolation).
+ *
+ * \param interpolation One of `cv::INTER_LINEAR`, `cv::INTER_CUBIC`, `cv::INTER_LANCZOS4`
+ * \throws ErrorException, if the image type or interpolation is not supported
+ */
+void resample(cv::Mat& dst, const cv::Mat& src, const cv::Size& size, int interpolation);
+
+
+struct ResampleCoeffs;
+
+/////////////////////////////////////////////////////////////////////
+/// Downscales an image fed by strips of rows, e.g. while it is being decoded.
+/// Each strip is resampled horizontally at once, and only the rows within the
+/// vertical filter window are kept. So the memory usage is about
+/// `output width * number of vertical taps` in addition to the output image.
+class StreamResampler
+{
+  public:
+    /*!
+     * \param src_size Size of the entire source image
+     * \param type Type of the source image: `CV_8UC1`, `CV_8UC3` or `CV_8UC4`
+     * \param size Size of the output not exceeding `src_size`
+     * \param interpolation Same as in `resample()`, or `cv::INTER_AREA`
+     * \throws ErrorException
+     */
+    StreamResampler(const cv::Size& src_size, int type, const cv::Size& size, int interpolation);
+
+    StreamResampler(const StreamResampler&) = delete;
+    StreamResampler& operator=(const StreamResampler&) = delete;
+
+    /// \returns whether images of `type` can be resampled with `interpolation`
+    static bool supported(int type, int interpolation) noexcept;
+
+    /// Feeds the next `rows` of the source
+    void push(const cv::Mat& rows);
+
+    /// \returns whether all of the output rows are made
+    inline bool done() const noexcept { return m_next_dst == m_dst.rows; }
+
+    /// \returns the output image (complete, if `done()`)
+    inline const cv::Mat& getResult() const noexcept { return m_dst; }
+
+  private:
+    cv::Size m_src_size;
+    int m_cn;
+    std::shared_ptr<const ResampleCoeffs> m_cx;
+    std::shared_ptr<const ResampleCoeffs> m_cy;
+    /// Horizontally resampled source rows [m_first, m_first + m_count)
+    cv::Mat m_rows;
+    int m_first = 0;
+    int m_count = 0;
+    /// Index of the next source row
+    int m_next_src = 0;
+    /// Index of the next output row
+    int m_next_dst = 0;
+    cv::Mat m_dst;
+};
+
+/////////////////////////////////////////////////////////////////////
+} // namespace imtools
+#endif // IMTOOLS_RESAMPLE_HXX
+// vim: et ts=2 sts=2 sw=2
@@ -0,0 +1,102 @@
+/* Copyright © 2014,2015 - Ruslan Osmanov <rrosmanov@gmail.com>
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#include "rowreader.hxx"
+
+#include <cstring>
+
+#include "exceptions.hxx"
+
+namespace imtools {
+/////////////////////////////////////////////////////////////////////
+
+namespace {
+
+/// Yields a region of the rows of another reader
+class CroppedRowReader : public RowReader
+{
+  public:
+    CroppedRowReader(RowReaderPtr reader, const cv::Rect& roi)
+      : m_reader(std::move(reader)),
+      m_roi(roi),
+      m_row(1, m_reader->getSize().width, m_reader->getType())
+    {
+      m_size = roi.size();
+      m_type = m_reader->getType();
+    }
+
+    virtual int read(cv::Mat& rows) override
+    {
+      const size_t offset = static_cast<size_t>(m_roi.x) * m_row.elemSize();
+      const size_t len = static_cast<size_t>(m_roi.width) * m_row.elemSize();
+      int n = 0;
+
+      for (; n < rows.rows && m_y < m_roi.y + m_roi.height; ++m_y) {
+        if (m_reader->read(m_row) != 1) {
+          throw ErrorException("Unexpected end of image at row %d", m_y);
+        }
+        if (m_y >= m_roi.y) {
+          memcpy(rows.ptr(n++), m_row.ptr(0) + offset, len);
+        }
+      }
+
+      return n;
+    }
+
+  private:
+    RowReaderPtr m_reader;
+    cv::Rect m_roi;
+    /// Row of the source
+    cv::Mat m_row;
+    /// Index of the next row of the source
+    int m_y = 0;
+};
+
+} // anonymous namespace
+
+/////////////////////////////////////////////////////////////////////
+
+RowReaderPtr
+crop_rows(RowReaderPtr reader, const cv::Rect& roi)
+{
+  const cv::Size& size = reader->getSize();
+
+  if (roi == cv::Rect(0, 0, size.width, size.height)) {
+    return reader;
+  }
+  if ((roi & cv::Rect(0, 0, size.width, size.height)) != roi || roi.area() == 0) {
+    throw ErrorException("Region %dx%d+%d+%d is out of the %dx%d image",
+        roi.width, roi.height, roi.x, roi.y, size.width, size.height);
+  }
+
+  return RowReaderPtr(new CroppedRowReader(std::move(reader), roi));
+}
+
+
+cv::Mat
+read_rows(RowReader& reader)
+{
+  cv::Mat img(reader.getSize(), reader.getType());
+
+  if (reader.read(img) != img.rows) {
+    throw ErrorException("Unexpected end of image");
+  }
+
+  return img;
+}
+
+/////////////////////////////////////////////////////////////////////
+} // namespace imtools
+// vim: et ts=2 sts=2 sw=2
@@ -0,0 +1,67 @@
+/* Copyright © 2014,2015 - Ruslan Osmanov <rrosmanov@gmail.com>
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#pragma once
+#ifndef IMTOOLS_ROWREADER_HXX
+#define IMTOOLS_ROWREADER_HXX
+
+#include <memory>
+#include <opencv2/core/core.hpp>
+
+namespace imtools {
+/////////////////////////////////////////////////////////////////////
+
+/// Decoder of an image file yielding the rows one by one from top to bottom,
+/// so that the whole image is never kept in memory
+class RowReader
+{
+  public:
+    virtual ~RowReader() {}
+
+    /// \returns size of the decoded image
+    inline const cv::Size& getSize() const noexcept { return m_size; }
+
+    /// \returns type of the decoded rows: `CV_8UC1` (gray), or `CV_8UC3` (BGR)
+    inline int getType() const noexcept { return m_type; }
+
+    /*! Decodes the next rows into `rows` (of `getType()` and `getSize().width`).
+     * \returns number of the rows decoded: `rows.rows`, or less at the end of the image
+     * \throws ErrorException
+     */
+    virtual int read(cv::Mat& rows) = 0;
+
+  protected:
+    cv::Size m_size;
+    int m_type = CV_8UC3;
+};
+
+typedef std::unique_ptr<RowReader> RowReaderPtr;
+
+/*! \returns reader yielding region `roi` of the rows of `reader`. The rows
+ * above and below the region are still decoded, but not kept.
+ * \throws ErrorException, if `roi` is out of the image
+ */
+RowReaderPtr crop_rows(RowReaderPtr reader, const cv::Rect& roi);
+
+/*! Reads the rest of the rows of `reader`
+ * \returns image of `reader.getSize()`
+ * \throws ErrorException
+ */
+cv::Mat read_rows(RowReader& reader);
+
+/////////////////////////////////////////////////////////////////////
+} // namespace imtools
+#endif // IMTOOLS_ROWREADER_HXX
+// vim: et ts=2 sts=2 sw=2
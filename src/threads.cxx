@@ -15,6 +15,7 @@
  */
 
 #include "threads.hxx"
+#include <atomic>
 
 #ifdef IMTOOLS_THREADS
 namespace imtools { namespace threads
@@ -22,6 +23,15 @@ namespace imtools { namespace threads
 
 it_lock_t io_lock;
 
+/// Initializes `io_lock` once per process
+static struct IoLockInit
+{
+  IoLockInit() noexcept { omp_init_lock(&io_lock); }
+} g_io_lock_init;
+
+/// Limit set by set_max_threads()
+static std::atomic<unsigned> g_max_threads{0};
+
 
 it_thread_id_t
 get_id() noexcept
@@ -30,10 +40,26 @@ get_id() noexcept
 }
 
 
+unsigned
+max_threads() noexcept
+{
+  unsigned num_threads = std::thread::hardware_concurrency();
+  unsigned limit = g_max_threads.load(std::memory_order_relaxed);
+
+  return (limit && (limit < num_threads || !num_threads)) ? limit : num_threads;
+}
+
+
+void
+set_max_threads(unsigned num_threads) noexcept
+{
+  g_max_threads.store(num_threads, std::memory_order_relaxed);
+}
+
+
 OmpGuard::OmpGuard(omp_lock_t& lock) noexcept
 : mLock(lock)
 {
-  omp_init_lock(&mLock);
   omp_set_lock(&mLock);
 }
 
@@ -41,7 +67,6 @@ OmpGuard::OmpGuard(omp_lock_t& lock) noexcept
 OmpGuard::~OmpGuard()
 {
   omp_unset_lock(&mLock);
-  omp_destroy_lock(&mLock);
 }
 
 }} // namespace imtools::threads
@@ -44,14 +44,15 @@ it_thread_id_t get_id() noexcept;
 
 /////////////////////////////////////////////////////////////////////
 
-/// Returns number of concurrent threads supported.
-inline unsigned
-max_threads()
-{
-  return std::thread::hardware_concurrency();
-}
+/// Returns number of concurrent threads supported, or the limit set by set_max_threads().
+unsigned max_threads() noexcept;
+
+/*! Limits the number of threads a command may use, e.g. when several commands
+ * run concurrently (0 - no limit) */
+void set_max_threads(unsigned num_threads) noexcept;
 
 /////////////////////////////////////////////////////////////////////
+/// Holds an initialized lock for the lifetime of the object
 class OmpGuard
 {
   public: